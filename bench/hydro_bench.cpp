@@ -0,0 +1,342 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../src/driver.hpp"
+#include "./synth.hpp"
+
+// Every heap allocation in the process goes through these, so each stage
+// can report how many it made. The benchmark is single-threaded. They are
+// kept out of line: inlined into the standard containers, GCC would pair
+// malloc/free with new/delete and warn about a mismatch.
+namespace
+{
+    size_t g_allocs = 0;
+    size_t g_alloc_bytes = 0;
+} // namespace
+
+__attribute__((noinline)) void *operator new(const size_t size)
+{
+    g_allocs++;
+    g_alloc_bytes += size;
+
+    if (void *p = std::malloc(size == 0 ? 1 : size))
+    {
+        return p;
+    }
+
+    throw std::bad_alloc{};
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+struct StageResult
+{
+    std::string stage;
+    double seconds = 0;
+    size_t allocs = 0;
+    size_t alloc_bytes = 0;
+};
+
+struct SizeResult
+{
+    std::string size;
+    size_t bytes = 0;
+    size_t statements = 0;
+    std::vector<StageResult> stages{};
+};
+
+static size_t parse_size(const std::string &text)
+{
+    size_t value = std::strtoull(text.c_str(), nullptr, 10);
+
+    switch (text.empty() ? ' ' : text.back())
+    {
+    case 'G':
+        value <<= 10;
+        [[fallthrough]];
+    case 'M':
+        value <<= 10;
+        [[fallthrough]];
+    case 'K':
+        value <<= 10;
+        break;
+    default:
+        break;
+    }
+
+    return value;
+}
+
+template <typename F>
+static StageResult measure(const char *stage, F &&f)
+{
+    const size_t allocs = g_allocs;
+    const size_t alloc_bytes = g_alloc_bytes;
+    const auto start = std::chrono::steady_clock::now();
+
+    f();
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return {.stage = stage, .seconds = elapsed.count(), .allocs = g_allocs - allocs,
+            .alloc_bytes = g_alloc_bytes - alloc_bytes};
+}
+
+// One run over a synthetic program of about `bytes` bytes. The arena is
+// sized from the input, since the compiler's default only fits ordinary
+// programs.
+static SizeResult run_size(const std::string &label, const size_t bytes, const SynthParams &params)
+{
+    SynthProgram synth(params);
+    const std::string source = synth.generate(bytes);
+
+    SizeResult result{.size = label, .bytes = source.size(), .statements = synth.statements()};
+
+    ArenaAllocator arena(std::max<size_t>(arena_size, source.size() * 64));
+    std::vector<Token> tokens;
+    std::optional<NodeProg> prog;
+
+    result.stages.push_back(measure("tokenize", [&]
+                                    {
+                                        Tokenizer tokenizer(source);
+                                        tokens = tokenizer.tokenize(); }));
+
+    result.stages.push_back(measure("parse", [&]
+                                    {
+                                        Parser parser(std::move(tokens), arena);
+                                        prog = parser.parse_prog(); }));
+
+    result.stages.push_back(measure("optimize", [&]
+                                    {
+                                        Inliner inliner(prog.value(), arena);
+                                        inliner.run();
+                                        CommonSubexprEliminator cse(prog.value(), arena);
+                                        cse.run();
+                                        DeadStoreEliminator dse(prog.value());
+                                        dse.run(); }));
+
+    result.stages.push_back(measure("generate", [&]
+                                    {
+                                        FrameLayout layout(prog.value());
+                                        Generator generator(prog.value(), layout.layout_prog());
+                                        const std::string assembly = generator.gen_prog();
+                                        (void)assembly; }));
+
+    return result;
+}
+
+static double mb_per_s(const SizeResult &size, const StageResult &stage)
+{
+    return static_cast<double>(size.bytes) / (1024.0 * 1024.0) / std::max(stage.seconds, 1e-9);
+}
+
+// Baseline lines are `<size> <stage> <MB/s>`.
+static std::map<std::string, double> load_baseline(const std::string &path)
+{
+    std::map<std::string, double> baseline;
+    std::ifstream file(path);
+    std::string size;
+    std::string stage;
+    double value = 0;
+
+    while (file >> size >> stage >> value)
+    {
+        baseline[size + " " + stage] = value;
+    }
+
+    return baseline;
+}
+
+static void usage()
+{
+    std::cerr << "hydro_bench [--sizes 1K,64K,1M] [--repeat N] [--baseline <file>] [--tolerance <fraction>]\n"
+                 "            [--update-baseline] [--statements N] [--depth N] [--nesting N] [--vars N]\n"
+                 "            [--elif N] [--comments <fraction>] [--seed N] [--emit <file.hy>]"
+              << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> sizes{"1K", "64K", "1M"};
+    size_t repeat = 3;
+    std::optional<std::string> baseline_path;
+    double tolerance = 0.5;
+    bool update_baseline = false;
+    std::optional<std::string> emit_path;
+    SynthParams params;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+
+        if (arg == "--sizes" && has_value)
+        {
+            sizes.clear();
+            std::stringstream list(argv[++i]);
+
+            for (std::string size; std::getline(list, size, ',');)
+            {
+                sizes.push_back(size);
+            }
+        }
+        else if (arg == "--repeat" && has_value)
+        {
+            repeat = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--baseline" && has_value)
+        {
+            baseline_path = argv[++i];
+        }
+        else if (arg == "--tolerance" && has_value)
+        {
+            tolerance = std::strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--update-baseline")
+        {
+            update_baseline = true;
+        }
+        else if (arg == "--statements" && has_value)
+        {
+            params.statements = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--depth" && has_value)
+        {
+            params.expr_depth = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--nesting" && has_value)
+        {
+            params.scope_depth = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--vars" && has_value)
+        {
+            params.variables = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--elif" && has_value)
+        {
+            params.elif_chain = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--comments" && has_value)
+        {
+            params.comment_density = std::strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--seed" && has_value)
+        {
+            params.seed = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--emit" && has_value)
+        {
+            emit_path = argv[++i];
+        }
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    // `--emit` writes one program of `--statements` statements and exits.
+    if (emit_path.has_value())
+    {
+        SynthProgram synth(params);
+        std::ofstream file(emit_path.value());
+        file << synth.generate();
+
+        return EXIT_SUCCESS;
+    }
+
+    std::cout << std::left << std::setw(8) << "size" << std::setw(10) << "stage" << std::right << std::setw(12)
+              << "MB/s" << std::setw(14) << "stmts/s" << std::setw(12) << "allocs" << std::setw(14) << "alloc bytes"
+              << std::endl;
+
+    std::map<std::string, double> current;
+
+    for (const std::string &size : sizes)
+    {
+        // The fastest of `repeat` runs is the least disturbed by noise.
+        std::optional<SizeResult> best;
+
+        for (size_t r = 0; r < repeat; r++)
+        {
+            SizeResult result = run_size(size, parse_size(size), params);
+
+            if (!best.has_value())
+            {
+                best = std::move(result);
+                continue;
+            }
+
+            for (size_t s = 0; s < result.stages.size(); s++)
+            {
+                if (result.stages[s].seconds < best->stages[s].seconds)
+                {
+                    best->stages[s] = result.stages[s];
+                }
+            }
+        }
+
+        for (const StageResult &stage : best->stages)
+        {
+            const double mbps = mb_per_s(best.value(), stage);
+            const double stmts = static_cast<double>(best->statements) / std::max(stage.seconds, 1e-9);
+
+            std::cout << std::left << std::setw(8) << size << std::setw(10) << stage.stage << std::right << std::fixed
+                      << std::setprecision(2) << std::setw(12) << mbps << std::setprecision(0) << std::setw(14)
+                      << stmts << std::setw(12) << stage.allocs << std::setw(14) << stage.alloc_bytes << std::endl;
+
+            current[size + " " + stage.stage] = mbps;
+        }
+    }
+
+    if (!baseline_path.has_value())
+    {
+        return EXIT_SUCCESS;
+    }
+
+    const std::map<std::string, double> baseline = load_baseline(baseline_path.value());
+
+    if (baseline.empty() || update_baseline)
+    {
+        std::ofstream file(baseline_path.value());
+
+        for (const auto &[key, mbps] : current)
+        {
+            file << key << " " << mbps << "\n";
+        }
+
+        std::cout << "baseline written to " << baseline_path.value() << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    int status = EXIT_SUCCESS;
+
+    for (const auto &[key, mbps] : current)
+    {
+        const auto it = baseline.find(key);
+
+        if (it != baseline.end() && mbps < it->second * (1.0 - tolerance))
+        {
+            std::cout << "regression: " << key << " at " << mbps << " MB/s, baseline " << it->second << " MB/s"
+                      << std::endl;
+            status = EXIT_FAILURE;
+        }
+    }
+
+    return status;
+}
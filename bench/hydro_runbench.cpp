@@ -0,0 +1,440 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../src/driver.hpp"
+#include "./synth.hpp"
+
+// Measures the programs the compiler produces rather than the compiler:
+// each corpus program is compiled once and its binary run many times under
+// hardware counters. Where perf_event_open is not permitted, only wall
+// time and binary size are reported.
+
+struct Sample
+{
+    std::optional<uint64_t> instructions;
+    std::optional<uint64_t> cycles;
+    std::optional<uint64_t> branch_misses;
+    double wall_ms = 0;
+    int status = 0;
+};
+
+class Counter
+{
+public:
+    Counter(const pid_t pid, const uint64_t config)
+    {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.enable_on_exec = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        m_fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+    }
+
+    Counter(const Counter &) = delete;
+    Counter &operator=(const Counter &) = delete;
+
+    ~Counter()
+    {
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+    }
+
+    [[nodiscard]] std::optional<uint64_t> read_value() const
+    {
+        uint64_t value = 0;
+
+        if (m_fd < 0 || read(m_fd, &value, sizeof(value)) != sizeof(value))
+        {
+            return {};
+        }
+
+        return value;
+    }
+
+private:
+    int m_fd = -1;
+};
+
+// The child blocks on a pipe until its counters are attached, and they
+// only start at exec, so nothing of the harness itself is counted.
+static std::optional<Sample> run_once(const std::filesystem::path &exe)
+{
+    int gate[2];
+
+    if (pipe2(gate, O_CLOEXEC) != 0)
+    {
+        return {};
+    }
+
+    const pid_t pid = fork();
+
+    if (pid < 0)
+    {
+        return {};
+    }
+
+    if (pid == 0)
+    {
+        close(gate[1]);
+        char go = 0;
+
+        if (read(gate[0], &go, 1) != 1)
+        {
+            _exit(127);
+        }
+
+        const int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+
+        execl(exe.c_str(), exe.c_str(), nullptr);
+        _exit(127);
+    }
+
+    close(gate[0]);
+
+    const Counter instructions(pid, PERF_COUNT_HW_INSTRUCTIONS);
+    const Counter cycles(pid, PERF_COUNT_HW_CPU_CYCLES);
+    const Counter branch_misses(pid, PERF_COUNT_HW_BRANCH_MISSES);
+
+    const auto start = std::chrono::steady_clock::now();
+    const bool released = write(gate[1], "x", 1) == 1;
+    close(gate[1]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    if (!released || !WIFEXITED(status) || WEXITSTATUS(status) == 127)
+    {
+        return {};
+    }
+
+    return Sample{.instructions = instructions.read_value(), .cycles = cycles.read_value(),
+                  .branch_misses = branch_misses.read_value(), .wall_ms = elapsed.count(),
+                  .status = WEXITSTATUS(status)};
+}
+
+static double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    return values.empty() ? 0 : values[values.size() / 2];
+}
+
+// Metrics of one program, as `<metric> -> value`. Counter metrics are the
+// median over all runs; a missing counter is left out.
+static std::map<std::string, double> measure(const std::filesystem::path &exe, const size_t runs)
+{
+    std::map<std::string, std::vector<double>> values;
+
+    for (size_t i = 0; i < runs; i++)
+    {
+        const std::optional<Sample> sample = run_once(exe);
+
+        if (!sample.has_value())
+        {
+            return {};
+        }
+
+        values["wall_ms"].push_back(sample->wall_ms);
+
+        if (sample->instructions.has_value())
+        {
+            values["instructions"].push_back(static_cast<double>(sample->instructions.value()));
+        }
+
+        if (sample->cycles.has_value())
+        {
+            values["cycles"].push_back(static_cast<double>(sample->cycles.value()));
+        }
+
+        if (sample->branch_misses.has_value())
+        {
+            values["branch_misses"].push_back(static_cast<double>(sample->branch_misses.value()));
+        }
+    }
+
+    std::map<std::string, double> metrics;
+
+    for (const auto &[name, samples] : values)
+    {
+        metrics[name] = median(samples);
+    }
+
+    metrics["size"] = static_cast<double>(std::filesystem::file_size(exe));
+
+    return metrics;
+}
+
+struct Program
+{
+    std::string name;
+    std::optional<std::filesystem::path> path;
+    std::string source;
+};
+
+static std::vector<Program> corpus(const std::filesystem::path &samples)
+{
+    std::vector<Program> programs;
+
+    for (const auto &entry : std::filesystem::directory_iterator(samples))
+    {
+        if (entry.path().extension() == ".hy")
+        {
+            programs.push_back({.name = entry.path().stem().string(), .path = entry.path(), .source = ""});
+        }
+    }
+
+    std::sort(programs.begin(), programs.end(), [](const Program &a, const Program &b)
+              { return a.name < b.name; });
+
+    // Loop-heavy programs, where code quality dominates start-up cost.
+    for (const uint64_t seed : {1, 2, 3})
+    {
+        SynthParams params;
+        params.statements = 60;
+        params.variables = 8;
+        params.scope_depth = 1;
+        params.elif_chain = 1;
+        params.comment_density = 0;
+        params.loop_iterations = 2000000;
+        params.seed = seed;
+
+        SynthProgram synth(params);
+        programs.push_back({.name = "synth_loops_" + std::to_string(seed), .path = {}, .source = synth.generate()});
+    }
+
+    return programs;
+}
+
+static void usage()
+{
+    std::cerr << "hydro_runbench [--samples <dir>] [--runs N] [--baseline <file>] [--threshold <fraction>]\n"
+                 "               [--wall-threshold <fraction>] [--update-baseline] [--tiny]"
+              << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    std::filesystem::path samples = "samples";
+    size_t runs = 20;
+    std::optional<std::string> baseline_path;
+    double threshold = 0.05;
+    double wall_threshold = 0.5;
+    bool update_baseline = false;
+    bool tiny = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+
+        if (arg == "--samples" && has_value)
+        {
+            samples = argv[++i];
+        }
+        else if (arg == "--runs" && has_value)
+        {
+            runs = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--baseline" && has_value)
+        {
+            baseline_path = argv[++i];
+        }
+        else if (arg == "--threshold" && has_value)
+        {
+            threshold = std::strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--wall-threshold" && has_value)
+        {
+            wall_threshold = std::strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--update-baseline")
+        {
+            update_baseline = true;
+        }
+        else if (arg == "--tiny")
+        {
+            tiny = true;
+        }
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    char dir_template[] = "/tmp/hydro_runbench.XXXXXX";
+
+    if (mkdtemp(dir_template) == nullptr)
+    {
+        std::cerr << "Unable to create a work directory." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const std::filesystem::path work = dir_template;
+    ArenaAllocator arena(arena_size);
+    std::map<std::string, double> current;
+    bool counters = false;
+
+    std::cout << std::left << std::setw(24) << "program" << std::right << std::setw(14) << "instructions"
+              << std::setw(14) << "cycles" << std::setw(14) << "br misses" << std::setw(12) << "wall ms"
+              << std::setw(10) << "size" << std::endl;
+
+    for (const Program &program : corpus(samples))
+    {
+        Options options;
+        options.tiny = tiny;
+        std::optional<std::string> source;
+        std::filesystem::path input = "-";
+
+        if (program.path.has_value())
+        {
+            input = std::filesystem::absolute(program.path.value());
+        }
+        else
+        {
+            source = program.source;
+        }
+
+        std::stringstream out;
+        std::stringstream err;
+        Driver driver(arena, out, err);
+
+        if (driver.compile(options, input, program.name, work, source) != EXIT_SUCCESS)
+        {
+            std::cout << std::left << std::setw(24) << program.name << "skipped: " << err.str().substr(0, err.str().find('\n'))
+                      << std::endl;
+            continue;
+        }
+
+        const std::map<std::string, double> metrics = measure(work / program.name, runs);
+
+        if (metrics.empty())
+        {
+            std::cout << std::left << std::setw(24) << program.name << "skipped: could not run" << std::endl;
+            continue;
+        }
+
+        const auto cell = [&](const char *name, const int width)
+        {
+            const auto it = metrics.find(name);
+            std::cout << std::setw(width);
+
+            if (it == metrics.end())
+            {
+                std::cout << "-";
+            }
+            else
+            {
+                std::cout << it->second;
+            }
+        };
+
+        std::cout << std::left << std::setw(24) << program.name << std::right << std::fixed << std::setprecision(0);
+        cell("instructions", 14);
+        cell("cycles", 14);
+        cell("branch_misses", 14);
+        std::cout << std::setprecision(3);
+        cell("wall_ms", 12);
+        std::cout << std::setprecision(0);
+        cell("size", 10);
+        std::cout << std::endl;
+
+        counters = counters || metrics.contains("instructions");
+
+        for (const auto &[name, value] : metrics)
+        {
+            current[program.name + " " + name] = value;
+        }
+    }
+
+    std::filesystem::remove_all(work);
+
+    if (!counters)
+    {
+        std::cout << "hardware counters unavailable; falling back to wall time" << std::endl;
+    }
+
+    if (!baseline_path.has_value())
+    {
+        return EXIT_SUCCESS;
+    }
+
+    std::map<std::string, double> baseline;
+    {
+        std::ifstream file(baseline_path.value());
+        std::string program;
+        std::string metric;
+        double value = 0;
+
+        while (file >> program >> metric >> value)
+        {
+            baseline[program + " " + metric] = value;
+        }
+    }
+
+    if (baseline.empty() || update_baseline)
+    {
+        std::ofstream file(baseline_path.value());
+        file << std::fixed << std::setprecision(3);
+
+        for (const auto &[key, value] : current)
+        {
+            file << key << " " << value << "\n";
+        }
+
+        std::cout << "baseline written to " << baseline_path.value() << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    // Every metric is lower-is-better. Counters and size are stable enough
+    // for a tight threshold; wall time gets a loose one, and differences
+    // under a millisecond are start-up noise rather than code quality.
+    int status = EXIT_SUCCESS;
+    std::cout << std::defaultfloat << std::setprecision(6);
+
+    for (const auto &[key, value] : current)
+    {
+        const auto it = baseline.find(key);
+
+        if (it == baseline.end() || it->second <= 0)
+        {
+            continue;
+        }
+
+        const bool wall = key.ends_with(" wall_ms");
+        const double limit = wall ? wall_threshold : threshold;
+
+        if (value > it->second * (1.0 + limit) && (!wall || value - it->second > 1.0))
+        {
+            std::cout << "regression: " << key << " " << value << " vs baseline " << it->second << std::endl;
+            status = EXIT_FAILURE;
+        }
+    }
+
+    return status;
+}
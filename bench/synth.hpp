@@ -0,0 +1,244 @@
+#pragma once
+
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+// Shape of a synthetic program. Every knob is independent, so a benchmark
+// can stress one part of the compiler at a time.
+struct SynthParams
+{
+    size_t statements = 1000;
+    size_t expr_depth = 3;
+    size_t scope_depth = 2;
+    size_t variables = 16;
+    size_t elif_chain = 2;
+    // Chance of a comment before each statement.
+    double comment_density = 0.1;
+    // When non-zero, top-level statements may be counted `while` loops of
+    // this many iterations, which makes the program worth running.
+    size_t loop_iterations = 0;
+    uint64_t seed = 1;
+};
+
+// Deterministic generator of valid Hydrogen programs: the same parameters
+// always produce the same bytes. All variables are declared up front, so
+// any statement may use any of them, and names declared in nested scopes
+// are unique to avoid shadowing errors.
+class SynthProgram
+{
+public:
+    explicit SynthProgram(const SynthParams &params)
+        : m_params(params), m_state(params.seed * 0x9e3779b97f4a7c15 + 1)
+    {
+    }
+
+    // Emits `statements` statements, or stops early once `max_bytes` is
+    // reached when that is non-zero.
+    std::string generate(const size_t max_bytes = 0)
+    {
+        m_out.str("");
+        m_stmts = 0;
+
+        for (size_t i = 0; i < m_params.variables; i++)
+        {
+            m_out << "let v" << i << " = " << next(100) << ";\n";
+            m_stmts++;
+        }
+
+        while ((max_bytes == 0 && m_stmts < m_params.statements) ||
+               (max_bytes != 0 && static_cast<size_t>(m_out.tellp()) < max_bytes))
+        {
+            gen_stmt(0);
+        }
+
+        m_out << "exit(v0);\n";
+        m_stmts++;
+
+        return m_out.str();
+    }
+
+    [[nodiscard]] size_t statements() const
+    {
+        return m_stmts;
+    }
+
+private:
+    // xorshift64*, small and identical on every platform.
+    uint64_t next()
+    {
+        m_state ^= m_state >> 12;
+        m_state ^= m_state << 25;
+        m_state ^= m_state >> 27;
+
+        return m_state * 0x2545f4914f6cdd1d;
+    }
+
+    uint64_t next(const uint64_t bound)
+    {
+        return next() % bound;
+    }
+
+    bool chance(const double p)
+    {
+        return static_cast<double>(next() >> 11) / static_cast<double>(1ull << 53) < p;
+    }
+
+    void indent(const size_t depth)
+    {
+        m_out << std::string(depth * 4, ' ');
+    }
+
+    std::string var()
+    {
+        return "v" + std::to_string(next(m_params.variables));
+    }
+
+    void gen_expr(const size_t depth)
+    {
+        if (depth == 0 || chance(0.25))
+        {
+            if (chance(0.6))
+            {
+                m_out << var();
+            }
+            else
+            {
+                m_out << next(1000);
+            }
+
+            return;
+        }
+
+        static const char ops[] = {'+', '-', '*', '/'};
+        const char op = ops[next(4)];
+
+        m_out << "(";
+        gen_expr(depth - 1);
+        m_out << " " << op << " ";
+
+        // Only ever divide by a non-zero literal.
+        if (op == '/')
+        {
+            m_out << 1 + next(9);
+        }
+        else
+        {
+            gen_expr(depth - 1);
+        }
+
+        m_out << ")";
+    }
+
+    void gen_comment(const size_t depth)
+    {
+        indent(depth);
+
+        if (chance(0.5))
+        {
+            m_out << "// statement " << m_stmts << " of a synthetic program\n";
+        }
+        else
+        {
+            m_out << "/* generated\n";
+            indent(depth);
+            m_out << "   comment */\n";
+        }
+    }
+
+    // `tail` is emitted as the scope's last statement.
+    void gen_scope(const size_t depth, const std::string &tail = "")
+    {
+        m_out << "{\n";
+
+        const size_t count = 1 + next(4);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            gen_stmt(depth + 1);
+        }
+
+        if (!tail.empty())
+        {
+            indent(depth + 1);
+            m_out << tail << "\n";
+        }
+
+        indent(depth);
+        m_out << "}";
+    }
+
+    void gen_stmt(const size_t depth)
+    {
+        if (m_params.comment_density > 0 && chance(m_params.comment_density))
+        {
+            gen_comment(depth);
+        }
+
+        m_stmts++;
+        indent(depth);
+
+        const bool nest = depth < m_params.scope_depth;
+        const uint64_t kind = next(nest ? 10 : 6);
+
+        // Loops only appear at the top level, so their costs add up rather
+        // than multiply. The counter is never touched by the body.
+        if (depth == 0 && m_params.loop_iterations > 0 && chance(0.2))
+        {
+            const std::string counter = "c" + std::to_string(m_temps++);
+
+            m_out << "let " << counter << " = " << m_params.loop_iterations << ";\n";
+            m_out << "while (" << counter << ") ";
+            gen_scope(depth, counter + " = " + counter + " - 1;");
+            m_out << "\n";
+            return;
+        }
+
+        if (kind < 3)
+        {
+            m_out << var() << " = ";
+            gen_expr(m_params.expr_depth);
+            m_out << ";\n";
+        }
+        else if (kind < 6)
+        {
+            m_out << "let t" << m_temps++ << " = ";
+            gen_expr(m_params.expr_depth);
+            m_out << ";\n";
+        }
+        else if (kind < 9)
+        {
+            m_out << "if (";
+            gen_expr(m_params.expr_depth);
+            m_out << ") ";
+            gen_scope(depth);
+
+            for (size_t i = 0; i < m_params.elif_chain; i++)
+            {
+                m_out << " elif (";
+                gen_expr(m_params.expr_depth);
+                m_out << ") ";
+                gen_scope(depth);
+            }
+
+            if (chance(0.5))
+            {
+                m_out << " else ";
+                gen_scope(depth);
+            }
+
+            m_out << "\n";
+        }
+        else
+        {
+            gen_scope(depth);
+            m_out << "\n";
+        }
+    }
+
+    SynthParams m_params;
+    uint64_t m_state;
+    std::stringstream m_out;
+    size_t m_stmts = 0;
+    size_t m_temps = 0;
+};
@@ -1,15 +1,29 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <typeindex>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
+#include <cxxabi.h>
+
+// Bump allocator over one buffer of `max_num_bytes`. A compilation that
+// outgrows it continues in overflow blocks of at least the same size, which
+// `reset` frees again, so only the first buffer stays mapped between uses.
 class ArenaAllocator final
 {
 public:
     explicit ArenaAllocator(const size_t max_num_bytes)
-        : m_size{max_num_bytes}, m_buffer{new std::byte[max_num_bytes]}, m_offset{m_buffer}
+        : m_size{max_num_bytes}, m_buffer{new std::byte[max_num_bytes]}, m_offset{m_buffer},
+          m_block{m_buffer}, m_block_end{m_buffer + max_num_bytes}
     {
     }
 
@@ -17,7 +31,7 @@ public:
     ArenaAllocator &operator=(const ArenaAllocator &) = delete;
 
     ArenaAllocator(ArenaAllocator &&other) noexcept
-        : m_size{std::exchange(other.m_size, 0)}, m_buffer{std::exchange(other.m_buffer, nullptr)}, m_offset{std::exchange(other.m_offset, nullptr)}
+        : m_size{std::exchange(other.m_size, 0)}, m_buffer{std::exchange(other.m_buffer, nullptr)}, m_offset{std::exchange(other.m_offset, nullptr)}, m_block{std::exchange(other.m_block, nullptr)}, m_block_end{std::exchange(other.m_block_end, nullptr)}, m_overflow{std::move(other.m_overflow)}, m_overflow_used{std::exchange(other.m_overflow_used, 0)}, m_dtors{std::move(other.m_dtors)}, m_count_types{other.m_count_types}, m_type_counts{std::move(other.m_type_counts)}
     {
     }
 
@@ -26,6 +40,13 @@ public:
         std::swap(m_size, other.m_size);
         std::swap(m_buffer, other.m_buffer);
         std::swap(m_offset, other.m_offset);
+        std::swap(m_block, other.m_block);
+        std::swap(m_block_end, other.m_block_end);
+        std::swap(m_overflow, other.m_overflow);
+        std::swap(m_overflow_used, other.m_overflow_used);
+        std::swap(m_dtors, other.m_dtors);
+        std::swap(m_count_types, other.m_count_types);
+        std::swap(m_type_counts, other.m_type_counts);
         return *this;
     }
 
@@ -33,30 +54,132 @@ public:
     [[nodiscard]] T *emplace(Args &&...args)
     {
         const auto allocated_memory = alloc<T>();
-        return new (allocated_memory) T{std::forward<Args>(args)...};
+        T *object = new (allocated_memory) T{std::forward<Args>(args)...};
+
+        // Nodes holding vectors would otherwise leak their heap storage,
+        // which adds up once an arena is reused across compilations.
+        if constexpr (!std::is_trivially_destructible_v<T>)
+        {
+            m_dtors.push_back({object, [](void *p)
+                               { static_cast<T *>(p)->~T(); }});
+        }
+
+        if (m_count_types)
+        {
+            m_type_counts[typeid(T)]++;
+        }
+
+        return object;
+    }
+
+    // Counting costs a hash lookup per object, so it is off unless asked for.
+    void count_types(const bool enabled)
+    {
+        m_count_types = enabled;
+    }
+
+    // Live objects by type name, when counting is enabled.
+    [[nodiscard]] std::map<std::string, size_t> type_counts() const
+    {
+        std::map<std::string, size_t> counts;
+
+        for (const auto &[type, count] : m_type_counts)
+        {
+            int status = 0;
+            char *name = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+            counts[status == 0 ? name : type.name()] += count;
+            std::free(name);
+        }
+
+        return counts;
+    }
+
+    [[nodiscard]] size_t bytes_used() const
+    {
+        return m_overflow_used + static_cast<size_t>(m_offset - m_block);
+    }
+
+    // Destroys every object, frees the overflow blocks and rewinds, keeping
+    // the first buffer's pages mapped.
+    void reset()
+    {
+        destroy();
+        m_overflow.clear();
+        m_overflow_used = 0;
+        m_block = m_buffer;
+        m_block_end = m_buffer + m_size;
+        m_offset = m_buffer;
+        m_type_counts.clear();
+    }
+
+    // Touches every page up front so the first compilation does not pay for
+    // the page faults.
+    void prefault()
+    {
+        std::memset(m_buffer, 0, m_size);
     }
 
     ~ArenaAllocator()
     {
+        destroy();
         delete[] m_buffer;
     }
 
 private:
+    struct Dtor
+    {
+        void *object;
+        void (*destroy)(void *);
+    };
+
+    void destroy()
+    {
+        for (auto it = m_dtors.rbegin(); it != m_dtors.rend(); ++it)
+        {
+            it->destroy(it->object);
+        }
+
+        m_dtors.clear();
+    }
+
     template <typename T>
     [[nodiscard]] T *alloc()
     {
-        std::size_t remaining_num_bytes = m_size - static_cast<std::size_t>(m_offset - m_buffer);
+        std::size_t remaining_num_bytes = static_cast<std::size_t>(m_block_end - m_offset);
         auto pointer = static_cast<void *>(m_offset);
-        const auto aligned_address = std::align(alignof(T), sizeof(T), pointer, remaining_num_bytes);
+        auto aligned_address = std::align(alignof(T), sizeof(T), pointer, remaining_num_bytes);
         if (aligned_address == nullptr)
         {
-            throw std::bad_alloc{};
+            grow(sizeof(T) + alignof(T));
+            remaining_num_bytes = static_cast<std::size_t>(m_block_end - m_offset);
+            pointer = static_cast<void *>(m_offset);
+            aligned_address = std::align(alignof(T), sizeof(T), pointer, remaining_num_bytes);
         }
         m_offset = static_cast<std::byte *>(aligned_address) + sizeof(T);
         return static_cast<T *>(aligned_address);
     }
 
+    // Continues in a fresh block; what is left of the current one is unused.
+    void grow(const std::size_t min_num_bytes)
+    {
+        const std::size_t size = std::max(m_size, min_num_bytes);
+        m_overflow.emplace_back(new std::byte[size]);
+        m_overflow_used += static_cast<std::size_t>(m_offset - m_block);
+        m_block = m_overflow.back().get();
+        m_block_end = m_block + size;
+        m_offset = m_block;
+    }
+
     std::size_t m_size;
     std::byte *m_buffer;
     std::byte *m_offset;
+    // The block being allocated from: the first buffer or the last overflow.
+    std::byte *m_block;
+    std::byte *m_block_end;
+    std::vector<std::unique_ptr<std::byte[]>> m_overflow{};
+    // Bytes allocated in blocks before the current one.
+    std::size_t m_overflow_used = 0;
+    std::vector<Dtor> m_dtors{};
+    bool m_count_types = false;
+    std::unordered_map<std::type_index, size_t> m_type_counts{};
 };
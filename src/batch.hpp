@@ -0,0 +1,134 @@
+#pragma once
+
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include "./driver.hpp"
+#include "./pool.hpp"
+
+// Prints each compilation's timings and writes the JSON report when asked.
+inline void report_stats(const Options &options, const std::filesystem::path &cwd,
+                         const std::vector<CompileStats> &stats, std::ostream &out, std::ostream &err)
+{
+    if (options.time_passes)
+    {
+        for (const CompileStats &entry : stats)
+        {
+            entry.print(out);
+        }
+    }
+
+    if (options.stats_json.has_value())
+    {
+        const std::filesystem::path path = cwd / options.stats_json.value();
+        std::fstream file(path, std::ios::out);
+
+        if (!file)
+        {
+            err << "Unable to write " << path << "." << std::endl;
+            return;
+        }
+
+        file << "{\"version\": \"" << hydro_version() << "\", \"compilations\": [";
+
+        for (size_t i = 0; i < stats.size(); i++)
+        {
+            file << (i > 0 ? ", " : "");
+            stats[i].write_json(file);
+        }
+
+        file << "]}\n";
+    }
+}
+
+// Compiles every input of `options`. A single input goes to `-o` or `out`;
+// a batch writes each executable under its input's stem in `cwd` and runs
+// on a work-stealing pool with one arena per worker. Each compilation's
+// output is buffered and replayed in input order, so the result does not
+// depend on scheduling.
+inline int compile_all(const Options &options, const std::filesystem::path &cwd, ArenaAllocator &arena,
+                       std::ostream &out, std::ostream &err, std::optional<std::string> source = {})
+{
+    const bool want_stats = options.time_passes || options.stats_json.has_value();
+    std::vector<CompileStats> stats(want_stats ? options.inputs.size() : 0);
+
+    if (options.inputs.size() == 1)
+    {
+        Driver driver(arena, out, err);
+        const int status = driver.compile(options, options.inputs.front(), options.output.value_or("out"), cwd,
+                                          std::move(source), want_stats ? &stats.front() : nullptr);
+        report_stats(options, cwd, stats, out, err);
+
+        return status;
+    }
+
+    std::vector<std::filesystem::path> outputs;
+    std::set<std::filesystem::path> seen;
+
+    for (const std::filesystem::path &input : options.inputs)
+    {
+        outputs.push_back(input.stem());
+
+        if (!seen.insert(outputs.back()).second)
+        {
+            err << "Two inputs would both be written to " << outputs.back() << "." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct Result
+    {
+        std::stringstream out;
+        std::stringstream err;
+        int status = EXIT_FAILURE;
+    };
+
+    std::vector<Result> results(options.inputs.size());
+    WorkStealingPool pool(std::min(options.jobs, options.inputs.size()));
+
+    // The caller's arena serves worker 0; the others get their own.
+    std::vector<std::unique_ptr<ArenaAllocator>> arenas;
+
+    for (size_t i = 1; i < pool.size(); i++)
+    {
+        arenas.push_back(std::make_unique<ArenaAllocator>(arena_size));
+    }
+
+    for (size_t i = 0; i < options.inputs.size(); i++)
+    {
+        pool.submit([&, i](const size_t worker)
+                    {
+                        ArenaAllocator &own = worker == 0 ? arena : *arenas[worker - 1];
+                        Driver driver(own, results[i].out, results[i].err);
+                        results[i].status = driver.compile(options, options.inputs[i], outputs[i], cwd, {},
+                                                           want_stats ? &stats[i] : nullptr); });
+    }
+
+    pool.run();
+
+    int status = EXIT_SUCCESS;
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        out << results[i].out.str();
+
+        // Successful inputs print nothing, so each message names its input.
+        std::string line;
+
+        while (std::getline(results[i].err, line))
+        {
+            err << options.inputs[i].string() << ": " << line << std::endl;
+        }
+
+        if (results[i].status != EXIT_SUCCESS)
+        {
+            status = results[i].status;
+        }
+    }
+
+    report_stats(options, cwd, stats, out, err);
+
+    return status;
+}
@@ -0,0 +1,305 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+struct CacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t entries = 0;
+    uintmax_t bytes = 0;
+};
+
+// On-disk cache of linked executables and their objects, keyed by a hash of
+// the source bytes, the compiler's own executable and everything else that
+// affects the output. Each entry is a directory named after its key; its mtime is
+// bumped on every hit, and the least recently used entries are evicted once
+// the cache grows past its size limit.
+class CompileCache
+{
+public:
+    explicit CompileCache(std::filesystem::path dir, const uintmax_t max_bytes)
+        : m_dir(std::move(dir)), m_max_bytes(max_bytes)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(m_dir, ec);
+    }
+
+    static std::filesystem::path default_dir()
+    {
+        if (const char *dir = std::getenv("XDG_CACHE_HOME"); dir != nullptr && *dir != '\0')
+        {
+            return std::filesystem::path(dir) / "hydro";
+        }
+
+        if (const char *home = std::getenv("HOME"); home != nullptr && *home != '\0')
+        {
+            return std::filesystem::path(home) / ".cache" / "hydro";
+        }
+
+        return std::filesystem::temp_directory_path() / "hydro-cache";
+    }
+
+    // 64-bit FNV-1a over every part, each prefixed with its length so that
+    // moving bytes from one part to the next changes the key.
+    static std::string key(const std::vector<std::string_view> &parts)
+    {
+        uint64_t hash = 0xcbf29ce484222325;
+
+        const auto mix = [&](const std::string_view bytes)
+        {
+            for (const char c : bytes)
+            {
+                hash ^= static_cast<unsigned char>(c);
+                hash *= 0x100000001b3;
+            }
+        };
+
+        for (const std::string_view part : parts)
+        {
+            const std::string size = std::to_string(part.size()) + ":";
+            mix(size);
+            mix(part);
+        }
+
+        std::stringstream ss;
+        ss << std::hex << std::setw(16) << std::setfill('0') << hash;
+
+        return ss.str();
+    }
+
+    // Copies the cached executable to `exe`, and the object and assembly to
+    // `obj` and `assembly` when the caller keeps them.
+    bool fetch(const std::string &key, const std::filesystem::path &exe, const std::optional<std::filesystem::path> &obj,
+               const std::optional<std::filesystem::path> &assembly)
+    {
+        const std::filesystem::path entry = m_dir / key;
+        std::error_code ec;
+
+        if (!std::filesystem::exists(entry / exe_name, ec))
+        {
+            count(0, 1);
+            return false;
+        }
+
+        for (const auto &[name, path] :
+             {std::pair{exe_name, std::optional(exe)}, std::pair{obj_name, obj}, std::pair{asm_name, assembly}})
+        {
+            if (!path.has_value())
+            {
+                continue;
+            }
+
+            std::filesystem::copy_file(entry / name, path.value(), std::filesystem::copy_options::overwrite_existing, ec);
+
+            if (ec)
+            {
+                count(0, 1);
+                return false;
+            }
+        }
+
+        std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), ec);
+        count(1, 0);
+
+        return true;
+    }
+
+    // Entries are assembled in a private directory and renamed into place,
+    // so concurrent compilers never see a half-written entry.
+    void store(const std::string &key, const std::filesystem::path &exe, const std::filesystem::path &obj,
+               const std::string_view assembly)
+    {
+        const std::filesystem::path entry = m_dir / key;
+        const std::string owner =
+            std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+        const std::filesystem::path tmp = m_dir / (key + ".tmp." + owner);
+        std::error_code ec;
+
+        std::filesystem::create_directories(tmp, ec);
+        std::filesystem::copy_file(exe, tmp / exe_name, std::filesystem::copy_options::overwrite_existing, ec);
+
+        if (!ec)
+        {
+            std::filesystem::copy_file(obj, tmp / obj_name, std::filesystem::copy_options::overwrite_existing, ec);
+        }
+
+        if (!ec)
+        {
+            std::ofstream file(tmp / asm_name, std::ios::binary);
+            file << assembly;
+
+            if (!file.flush())
+            {
+                ec = std::make_error_code(std::errc::io_error);
+            }
+        }
+
+        if (!ec)
+        {
+            std::filesystem::rename(tmp, entry, ec);
+        }
+
+        std::filesystem::remove_all(tmp, ec);
+
+        evict();
+    }
+
+    [[nodiscard]] CacheStats stats() const
+    {
+        CacheStats stats;
+
+        {
+            std::ifstream file(m_dir / stats_name);
+            std::string label;
+            file >> label >> stats.hits >> label >> stats.misses;
+        }
+
+        for (const Entry &entry : entries())
+        {
+            stats.entries++;
+            stats.bytes += entry.bytes;
+        }
+
+        return stats;
+    }
+
+private:
+    struct Entry
+    {
+        std::filesystem::path path;
+        std::filesystem::file_time_type used;
+        uintmax_t bytes;
+    };
+
+    [[nodiscard]] std::vector<Entry> entries() const
+    {
+        std::vector<Entry> result;
+        std::error_code ec;
+
+        for (const auto &dir : std::filesystem::directory_iterator(m_dir, ec))
+        {
+            if (!dir.is_directory(ec) || dir.path().filename().string().find('.') != std::string::npos)
+            {
+                continue;
+            }
+
+            Entry entry{.path = dir.path(), .used = dir.last_write_time(ec), .bytes = 0};
+
+            for (const auto &file : std::filesystem::directory_iterator(dir.path(), ec))
+            {
+                entry.bytes += file.file_size(ec);
+            }
+
+            result.push_back(entry);
+        }
+
+        return result;
+    }
+
+    void evict() const
+    {
+        std::vector<Entry> all = entries();
+        uintmax_t total = 0;
+
+        for (const Entry &entry : all)
+        {
+            total += entry.bytes;
+        }
+
+        std::sort(all.begin(), all.end(), [](const Entry &a, const Entry &b)
+                  { return a.used < b.used; });
+
+        std::error_code ec;
+
+        for (const Entry &entry : all)
+        {
+            if (total <= m_max_bytes)
+            {
+                break;
+            }
+
+            std::filesystem::remove_all(entry.path, ec);
+            total -= entry.bytes;
+        }
+    }
+
+    // The counters are shared by every compiler using the cache, so they
+    // are updated under an exclusive lock.
+    void count(const uint64_t hits, const uint64_t misses) const
+    {
+        const std::filesystem::path path = m_dir / stats_name;
+        const int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+
+        if (fd < 0)
+        {
+            return;
+        }
+
+        flock(fd, LOCK_EX);
+
+        char buffer[128]{};
+        const ssize_t size = pread(fd, buffer, sizeof(buffer) - 1, 0);
+
+        CacheStats stats;
+
+        if (size > 0)
+        {
+            std::stringstream ss(buffer);
+            std::string label;
+            ss >> label >> stats.hits >> label >> stats.misses;
+        }
+
+        stats.hits += hits;
+        stats.misses += misses;
+
+        const std::string text = "hits " + std::to_string(stats.hits) + "\nmisses " + std::to_string(stats.misses) + "\n";
+        ftruncate(fd, 0);
+        pwrite(fd, text.data(), text.size(), 0);
+
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+
+    static constexpr const char *exe_name = "out";
+    static constexpr const char *obj_name = "out.o";
+    static constexpr const char *asm_name = "out.asm";
+    static constexpr const char *stats_name = "stats";
+
+    std::filesystem::path m_dir;
+    uintmax_t m_max_bytes;
+};
+
+// The compiler's identity in cache keys: a hash of its own executable, read
+// once. Any rebuild that changes the binary changes every key, so stale
+// entries are simply never hit again and age out. Empty when the executable
+// cannot be read, in which case nothing is cached.
+inline const std::string &hydro_version()
+{
+    static const std::string version = []
+    {
+        std::ifstream exe("/proc/self/exe", std::ios::binary);
+        std::stringstream bytes;
+        bytes << exe.rdbuf();
+
+        return exe && !bytes.str().empty() ? "hydro " + CompileCache::key({bytes.str()}) : std::string();
+    }();
+
+    return version;
+}
@@ -0,0 +1,837 @@
+#pragma once
+
+#include <map>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "./arena.hpp"
+#include "./parser.hpp"
+#include "./liveness.hpp"
+
+struct CseStats
+{
+    size_t hits = 0;
+    size_t temps = 0;
+};
+
+// Local value numbering over straight-line regions. A region is a run of
+// statements inside one scope; any statement with nested control flow ends
+// it. When a binary expression is computed again with the same operand
+// values, its first occurrence is hoisted into a hidden `let` right before
+// the statement that contains it, and every occurrence reads that
+// temporary instead. Assignments kill the value numbers of their target.
+// Arrays and their elements are never given a shared value number, so an
+// expression reading one is always computed where it stands. An expression
+// that can trap is not hoisted out of a statement with a call, since the
+// call may exit the program before the expression would have run.
+class CommonSubexprEliminator
+{
+public:
+    explicit CommonSubexprEliminator(NodeProg &prog, ArenaAllocator &allocator)
+        : m_prog(prog), m_allocator(allocator)
+    {
+    }
+
+    CseStats run()
+    {
+        cse_stmts(m_prog.stmts);
+
+        for (NodeFn *fn : m_prog.fns)
+        {
+            cse_stmts(fn->scope->stmts);
+        }
+
+        return m_stats;
+    }
+
+private:
+    enum class Op
+    {
+        add,
+        sub,
+        multi,
+        div,
+        and_,
+        or_,
+        eq,
+        ne,
+        lt,
+        le,
+        gt,
+        ge
+    };
+
+    struct Entry
+    {
+        NodeExpr *first;
+        size_t hits = 0;
+    };
+
+    void reset()
+    {
+        m_lits.clear();
+        m_vars.clear();
+        m_bins.clear();
+        m_available.clear();
+        m_vns.clear();
+    }
+
+    size_t fresh()
+    {
+        return m_next_vn++;
+    }
+
+    size_t var_vn(const std::string &name)
+    {
+        if (name == m_declaring || m_arrays.contains(name))
+        {
+            // The variable being declared is not in scope before its `let`,
+            // so nothing that reads it may be hoisted.
+            return fresh();
+        }
+
+        const auto it = m_vars.find(name);
+
+        if (it != m_vars.end())
+        {
+            return it->second;
+        }
+
+        return m_vars[name] = fresh();
+    }
+
+    void kill(const std::string &name)
+    {
+        m_vars[name] = fresh();
+    }
+
+    // Bottom-up numbering of every binary expression node in `expr`.
+    size_t number(NodeExpr *expr)
+    {
+        struct ExprVisitor
+        {
+            CommonSubexprEliminator &cse;
+
+            size_t operator()(NodeTerm *term) const
+            {
+                struct TermVisitor
+                {
+                    CommonSubexprEliminator &cse;
+
+                    size_t operator()(const NodeTermIntLit *term_int_lit) const
+                    {
+                        std::string value = term_int_lit->int_lit.value.value();
+                        value.erase(0, std::min(value.find_first_not_of('0'), value.size() - 1));
+
+                        const auto it = cse.m_lits.find(value);
+
+                        if (it != cse.m_lits.end())
+                        {
+                            return it->second;
+                        }
+
+                        return cse.m_lits[value] = cse.fresh();
+                    }
+
+                    size_t operator()(const NodeTermIdent *term_ident) const
+                    {
+                        return cse.var_vn(term_ident->ident.value.value());
+                    }
+
+                    size_t operator()(const NodeTermParen *term_paren) const
+                    {
+                        return cse.number(term_paren->expr);
+                    }
+
+                    // Calls are never reused, but their arguments may be.
+                    size_t operator()(const NodeTermCall *term_call) const
+                    {
+                        for (NodeExpr *arg : term_call->args)
+                        {
+                            cse.number(arg);
+                        }
+
+                        return cse.fresh();
+                    }
+
+                    size_t operator()(const NodeTermIndex *term_index) const
+                    {
+                        cse.number(term_index->index);
+
+                        return cse.fresh();
+                    }
+
+                    size_t operator()(const NodeTermNot *term_not) const
+                    {
+                        cse.number(term_not->expr);
+
+                        return cse.fresh();
+                    }
+                };
+
+                return std::visit(TermVisitor{.cse = cse}, term->var);
+            }
+
+            size_t operator()(NodeBinExpr *bin_expr) const
+            {
+                struct BinExprVisitor
+                {
+                    CommonSubexprEliminator &cse;
+
+                    size_t operator()(const NodeBinExprAdd *add) const
+                    {
+                        return cse.bin_vn(Op::add, cse.number(add->lhs), cse.number(add->rhs));
+                    }
+
+                    size_t operator()(const NodeBinExprSub *sub) const
+                    {
+                        return cse.bin_vn(Op::sub, cse.number(sub->lhs), cse.number(sub->rhs));
+                    }
+
+                    size_t operator()(const NodeBinExprMulti *multi) const
+                    {
+                        return cse.bin_vn(Op::multi, cse.number(multi->lhs), cse.number(multi->rhs));
+                    }
+
+                    size_t operator()(const NodeBinExprDiv *div) const
+                    {
+                        return cse.bin_vn(Op::div, cse.number(div->lhs), cse.number(div->rhs));
+                    }
+
+                    size_t operator()(const NodeBinExprAnd *and_) const
+                    {
+                        return cse.bin_vn(Op::and_, cse.number(and_->lhs), cse.number(and_->rhs));
+                    }
+
+                    size_t operator()(const NodeBinExprOr *or_) const
+                    {
+                        return cse.bin_vn(Op::or_, cse.number(or_->lhs), cse.number(or_->rhs));
+                    }
+
+                    size_t operator()(const NodeBinExprEq *eq) const
+                    {
+                        return cse.bin_vn(Op::eq, cse.number(eq->lhs), cse.number(eq->rhs));
+                    }
+
+                    size_t operator()(const NodeBinExprNe *ne) const
+                    {
+                        return cse.bin_vn(Op::ne, cse.number(ne->lhs), cse.number(ne->rhs));
+                    }
+
+                    size_t operator()(const NodeBinExprLt *lt) const
+                    {
+                        return cse.bin_vn(Op::lt, cse.number(lt->lhs), cse.number(lt->rhs));
+                    }
+
+                    size_t operator()(const NodeBinExprLe *le) const
+                    {
+                        return cse.bin_vn(Op::le, cse.number(le->lhs), cse.number(le->rhs));
+                    }
+
+                    size_t operator()(const NodeBinExprGt *gt) const
+                    {
+                        return cse.bin_vn(Op::gt, cse.number(gt->lhs), cse.number(gt->rhs));
+                    }
+
+                    size_t operator()(const NodeBinExprGe *ge) const
+                    {
+                        return cse.bin_vn(Op::ge, cse.number(ge->lhs), cse.number(ge->rhs));
+                    }
+                };
+
+                return std::visit(BinExprVisitor{.cse = cse}, bin_expr->var);
+            }
+        };
+
+        const size_t vn = std::visit(ExprVisitor{.cse = *this}, expr->var);
+
+        if (std::holds_alternative<NodeBinExpr *>(expr->var))
+        {
+            m_vns[expr] = vn;
+        }
+
+        return vn;
+    }
+
+    size_t bin_vn(const Op op, size_t lhs, size_t rhs)
+    {
+        if ((op == Op::add || op == Op::multi || op == Op::eq || op == Op::ne) && rhs < lhs)
+        {
+            std::swap(lhs, rhs);
+        }
+
+        const auto key = std::make_tuple(op, lhs, rhs);
+        const auto it = m_bins.find(key);
+
+        if (it != m_bins.end())
+        {
+            return it->second;
+        }
+
+        return m_bins[key] = fresh();
+    }
+
+    // Top-down matching: an expression whose value is already available is a
+    // hit and its operands are never evaluated, so they are not visited.
+    void match(NodeExpr *expr)
+    {
+        if (const auto it = m_vns.find(expr); it != m_vns.end())
+        {
+            const auto available = m_available.find(it->second);
+
+            if (available != m_available.end())
+            {
+                Entry &entry = m_entries[available->second];
+                entry.hits++;
+                m_hits.emplace_back(expr, available->second);
+                return;
+            }
+
+            if (!m_stmt_calls || DeadStoreEliminator::is_pure(expr))
+            {
+                m_available[it->second] = m_entries.size();
+                m_entries.push_back({.first = expr});
+            }
+        }
+
+        struct ExprVisitor
+        {
+            CommonSubexprEliminator &cse;
+
+            void operator()(NodeTerm *term) const
+            {
+                if (std::holds_alternative<NodeTermParen *>(term->var))
+                {
+                    cse.match(std::get<NodeTermParen *>(term->var)->expr);
+                }
+                else if (std::holds_alternative<NodeTermCall *>(term->var))
+                {
+                    for (NodeExpr *arg : std::get<NodeTermCall *>(term->var)->args)
+                    {
+                        cse.match(arg);
+                    }
+                }
+                else if (std::holds_alternative<NodeTermIndex *>(term->var))
+                {
+                    cse.match(std::get<NodeTermIndex *>(term->var)->index);
+                }
+                else if (std::holds_alternative<NodeTermNot *>(term->var))
+                {
+                    cse.match(std::get<NodeTermNot *>(term->var)->expr);
+                }
+            }
+
+            // The right operand of `&&` and `||` may not run at all, so
+            // nothing inside it is hoisted in front of the statement.
+            void operator()(NodeBinExpr *bin_expr) const
+            {
+                std::visit([&]<typename Bin>(Bin *bin)
+                           {
+                               cse.match(bin->lhs);
+
+                               if constexpr (!std::is_same_v<Bin, NodeBinExprAnd> && !std::is_same_v<Bin, NodeBinExprOr>)
+                               {
+                                   cse.match(bin->rhs);
+                               } },
+                           bin_expr->var);
+            }
+        };
+
+        std::visit(ExprVisitor{.cse = *this}, expr->var);
+    }
+
+    void visit_expr(NodeExpr *expr)
+    {
+        number(expr);
+        match(expr);
+    }
+
+    static int first_line(const NodeExpr *expr)
+    {
+        struct ExprVisitor
+        {
+            int operator()(const NodeTerm *term) const
+            {
+                struct TermVisitor
+                {
+                    int operator()(const NodeTermIntLit *term_int_lit) const
+                    {
+                        return term_int_lit->int_lit.line;
+                    }
+
+                    int operator()(const NodeTermIdent *term_ident) const
+                    {
+                        return term_ident->ident.line;
+                    }
+
+                    int operator()(const NodeTermParen *term_paren) const
+                    {
+                        return first_line(term_paren->expr);
+                    }
+
+                    int operator()(const NodeTermCall *term_call) const
+                    {
+                        return term_call->ident.line;
+                    }
+
+                    int operator()(const NodeTermIndex *term_index) const
+                    {
+                        return term_index->ident.line;
+                    }
+
+                    int operator()(const NodeTermNot *term_not) const
+                    {
+                        return first_line(term_not->expr);
+                    }
+                };
+
+                return std::visit(TermVisitor{}, term->var);
+            }
+
+            int operator()(const NodeBinExpr *bin_expr) const
+            {
+                return std::visit([](const auto *bin)
+                                  { return first_line(bin->lhs); },
+                                  bin_expr->var);
+            }
+        };
+
+        return std::visit(ExprVisitor{}, expr->var);
+    }
+
+    static bool has_call(const NodeExpr *expr)
+    {
+        struct ExprVisitor
+        {
+            bool operator()(const NodeTerm *term) const
+            {
+                struct TermVisitor
+                {
+                    bool operator()(const NodeTermIntLit *) const
+                    {
+                        return false;
+                    }
+
+                    bool operator()(const NodeTermIdent *) const
+                    {
+                        return false;
+                    }
+
+                    bool operator()(const NodeTermParen *term_paren) const
+                    {
+                        return has_call(term_paren->expr);
+                    }
+
+                    bool operator()(const NodeTermCall *) const
+                    {
+                        return true;
+                    }
+
+                    bool operator()(const NodeTermIndex *term_index) const
+                    {
+                        return has_call(term_index->index);
+                    }
+
+                    bool operator()(const NodeTermNot *term_not) const
+                    {
+                        return has_call(term_not->expr);
+                    }
+                };
+
+                return std::visit(TermVisitor{}, term->var);
+            }
+
+            bool operator()(const NodeBinExpr *bin_expr) const
+            {
+                return std::visit([](const auto *bin)
+                                  { return has_call(bin->lhs) || has_call(bin->rhs); },
+                                  bin_expr->var);
+            }
+        };
+
+        return std::visit(ExprVisitor{}, expr->var);
+    }
+
+    NodeExpr *ident_expr(const Token &ident)
+    {
+        auto term_ident = m_allocator.emplace<NodeTermIdent>(ident);
+        auto term = m_allocator.emplace<NodeTerm>(term_ident);
+
+        return m_allocator.emplace<NodeExpr>(term);
+    }
+
+    // Emits, in post-order, a temporary for every first occurrence in `expr`
+    // that was reused later, so inner temporaries are declared first.
+    void hoist(NodeExpr *expr, std::vector<NodeStmt *> &lets)
+    {
+        struct ExprVisitor
+        {
+            CommonSubexprEliminator &cse;
+            std::vector<NodeStmt *> &lets;
+
+            void operator()(NodeTerm *term) const
+            {
+                if (std::holds_alternative<NodeTermParen *>(term->var))
+                {
+                    cse.hoist(std::get<NodeTermParen *>(term->var)->expr, lets);
+                }
+                else if (std::holds_alternative<NodeTermCall *>(term->var))
+                {
+                    for (NodeExpr *arg : std::get<NodeTermCall *>(term->var)->args)
+                    {
+                        cse.hoist(arg, lets);
+                    }
+                }
+                else if (std::holds_alternative<NodeTermIndex *>(term->var))
+                {
+                    cse.hoist(std::get<NodeTermIndex *>(term->var)->index, lets);
+                }
+                else if (std::holds_alternative<NodeTermNot *>(term->var))
+                {
+                    cse.hoist(std::get<NodeTermNot *>(term->var)->expr, lets);
+                }
+            }
+
+            void operator()(NodeBinExpr *bin_expr) const
+            {
+                std::visit([&](auto *bin)
+                           {
+                               cse.hoist(bin->lhs, lets);
+                               cse.hoist(bin->rhs, lets); },
+                           bin_expr->var);
+            }
+        };
+
+        std::visit(ExprVisitor{.cse = *this, .lets = lets}, expr->var);
+
+        const auto it = m_firsts.find(expr);
+
+        if (it == m_firsts.end())
+        {
+            return;
+        }
+
+        const Token &ident = m_temps.at(it->second);
+
+        auto moved = m_allocator.emplace<NodeExpr>();
+        moved->var = expr->var;
+
+        auto stmt_let = m_allocator.emplace<NodeStmtLet>(ident, moved);
+        lets.push_back(m_allocator.emplace<NodeStmt>(stmt_let));
+
+        expr->var = ident_expr(ident)->var;
+    }
+
+    // Rewrites the region that was just numbered: reused values get a
+    // temporary declared in front of the statement that first computes them.
+    void rewrite(std::vector<NodeStmt *> &stmts, const size_t begin, size_t &end)
+    {
+        m_firsts.clear();
+        m_temps.clear();
+
+        for (size_t i = 0; i < m_entries.size(); i++)
+        {
+            const Entry &entry = m_entries[i];
+
+            if (entry.hits == 0)
+            {
+                continue;
+            }
+
+            std::stringstream name;
+            name << "$cse" << m_stats.temps++;
+
+            m_firsts[entry.first] = i;
+            m_temps[i] = Token{.type = TokenType::ident, .line = first_line(entry.first), .value = name.str()};
+            m_stats.hits += entry.hits;
+        }
+
+        for (const auto &[expr, index] : m_hits)
+        {
+            expr->var = ident_expr(m_temps.at(index))->var;
+        }
+
+        size_t i = begin;
+
+        for (const std::vector<NodeExpr *> &exprs : m_region_exprs)
+        {
+            std::vector<NodeStmt *> lets;
+
+            for (NodeExpr *expr : exprs)
+            {
+                hoist(expr, lets);
+            }
+
+            stmts.insert(stmts.begin() + static_cast<std::ptrdiff_t>(i), lets.begin(), lets.end());
+            i += lets.size() + 1;
+            end += lets.size();
+        }
+
+        m_entries.clear();
+        m_hits.clear();
+        m_region_exprs.clear();
+        reset();
+    }
+
+    void cse_scope(NodeScope *scope)
+    {
+        cse_stmts(scope->stmts);
+    }
+
+    void cse_if_pred(NodeIfPred *pred)
+    {
+        struct PredVisitor
+        {
+            CommonSubexprEliminator &cse;
+
+            void operator()(NodeIfPredElse *else_cond) const
+            {
+                cse.cse_scope(else_cond->scope);
+            }
+
+            void operator()(NodeIfPredElif *elif) const
+            {
+                // An `elif` condition has no statement list in front of it to
+                // hold a temporary, so it is left alone.
+                cse.cse_scope(elif->scope);
+
+                if (elif->pred.has_value())
+                {
+                    cse.cse_if_pred(elif->pred.value());
+                }
+            }
+        };
+
+        std::visit(PredVisitor{.cse = *this}, pred->var);
+    }
+
+    void cse_stmts(std::vector<NodeStmt *> &stmts)
+    {
+        size_t begin = 0;
+
+        for (size_t i = 0; i < stmts.size(); i++)
+        {
+            struct StmtVisitor
+            {
+                CommonSubexprEliminator &cse;
+                std::vector<NodeExpr *> &exprs;
+                bool ends_region = false;
+
+                void operator()(NodeStmtExit *stmt_exit)
+                {
+                    cse.visit_expr(stmt_exit->expr);
+                    exprs.push_back(stmt_exit->expr);
+                }
+
+                void operator()(NodeStmtPrint *stmt_print)
+                {
+                    cse.visit_expr(stmt_print->expr);
+                    exprs.push_back(stmt_print->expr);
+                }
+
+                void operator()(NodeStmtLet *stmt_let)
+                {
+                    const std::string &name = stmt_let->ident.value.value();
+
+                    if (stmt_let->length != 0)
+                    {
+                        cse.m_arrays.insert(name);
+                    }
+
+                    if (stmt_let->expr != nullptr)
+                    {
+                        cse.m_declaring = name;
+                        cse.visit_expr(stmt_let->expr);
+                        cse.m_declaring.clear();
+                        exprs.push_back(stmt_let->expr);
+                    }
+
+                    cse.kill(name);
+                }
+
+                void operator()(NodeScope *)
+                {
+                    ends_region = true;
+                }
+
+                void operator()(NodeStmtIf *stmt_if)
+                {
+                    cse.visit_expr(stmt_if->expr);
+                    exprs.push_back(stmt_if->expr);
+                    ends_region = true;
+                }
+
+                void operator()(NodeStmtReturn *stmt_return)
+                {
+                    cse.visit_expr(stmt_return->expr);
+                    exprs.push_back(stmt_return->expr);
+                }
+
+                void operator()(NodeStmtWhile *)
+                {
+                    // The condition runs on every iteration, not once here.
+                    ends_region = true;
+                }
+
+                void operator()(NodeStmtMatch *stmt_match)
+                {
+                    cse.visit_expr(stmt_match->expr);
+                    exprs.push_back(stmt_match->expr);
+                    ends_region = true;
+                }
+
+                void operator()(NodeStmtAssign *stmt_assign)
+                {
+                    if (stmt_assign->index != nullptr)
+                    {
+                        cse.visit_expr(stmt_assign->index);
+                        exprs.push_back(stmt_assign->index);
+                    }
+
+                    cse.visit_expr(stmt_assign->expr);
+                    exprs.push_back(stmt_assign->expr);
+                    cse.kill(stmt_assign->ident.value.value());
+                }
+            };
+
+            m_region_exprs.emplace_back();
+
+            StmtVisitor visitor{.cse = *this, .exprs = m_region_exprs.back()};
+            NodeStmt *stmt = stmts[i];
+            m_stmt_calls = stmt_has_call(stmt);
+            std::visit(visitor, stmt->var);
+
+            if (!visitor.ends_region && i + 1 < stmts.size())
+            {
+                continue;
+            }
+
+            size_t end = i + 1;
+            rewrite(stmts, begin, end);
+            i = end - 1;
+            begin = end;
+
+            if (visitor.ends_region)
+            {
+                cse_nested(stmt);
+            }
+        }
+    }
+
+    // Only the expressions evaluated by the statement itself count; nested
+    // blocks are regions of their own.
+    static bool stmt_has_call(const NodeStmt *stmt)
+    {
+        struct StmtVisitor
+        {
+            bool operator()(const NodeStmtExit *stmt_exit) const
+            {
+                return has_call(stmt_exit->expr);
+            }
+
+            bool operator()(const NodeStmtPrint *stmt_print) const
+            {
+                return has_call(stmt_print->expr);
+            }
+
+            bool operator()(const NodeStmtLet *stmt_let) const
+            {
+                return stmt_let->expr != nullptr && has_call(stmt_let->expr);
+            }
+
+            bool operator()(const NodeScope *) const
+            {
+                return false;
+            }
+
+            bool operator()(const NodeStmtIf *stmt_if) const
+            {
+                return has_call(stmt_if->expr);
+            }
+
+            bool operator()(const NodeStmtReturn *stmt_return) const
+            {
+                return has_call(stmt_return->expr);
+            }
+
+            bool operator()(const NodeStmtWhile *) const
+            {
+                return false;
+            }
+
+            bool operator()(const NodeStmtMatch *stmt_match) const
+            {
+                return has_call(stmt_match->expr);
+            }
+
+            bool operator()(const NodeStmtAssign *stmt_assign) const
+            {
+                return (stmt_assign->index != nullptr && has_call(stmt_assign->index)) || has_call(stmt_assign->expr);
+            }
+        };
+
+        return std::visit(StmtVisitor{}, stmt->var);
+    }
+
+    // Each block inside a control-flow statement starts a fresh region.
+    void cse_nested(NodeStmt *stmt)
+    {
+        if (std::holds_alternative<NodeScope *>(stmt->var))
+        {
+            cse_scope(std::get<NodeScope *>(stmt->var));
+        }
+        else if (std::holds_alternative<NodeStmtIf *>(stmt->var))
+        {
+            const auto stmt_if = std::get<NodeStmtIf *>(stmt->var);
+            cse_scope(stmt_if->scope);
+
+            if (stmt_if->pred.has_value())
+            {
+                cse_if_pred(stmt_if->pred.value());
+            }
+        }
+        else if (std::holds_alternative<NodeStmtWhile *>(stmt->var))
+        {
+            cse_scope(std::get<NodeStmtWhile *>(stmt->var)->scope);
+        }
+        else if (std::holds_alternative<NodeStmtMatch *>(stmt->var))
+        {
+            const auto stmt_match = std::get<NodeStmtMatch *>(stmt->var);
+
+            for (const NodeMatchArm &arm : stmt_match->arms)
+            {
+                cse_scope(arm.scope);
+            }
+
+            if (stmt_match->otherwise != nullptr)
+            {
+                cse_scope(stmt_match->otherwise);
+            }
+        }
+    }
+
+    NodeProg &m_prog;
+    ArenaAllocator &m_allocator;
+    CseStats m_stats{};
+    size_t m_next_vn = 0;
+    std::string m_declaring{};
+    // Whether the statement being numbered makes a call.
+    bool m_stmt_calls = false;
+    // Names declared as an array anywhere seen so far.
+    std::unordered_set<std::string> m_arrays{};
+    std::unordered_map<std::string, size_t> m_lits{};
+    std::unordered_map<std::string, size_t> m_vars{};
+    std::map<std::tuple<Op, size_t, size_t>, size_t> m_bins{};
+    std::unordered_map<const NodeExpr *, size_t> m_vns{};
+    std::unordered_map<size_t, size_t> m_available{};
+    std::vector<Entry> m_entries{};
+    std::vector<std::pair<NodeExpr *, size_t>> m_hits{};
+    std::vector<std::vector<NodeExpr *>> m_region_exprs{};
+    std::unordered_map<const NodeExpr *, size_t> m_firsts{};
+    std::unordered_map<size_t, Token> m_temps{};
+};
@@ -0,0 +1,669 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./tokenization.hpp"
+#include "./parser.hpp"
+#include "./inliner.hpp"
+#include "./cse.hpp"
+#include "./liveness.hpp"
+#include "./frame.hpp"
+#include "./superopt.hpp"
+#include "./generation.hpp"
+#include "./cache.hpp"
+#include "./toolchain.hpp"
+#include "./elf.hpp"
+#include "./stats.hpp"
+
+// Large enough for the parser and every pass that adds nodes.
+inline constexpr size_t arena_size = 1024 * 1024 * 16; // 16 mb
+
+struct Options
+{
+    enum class Mode
+    {
+        compile,
+        superopt,
+        cache_stats,
+        show_profile,
+        watch,
+        server,
+        client
+    };
+
+    Mode mode = Mode::compile;
+    // `-` reads the source from standard input.
+    std::vector<std::filesystem::path> inputs{};
+    // The executable; the assembly and object sit next to it as
+    // `<output>.asm` and `<output>.o`. Defaults to `out` for a single input
+    // and to each input's stem for a batch.
+    std::optional<std::filesystem::path> output;
+    bool opt_report = false;
+    // Keep `<output>.asm` and `<output>.o` on disk instead of in memory.
+    bool save_temps = false;
+    bool time_passes = false;
+    // Count basic block executions; the program writes them to
+    // `<output>.prof` when it exits.
+    bool instrument = false;
+    // Emit DWARF line information and a symbol per block.
+    bool debug = false;
+    // Link into a single-segment executable without symbols or section
+    // headers.
+    bool tiny = false;
+    // From `-march=`: x86-64 and x86-64-v2 have SSE2, x86-64-v3 and up
+    // AVX2, and `native` is whatever the compiling CPU has.
+    VectorIsa vector_isa = VectorIsa::sse2;
+    // `--show-profile` prints this profile; `--profile-use` lays out
+    // branches from it.
+    std::optional<std::filesystem::path> profile_path;
+    std::optional<std::filesystem::path> stats_json;
+    std::optional<std::filesystem::path> superopt_path;
+    std::optional<std::filesystem::path> rewrite_path;
+    bool use_cache = false;
+    std::filesystem::path cache_dir = CompileCache::default_dir();
+    uintmax_t cache_size = 64;
+    std::optional<std::filesystem::path> socket;
+    // Threads for a batch, or for generating a single large program.
+    size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+    // Arguments forwarded by `--connect`.
+    std::vector<std::string> forward{};
+};
+
+inline void print_usage(std::ostream &err)
+{
+    err << "Incorrect usage." << std::endl;
+    err << "hydro [--opt-report] [--rewrite-table <table>] [--cache] [--cache-dir <dir>] [--cache-size <MiB>] "
+           "[--save-temps] [--time-passes] [--stats-json=<path>] [--instrument] [--profile-use <output.prof>] [-g | --tiny] [-march=<arch>] [-j <jobs>] [-o <output>] <input.hy | ->"
+        << std::endl;
+    err << "hydro [options] [-j <jobs>] <input.hy> <input.hy>..." << std::endl;
+    err << "hydro --watch [options] [-o <output>] <input.hy>" << std::endl;
+    err << "hydro --superopt <table>" << std::endl;
+    err << "hydro --cache-stats [--cache-dir <dir>]" << std::endl;
+    err << "hydro --show-profile <output.prof>" << std::endl;
+    err << "hydro --server [--socket <path>] [-j <workers>]" << std::endl;
+    err << "hydro --connect [--socket <path>] <compile arguments>" << std::endl;
+}
+
+inline std::optional<Options> parse_args(const std::vector<std::string> &args)
+{
+    Options options;
+
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        const std::string &arg = args[i];
+        const bool has_value = i + 1 < args.size();
+
+        if (arg == "--connect")
+        {
+            // Everything else is for the server, apart from the socket.
+            options.mode = Options::Mode::client;
+
+            for (i++; i < args.size(); i++)
+            {
+                if (args[i] == "--socket" && i + 1 < args.size())
+                {
+                    options.socket = args[++i];
+                }
+                else
+                {
+                    options.forward.push_back(args[i]);
+                }
+            }
+
+            return options;
+        }
+        else if (arg == "--opt-report")
+        {
+            options.opt_report = true;
+        }
+        else if (arg == "--save-temps")
+        {
+            options.save_temps = true;
+        }
+        else if (arg == "--time-passes")
+        {
+            options.time_passes = true;
+        }
+        else if (arg == "--instrument")
+        {
+            options.instrument = true;
+        }
+        else if (arg == "-g")
+        {
+            options.debug = true;
+        }
+        else if (arg == "--tiny")
+        {
+            options.tiny = true;
+        }
+        else if (arg.starts_with("-march="))
+        {
+            const std::string arch = arg.substr(std::string("-march=").size());
+
+            if (arch == "x86-64" || arch == "x86-64-v2")
+            {
+                options.vector_isa = VectorIsa::sse2;
+            }
+            else if (arch == "x86-64-v3" || arch == "x86-64-v4")
+            {
+                options.vector_isa = VectorIsa::avx2;
+            }
+            else if (arch == "native")
+            {
+                options.vector_isa = __builtin_cpu_supports("avx2") ? VectorIsa::avx2 : VectorIsa::sse2;
+            }
+            else
+            {
+                return {};
+            }
+        }
+        else if (arg == "--profile-use" && has_value)
+        {
+            options.profile_path = args[++i];
+        }
+        else if (arg == "--watch")
+        {
+            options.mode = Options::Mode::watch;
+        }
+        else if (arg == "--show-profile" && has_value)
+        {
+            options.mode = Options::Mode::show_profile;
+            options.profile_path = args[++i];
+        }
+        else if (arg.starts_with("--stats-json="))
+        {
+            options.stats_json = arg.substr(std::string("--stats-json=").size());
+        }
+        else if (arg == "--stats-json" && has_value)
+        {
+            options.stats_json = args[++i];
+        }
+        else if (arg == "--superopt" && has_value)
+        {
+            options.mode = Options::Mode::superopt;
+            options.superopt_path = args[++i];
+        }
+        else if (arg == "--rewrite-table" && has_value)
+        {
+            options.rewrite_path = args[++i];
+        }
+        else if (arg == "--cache")
+        {
+            options.use_cache = true;
+        }
+        else if (arg == "--cache-stats")
+        {
+            options.mode = Options::Mode::cache_stats;
+        }
+        else if (arg == "--cache-dir" && has_value)
+        {
+            options.use_cache = true;
+            options.cache_dir = args[++i];
+        }
+        else if (arg == "--cache-size" && has_value)
+        {
+            options.use_cache = true;
+            options.cache_size = std::strtoull(args[++i].c_str(), nullptr, 10);
+        }
+        else if (arg == "--server")
+        {
+            options.mode = Options::Mode::server;
+        }
+        else if (arg == "--socket" && has_value)
+        {
+            options.socket = args[++i];
+        }
+        else if (arg == "-j" && has_value)
+        {
+            options.jobs = std::max<size_t>(1, std::strtoull(args[++i].c_str(), nullptr, 10));
+        }
+        else if (arg == "-o" && has_value)
+        {
+            options.output = args[++i];
+        }
+        else if (arg.starts_with("-") && arg != "-")
+        {
+            return {};
+        }
+        else
+        {
+            options.inputs.push_back(arg);
+        }
+    }
+
+    const bool wants_input = options.mode == Options::Mode::compile || options.mode == Options::Mode::watch;
+
+    if (wants_input == options.inputs.empty())
+    {
+        return {};
+    }
+
+    // A tiny executable has nowhere to keep debug information.
+    if (options.tiny && options.debug)
+    {
+        return {};
+    }
+
+    // A batch names its outputs after its inputs, so neither standard input
+    // nor a single output name makes sense there.
+    if (options.inputs.size() > 1 &&
+        (options.output.has_value() || std::find(options.inputs.begin(), options.inputs.end(), "-") != options.inputs.end()))
+    {
+        return {};
+    }
+
+    // Watch mode follows a single file on disk.
+    if (options.mode == Options::Mode::watch && (options.inputs.size() > 1 || options.inputs.front() == "-"))
+    {
+        return {};
+    }
+
+    return options;
+}
+
+// Runs one compilation from source to executable. Paths are resolved
+// against `cwd` rather than the process's working directory, and all output
+// goes to the given streams, so several compilations can share a process.
+class Driver
+{
+public:
+    explicit Driver(ArenaAllocator &arena, std::ostream &out, std::ostream &err)
+        : m_arena(arena), m_out(out), m_err(err)
+    {
+    }
+
+    // Fills in `stats`, when given, with pass timings and counters.
+    int compile(const Options &options, const std::filesystem::path &input, const std::filesystem::path &output,
+                const std::filesystem::path &cwd, std::optional<std::string> source = {},
+                CompileStats *stats = nullptr)
+    {
+        m_stats = stats;
+        m_arena.count_types(stats != nullptr);
+
+        if (stats != nullptr)
+        {
+            stats->input = input.string();
+        }
+
+        try
+        {
+            const int status = run(options, input, output, cwd, std::move(source));
+            finish();
+            return status;
+        }
+        catch (const CompileError &error)
+        {
+            finish();
+            m_err << error.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        catch (const std::bad_alloc &)
+        {
+            finish();
+            m_err << "Out of memory." << std::endl;
+            return EXIT_FAILURE;
+        }
+        catch (const std::exception &error)
+        {
+            finish();
+            m_err << "Internal error: " << error.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+private:
+    void finish()
+    {
+        if (m_stats != nullptr)
+        {
+            m_stats->peak_rss_kib = CompileStats::peak_rss();
+        }
+
+        m_arena.reset();
+    }
+
+    int run(const Options &options, const std::filesystem::path &input, const std::filesystem::path &output,
+            const std::filesystem::path &cwd, std::optional<std::string> source)
+    {
+        std::optional<RewriteTable> rewrites;
+        std::string rewrite_bytes;
+
+        if (options.rewrite_path.has_value())
+        {
+            const std::filesystem::path rewrite_path = cwd / options.rewrite_path.value();
+            std::fstream file(rewrite_path, std::ios::in);
+
+            if (!file)
+            {
+                m_err << "The file " << rewrite_path << " does not exist." << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            std::stringstream bytes;
+            bytes << file.rdbuf();
+            rewrite_bytes = bytes.str();
+
+            std::stringstream table(rewrite_bytes);
+            rewrites = RewriteTable::load(table);
+
+            if (!rewrites.has_value())
+            {
+                m_err << "Invalid rewrite table " << rewrite_path << "." << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+
+        std::optional<Profile> profile;
+        std::string profile_bytes;
+
+        if (options.profile_path.has_value())
+        {
+            const std::filesystem::path profile_path = cwd / options.profile_path.value();
+            std::fstream file(profile_path, std::ios::in | std::ios::binary);
+
+            if (!file)
+            {
+                m_err << "The file " << profile_path << " does not exist." << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            std::stringstream bytes;
+            bytes << file.rdbuf();
+            profile_bytes = bytes.str();
+
+            std::stringstream data(profile_bytes);
+            profile = Profile::load(data);
+
+            if (!profile.has_value())
+            {
+                m_err << "Invalid profile " << profile_path << "." << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+
+        std::string contents;
+
+        if (input == "-")
+        {
+            contents = std::move(source).value_or("");
+        }
+        else
+        {
+            const std::filesystem::path file_path = cwd / input;
+
+            if (!std::filesystem::exists(file_path))
+            {
+                m_err << "The file " << file_path << " does not exist." << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            if (!file_path.has_extension() || file_path.extension() != ".hy")
+            {
+                m_err << "Invalid Hydrogen file." << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            contents = time_pass(m_stats, "read", [&]
+                                 {
+                                     std::stringstream contents_stream;
+                                     std::fstream file(file_path, std::ios::in);
+                                     contents_stream << file.rdbuf();
+                                     return contents_stream.str(); });
+        }
+
+        const std::filesystem::path exe_path = cwd / output;
+        const std::filesystem::path obj_path = exe_path.string() + ".o";
+        const std::filesystem::path asm_path = exe_path.string() + ".asm";
+
+        // The rewrite table, the profile, instrumentation, debug information,
+        // tiny linking and the vector extension are the only options that
+        // change the output, so they are part of the key. An instrumented
+        // program embeds the path of its profile, and debug information the
+        // path of its source.
+        const std::optional<std::string> profile_path =
+            options.instrument ? std::optional(output.string() + ".prof") : std::nullopt;
+        const std::optional<std::string> debug_file =
+            options.debug ? std::optional(input == "-" ? "stdin.hy" : std::filesystem::absolute(cwd / input).lexically_normal().string())
+                          : std::nullopt;
+        std::optional<CompileCache> cache;
+        std::string cache_key;
+
+        // A hit restores the executable, and with `--save-temps` its object
+        // and assembly, but the optimization report comes from running the
+        // passes, so `--opt-report` always compiles.
+        if (options.use_cache && !options.opt_report && !hydro_version().empty())
+        {
+            cache.emplace(options.cache_dir, options.cache_size << 20);
+            cache_key = CompileCache::key({hydro_version(), rewrite_bytes, profile_bytes, profile_path.value_or(""),
+                                           debug_file.value_or(""), options.tiny ? "tiny" : "",
+                                           options.vector_isa == VectorIsa::avx2 ? "avx2" : "", contents});
+
+            if (time_pass(m_stats, "cache", [&]
+                          { return cache->fetch(cache_key, exe_path,
+                                                options.save_temps ? std::optional(obj_path) : std::nullopt,
+                                                options.save_temps ? std::optional(asm_path) : std::nullopt); }))
+            {
+                if (m_stats != nullptr)
+                {
+                    m_stats->cache_hit = true;
+                }
+
+                return EXIT_SUCCESS;
+            }
+        }
+
+        Tokenizer tokenizer(std::move(contents));
+        std::vector<Token> tokens = time_pass(m_stats, "tokenize", [&]
+                                              { return tokenizer.tokenize(); });
+
+        if (m_stats != nullptr)
+        {
+            m_stats->tokens = tokens.size();
+        }
+
+        Parser parser(std::move(tokens), m_arena);
+        std::optional<NodeProg> prog = time_pass(m_stats, "parse", [&]
+                                                 { return parser.parse_prog(); });
+
+        if (!prog.has_value())
+        {
+            m_err << "Invalid program." << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        Inliner inliner(prog.value(), m_arena);
+        const InlineStats inline_stats = time_pass(m_stats, "inline", [&]
+                                                   { return inliner.run(); });
+
+        CommonSubexprEliminator cse(prog.value(), m_arena);
+        const CseStats cse_stats = time_pass(m_stats, "cse", [&]
+                                             { return cse.run(); });
+
+        DeadStoreEliminator dse(prog.value());
+        const DeadStoreStats dse_stats = time_pass(m_stats, "dse", [&]
+                                                   { return dse.run(); });
+
+        if (options.opt_report)
+        {
+            m_out << "inline: " << inline_stats.calls_inlined << " calls inlined" << std::endl;
+            m_out << "cse: " << cse_stats.hits << " hits using " << cse_stats.temps << " temporaries" << std::endl;
+            m_out << "dse: removed " << dse_stats.stores_removed << " dead stores and " << dse_stats.lets_removed
+                  << " unused variables" << std::endl;
+        }
+
+        bool writable_data = false;
+        const std::string assembly = time_pass(m_stats, "generate", [&]
+                                               {
+                                                   FrameLayout layout(prog.value());
+                                                   Generator generator(prog.value(), layout.layout_prog(),
+                                                                       {.rewrites = rewrites.has_value() ? &rewrites.value() : nullptr,
+                                                                        .profile_path = profile_path,
+                                                                        .profile = profile.has_value() ? &profile.value() : nullptr,
+                                                                        .debug_file = debug_file,
+                                                                        .jobs = options.inputs.size() == 1 ? options.jobs : 1,
+                                                                        .vector_isa = options.vector_isa});
+                                                   std::string code = generator.gen_prog();
+                                                   writable_data = generator.has_writable_data();
+                                                   return code; });
+
+        if (m_stats != nullptr)
+        {
+            m_stats->nodes = m_arena.type_counts();
+            m_stats->arena_bytes = m_arena.bytes_used();
+        }
+
+        const bool linked = assemble(options, assembly, writable_data, exe_path, [&](const std::filesystem::path &obj)
+                                     {
+                                         if (cache.has_value())
+                                         {
+                                             time_pass(m_stats, "cache store", [&]
+                                                       { cache->store(cache_key, exe_path, obj, assembly); });
+                                         } });
+
+        return linked ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+public:
+    // Assembles and links `assembly` into `exe_path`, calling `linked` with
+    // the object file once the executable is in place.
+    bool assemble(const Options &options, const std::string &assembly, const bool writable_data,
+                  const std::filesystem::path &exe_path,
+                  const std::function<void(const std::filesystem::path &)> &linked = {})
+    {
+        if (options.save_temps)
+        {
+            const std::filesystem::path asm_path = exe_path.string() + ".asm";
+            const std::filesystem::path obj_path = exe_path.string() + ".o";
+
+            time_pass(m_stats, "asm write", [&]
+                      {
+                          std::fstream file(asm_path, std::ios::out);
+                          file << assembly; });
+
+            if (!link(nasm_args(options, asm_path.string(), obj_path.string()), {}) ||
+                !link_exe(options, obj_path.string(), {}, exe_path, writable_data))
+            {
+                return false;
+            }
+
+            if (linked)
+            {
+                linked(obj_path);
+            }
+
+            return true;
+        }
+
+        // The intermediates never touch the disk: the assembly and object
+        // live in memory files that the tools inherit as descriptors. NASM
+        // makes several passes over its input, so it cannot read from a pipe
+        // while generation is still running.
+        const MemFile asm_file("hydro.asm");
+        const MemFile obj_file("hydro.o");
+
+        if (!asm_file.valid() || !obj_file.valid() || !time_pass(m_stats, "asm write", [&]
+                                                                  { return asm_file.write_all(assembly); }))
+        {
+            m_err << "Unable to create in-memory files: " << std::strerror(errno) << "." << std::endl;
+            return false;
+        }
+
+        if (!link(nasm_args(options, asm_file.child_path(), obj_file.child_path()), {asm_file.fd(), obj_file.fd()}) ||
+            !link_exe(options, obj_file.child_path(), {obj_file.fd()}, exe_path, writable_data))
+        {
+            return false;
+        }
+
+        if (linked)
+        {
+            linked(obj_file.path());
+        }
+
+        return true;
+    }
+
+private:
+    static std::vector<std::string> nasm_args(const Options &options, const std::string &input, const std::string &output)
+    {
+        std::vector<std::string> args{"nasm", "-felf64"};
+
+        if (options.debug)
+        {
+            args.insert(args.end(), {"-g", "-F", "dwarf"});
+        }
+
+        args.insert(args.end(), {input, "-o", output});
+
+        return args;
+    }
+
+    // A tiny executable is linked with a generated script, from memory like
+    // the other intermediates, and then loses its section headers.
+    bool link_exe(const Options &options, const std::string &obj, std::vector<int> fds,
+                  const std::filesystem::path &exe, const bool writable_data)
+    {
+        if (!options.tiny)
+        {
+            return link({"ld", obj, "-o", exe.string()}, fds);
+        }
+
+        const MemFile script("hydro.ld");
+
+        if (!script.valid() || !script.write_all(tiny_linker_script(writable_data)))
+        {
+            m_err << "Unable to create in-memory files: " << std::strerror(errno) << "." << std::endl;
+            return false;
+        }
+
+        fds.push_back(script.fd());
+
+        if (!link({"ld", "-n", "-s", "--build-id=none", "-T", script.child_path(), obj, "-o", exe.string()}, fds))
+        {
+            return false;
+        }
+
+        if (const std::optional<std::string> error = time_pass(m_stats, "trim", [&]
+                                                               { return strip_section_headers(exe); }))
+        {
+            m_err << error.value() << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    // The tool's CPU time is its own rather than this thread's.
+    bool link(const std::vector<std::string> &argv, const std::vector<int> &fds)
+    {
+        rusage usage{};
+        const std::optional<std::string> error = time_pass(m_stats, argv.front().c_str(), [&]
+                                                           { return run_tool(argv, fds, &usage); });
+
+        if (m_stats != nullptr)
+        {
+            m_stats->passes.back().cpu_ms = CompileStats::usage_cpu_ms(usage);
+        }
+
+        if (error.has_value())
+        {
+            m_err << error.value() << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    ArenaAllocator &m_arena;
+    std::ostream &m_out;
+    std::ostream &m_err;
+    CompileStats *m_stats = nullptr;
+};
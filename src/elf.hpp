@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+
+#include <elf.h>
+
+// Linker script for `--tiny`: the headers and all code share one
+// read-only executable segment with no page alignment in the file. Writable
+// data, when the program has any, gets a second segment one page further
+// on, which keeps its address and file offset congruent modulo the page
+// size as the kernel requires.
+inline std::string tiny_linker_script(const bool writable)
+{
+    std::stringstream script;
+
+    script << "ENTRY(_start)\n";
+    script << "PHDRS\n{\n";
+    script << "    text PT_LOAD FILEHDR PHDRS FLAGS(5);\n";
+
+    if (writable)
+    {
+        script << "    data PT_LOAD FLAGS(6);\n";
+    }
+
+    script << "}\n";
+    script << "SECTIONS\n{\n";
+    script << "    . = 0x400000 + SIZEOF_HEADERS;\n";
+    script << "    .text : { *(.text .text.*) } :text\n";
+
+    if (writable)
+    {
+        script << "    . = . + 0x1000;\n";
+        script << "    .data : { *(.data .data.*) } :data\n";
+        script << "    .bss : { *(.bss .bss.*) } :data\n";
+    }
+
+    script << "    /DISCARD/ : { *(.note .note.* .comment .eh_frame) }\n";
+    script << "}\n";
+
+    return script.str();
+}
+
+// The kernel loads an executable from its program headers alone, so the
+// section header table, the section name table and anything else past the
+// last loaded byte can go. Returns false if `image` is not an executable.
+inline bool strip_section_headers(std::string &image)
+{
+    Elf64_Ehdr header{};
+
+    if (image.size() < sizeof(header))
+    {
+        return false;
+    }
+
+    std::memcpy(&header, image.data(), sizeof(header));
+
+    const size_t phdrs_end = header.e_phoff + static_cast<size_t>(header.e_phnum) * header.e_phentsize;
+
+    if (std::memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 || header.e_phentsize != sizeof(Elf64_Phdr) ||
+        phdrs_end > image.size())
+    {
+        return false;
+    }
+
+    size_t end = phdrs_end;
+
+    for (size_t i = 0; i < header.e_phnum; i++)
+    {
+        Elf64_Phdr phdr{};
+        std::memcpy(&phdr, image.data() + header.e_phoff + i * sizeof(phdr), sizeof(phdr));
+
+        if (phdr.p_type == PT_LOAD)
+        {
+            end = std::max<size_t>(end, phdr.p_offset + phdr.p_filesz);
+        }
+    }
+
+    header.e_shoff = 0;
+    header.e_shnum = 0;
+    header.e_shentsize = 0;
+    header.e_shstrndx = SHN_UNDEF;
+
+    std::memcpy(image.data(), &header, sizeof(header));
+    image.resize(std::min(end, image.size()));
+
+    return true;
+}
+
+// Returns a description of the failure, if any.
+inline std::optional<std::string> strip_section_headers(const std::filesystem::path &path)
+{
+    std::string image;
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::stringstream bytes;
+        bytes << file.rdbuf();
+        image = bytes.str();
+    }
+
+    if (!strip_section_headers(image))
+    {
+        return "Invalid executable " + path.string() + ".";
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file << image;
+
+    if (!file)
+    {
+        return "Unable to write " + path.string() + ".";
+    }
+
+    return {};
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// Raised for any error in the program being compiled. The compiler used to
+// exit on the spot; throwing lets long-lived callers such as the compile
+// server report the message and carry on.
+struct CompileError : std::runtime_error
+{
+    explicit CompileError(const std::string &message, const int line = 0)
+        : std::runtime_error(message), line(line)
+    {
+    }
+
+    // The source line the error refers to, or 0 when there is none.
+    int line;
+};
+
+template <typename... Args>
+[[noreturn]] void compile_error(const Args &...args)
+{
+    std::stringstream ss;
+    (ss << ... << args);
+
+    throw CompileError(ss.str());
+}
+
+// Like `compile_error`, for an error at a known line; the message ends in
+// ` on line <line>.`.
+template <typename... Args>
+[[noreturn]] void compile_error_at(const int line, const Args &...args)
+{
+    std::stringstream ss;
+    (ss << ... << args);
+    ss << " on line " << line << ".";
+
+    throw CompileError(ss.str(), line);
+}
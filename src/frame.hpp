@@ -0,0 +1,196 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "./parser.hpp"
+
+struct Frame
+{
+    // Byte offset below `rbp` of each variable's slot, for the main program
+    // and every function alike. A slot is as wide as the variable's type
+    // and aligned to it; an array takes 8 bytes per element and its offset
+    // is that of element 0, the lowest address.
+    std::unordered_map<const NodeStmtLet *, size_t> offsets{};
+    size_t size = 0;
+    std::unordered_map<const NodeFn *, size_t> fn_sizes{};
+};
+
+// Assigns every variable a fixed `rbp`-relative slot. Slots are handed out in
+// scope order and released when the scope closes, so sibling scopes, whose
+// variables are never alive at the same time, reuse the same slots. Narrow
+// variables are packed, each padded only to its own alignment.
+class FrameLayout
+{
+public:
+    explicit FrameLayout(const NodeProg &prog)
+        : m_prog(prog)
+    {
+    }
+
+    [[nodiscard]] Frame layout_prog()
+    {
+        for (const NodeStmt *stmt : m_prog.stmts)
+        {
+            layout_stmt(stmt);
+        }
+
+        m_frame.size = frame_size();
+
+        for (const NodeFn *fn : m_prog.fns)
+        {
+            m_used = 0;
+            m_peak = 0;
+
+            for (const NodeStmtLet *param : fn->params)
+            {
+                allocate(param);
+            }
+
+            layout_scope(fn->scope);
+
+            m_frame.fn_sizes[fn] = frame_size();
+        }
+
+        return m_frame;
+    }
+
+private:
+    // Keeps `rsp` 16-byte aligned below the frame.
+    [[nodiscard]] size_t frame_size() const
+    {
+        return (m_peak + 15) / 16 * 16;
+    }
+
+    static size_t type_size(const IntType type)
+    {
+        switch (type)
+        {
+        case IntType::u8:
+            return 1;
+        case IntType::i32:
+            return 4;
+        case IntType::i64:
+            break;
+        }
+
+        return 8;
+    }
+
+    void allocate(const NodeStmtLet *stmt_let)
+    {
+        const size_t size = type_size(stmt_let->type);
+
+        m_used += size * std::max<size_t>(1, stmt_let->length);
+        m_used = (m_used + size - 1) / size * size;
+        m_peak = std::max(m_peak, m_used);
+        m_frame.offsets[stmt_let] = m_used;
+    }
+
+    void layout_scope(const NodeScope *scope)
+    {
+        const size_t mark = m_used;
+
+        for (const NodeStmt *stmt : scope->stmts)
+        {
+            layout_stmt(stmt);
+        }
+
+        m_used = mark;
+    }
+
+    void layout_if_pred(const NodeIfPred *pred)
+    {
+        struct PredVisitor
+        {
+            FrameLayout &layout;
+
+            void operator()(const NodeIfPredElse *else_cond) const
+            {
+                layout.layout_scope(else_cond->scope);
+            }
+
+            void operator()(const NodeIfPredElif *elif) const
+            {
+                layout.layout_scope(elif->scope);
+
+                if (elif->pred.has_value())
+                {
+                    layout.layout_if_pred(elif->pred.value());
+                }
+            }
+        };
+
+        std::visit(PredVisitor{.layout = *this}, pred->var);
+    }
+
+    void layout_stmt(const NodeStmt *stmt)
+    {
+        struct StmtVisitor
+        {
+            FrameLayout &layout;
+
+            void operator()(const NodeStmtExit *) const
+            {
+            }
+
+            void operator()(const NodeStmtPrint *) const
+            {
+            }
+
+            void operator()(const NodeStmtLet *stmt_let) const
+            {
+                layout.allocate(stmt_let);
+            }
+
+            void operator()(const NodeScope *scope) const
+            {
+                layout.layout_scope(scope);
+            }
+
+            void operator()(const NodeStmtIf *stmt_if) const
+            {
+                layout.layout_scope(stmt_if->scope);
+
+                if (stmt_if->pred.has_value())
+                {
+                    layout.layout_if_pred(stmt_if->pred.value());
+                }
+            }
+
+            void operator()(const NodeStmtAssign *) const
+            {
+            }
+
+            void operator()(const NodeStmtWhile *stmt_while) const
+            {
+                layout.layout_scope(stmt_while->scope);
+            }
+
+            void operator()(const NodeStmtReturn *) const
+            {
+            }
+
+            void operator()(const NodeStmtMatch *stmt_match) const
+            {
+                for (const NodeMatchArm &arm : stmt_match->arms)
+                {
+                    layout.layout_scope(arm.scope);
+                }
+
+                if (stmt_match->otherwise != nullptr)
+                {
+                    layout.layout_scope(stmt_match->otherwise);
+                }
+            }
+        };
+
+        std::visit(StmtVisitor{.layout = *this}, stmt->var);
+    }
+
+    const NodeProg &m_prog;
+    Frame m_frame{};
+    // Bytes below `rbp` in use, and the most ever used.
+    size_t m_used = 0;
+    size_t m_peak = 0;
+};
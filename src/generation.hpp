@@ -2,12 +2,57 @@
 
 #include <filesystem>
 #include <algorithm>
+#include <array>
+#include <cassert>
+#include <cctype>
+#include <limits>
+#include <exception>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+#include "./pool.hpp"
+#include "./profile.hpp"
+#include "./stmt_cache.hpp"
+
+// The widest vector extension element-wise array statements may use. SSE2
+// is part of every x86-64 CPU; AVX2 starts at x86-64-v3.
+enum class VectorIsa
+{
+    sse2,
+    avx2
+};
+
+struct CodegenOptions
+{
+    const RewriteTable *rewrites = nullptr;
+    // When set, every basic block counts its executions and the program
+    // writes the counts to this path just before it exits.
+    std::optional<std::string> profile_path;
+    // Counts from an instrumented run, used to lay out if chains.
+    const Profile *profile = nullptr;
+    // When set, statements carry `%line` directives into this source file,
+    // for NASM's DWARF line table, and every block gets a symbol named
+    // after its kind and line.
+    std::optional<std::string> debug_file;
+    // Reuses the code of top-level statements from an earlier build. Not
+    // used together with instrumentation, profiles or debug information,
+    // whose state is not kept per statement.
+    StmtCodeCache *stmt_cache = nullptr;
+    // Threads for the top-level statements of large programs. The output
+    // does not depend on it.
+    size_t jobs = 1;
+    VectorIsa vector_isa = VectorIsa::sse2;
+};
 
 class Generator
 {
 public:
-    explicit Generator(NodeProg prog)
-        : m_prog(std::move(prog))
+    explicit Generator(NodeProg prog, Frame frame, CodegenOptions options = {})
+        : m_prog(std::make_shared<const NodeProg>(std::move(prog))),
+          m_frame(std::make_shared<const Frame>(std::move(frame))), m_options(std::move(options)),
+          m_prints(prints(m_prog->stmts) || std::any_of(m_prog->fns.cbegin(), m_prog->fns.cend(), [](const NodeFn *fn)
+                                                        { return prints(fn->scope->stmts); }))
     {
     }
 
@@ -25,25 +70,73 @@ public:
 
             void operator()(const NodeTermIdent *term_ident) const
             {
-                const auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var &var)
-                                             { return var.name == term_ident->ident.value.value(); });
+                const Var &var = gen.find_var(term_ident->ident);
 
-                if (it == gen.m_vars.cend())
+                if (var.length != 0)
                 {
-                    std::cerr << "Undeclared identifier: " << term_ident->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+                    compile_error_at(term_ident->ident.line, "Array used as a value: ", var.name);
                 }
 
-                std::stringstream offset;
-                offset << "QWORD [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "]";
-
-                gen.push(offset.str());
+                gen.push_var(var);
             }
 
             void operator()(const NodeTermParen *term_paren) const
             {
                 gen.gen_expr(term_paren->expr);
             }
+
+            void operator()(const NodeTermCall *term_call) const
+            {
+                const std::string &name = term_call->ident.value.value();
+                const auto it = gen.m_fns.find(name);
+
+                if (it == gen.m_fns.end())
+                {
+                    compile_error_at(term_call->ident.line, "Undeclared function: ", name);
+                }
+
+                const NodeFn *fn = it->second;
+
+                if (term_call->args.size() != fn->params.size())
+                {
+                    compile_error_at(term_call->ident.line, "Function ", name, " expects ", fn->params.size(), " arguments, got ", term_call->args.size());
+                }
+
+                for (const NodeExpr *arg : term_call->args)
+                {
+                    gen.gen_expr(arg);
+                }
+
+                for (size_t i = term_call->args.size(); i-- > 0;)
+                {
+                    gen.pop(arg_regs[i]);
+                }
+
+                gen.m_output << "    call " << fn_label(name) << "\n";
+                gen.push("rax");
+
+                std::vector<const NodeFn *> &callees = gen.m_calls[gen.m_fn];
+
+                if (std::find(callees.cbegin(), callees.cend(), fn) == callees.cend())
+                {
+                    callees.push_back(fn);
+                }
+            }
+
+            void operator()(const NodeTermIndex *term_index) const
+            {
+                gen.push(gen.gen_element(term_index->ident, term_index->index));
+            }
+
+            void operator()(const NodeTermNot *term_not) const
+            {
+                gen.gen_expr(term_not->expr);
+                gen.pop("rax");
+                gen.m_output << "    test rax, rax\n";
+                gen.m_output << "    sete al\n";
+                gen.m_output << "    movzx eax, al\n";
+                gen.push("rax");
+            }
         };
 
         TermVisitor visitor({.gen = *this});
@@ -52,6 +145,32 @@ public:
 
     void gen_bin_expr(const NodeBinExpr *bin_expr)
     {
+        // A superoptimized rewrite takes `x` in `rax` and `y` in `rcx`. The
+        // operands are still evaluated right to left, like the stack code.
+        if (const auto match = m_options.rewrites != nullptr ? m_options.rewrites->match(bin_expr) : std::nullopt)
+        {
+            if (match->y != nullptr)
+            {
+                gen_expr(match->y);
+            }
+
+            gen_expr(match->x);
+            pop("rax");
+
+            if (match->y != nullptr)
+            {
+                pop("rcx");
+            }
+
+            for (const std::string &instr : *match->instrs)
+            {
+                m_output << "    " << instr << "\n";
+            }
+
+            push("rax");
+            return;
+        }
+
         struct BinExprVisitor
         {
             Generator &gen;
@@ -95,6 +214,8 @@ public:
                 gen.push("rax");
             }
 
+            // When both operands are known to fit in 32 bits, so does the
+            // quotient, and the 32-bit `div` is several times faster.
             void operator()(const NodeBinExprDiv *const div) const
             {
                 gen.gen_expr(div->rhs);
@@ -103,16 +224,199 @@ public:
                 gen.pop("rax");
                 gen.pop("rbx");
 
-                gen.m_output << "    div rbx\n";
+                if (gen.fits_u32(div->lhs) && gen.fits_u32(div->rhs))
+                {
+                    gen.m_output << "    xor edx, edx\n";
+                    gen.m_output << "    div ebx\n";
+                }
+                else
+                {
+                    gen.m_output << "    xor rdx, rdx\n";
+                    gen.m_output << "    div rbx\n";
+                }
+
+                gen.push("rax");
+            }
+
+            // A zero left operand is already the result, so the jump skips
+            // the right one with `rax` still holding it.
+            void operator()(const NodeBinExprAnd *and_) const
+            {
+                const std::string label = gen.create_label();
+
+                gen.gen_expr(and_->lhs);
+                gen.pop("rax");
+                gen.m_output << "    test rax, rax\n";
+                gen.m_output << "    jz " << label << "\n";
+
+                gen.gen_expr(and_->rhs);
+                gen.pop("rax");
+                gen.m_output << "    test rax, rax\n";
+                gen.m_output << "    setne al\n";
+                gen.m_output << "    movzx eax, al\n";
+
+                gen.m_output << label << ":\n";
+                gen.push("rax");
+            }
+
+            // A nonzero left operand is normalized to 1 before the jump.
+            void operator()(const NodeBinExprOr *or_) const
+            {
+                const std::string label = gen.create_label();
+
+                gen.gen_expr(or_->lhs);
+                gen.pop("rax");
+                gen.m_output << "    test rax, rax\n";
+                gen.m_output << "    setne al\n";
+                gen.m_output << "    movzx eax, al\n";
+                gen.m_output << "    jnz " << label << "\n";
+
+                gen.gen_expr(or_->rhs);
+                gen.pop("rax");
+                gen.m_output << "    test rax, rax\n";
+                gen.m_output << "    setne al\n";
+                gen.m_output << "    movzx eax, al\n";
 
+                gen.m_output << label << ":\n";
                 gen.push("rax");
             }
+
+            void operator()(const NodeBinExprEq *eq) const
+            {
+                gen.gen_set(eq->lhs, eq->rhs, "e");
+            }
+
+            void operator()(const NodeBinExprNe *ne) const
+            {
+                gen.gen_set(ne->lhs, ne->rhs, "ne");
+            }
+
+            void operator()(const NodeBinExprLt *lt) const
+            {
+                gen.gen_set(lt->lhs, lt->rhs, "b");
+            }
+
+            void operator()(const NodeBinExprLe *le) const
+            {
+                gen.gen_set(le->lhs, le->rhs, "be");
+            }
+
+            void operator()(const NodeBinExprGt *gt) const
+            {
+                gen.gen_set(gt->lhs, gt->rhs, "a");
+            }
+
+            void operator()(const NodeBinExprGe *ge) const
+            {
+                gen.gen_set(ge->lhs, ge->rhs, "ae");
+            }
         };
 
         BinExprVisitor visitor{.gen = *this};
         std::visit(visitor, bin_expr->var);
     }
 
+    // Sets the flags as `cmp lhs, rhs` would. A literal on the right that
+    // fits a sign-extended 32-bit immediate is compared directly.
+    void gen_compare(const NodeExpr *lhs, const NodeExpr *rhs)
+    {
+        if (const auto imm = immediate(rhs))
+        {
+            gen_expr(lhs);
+            pop("rax");
+            m_output << "    cmp rax, " << imm.value() << "\n";
+            return;
+        }
+
+        gen_expr(rhs);
+        gen_expr(lhs);
+
+        pop("rax");
+        pop("rbx");
+
+        m_output << "    cmp rax, rbx\n";
+    }
+
+    // 1 when `cc` holds for `lhs` against `rhs`, and 0 otherwise.
+    void gen_set(const NodeExpr *lhs, const NodeExpr *rhs, const std::string &cc)
+    {
+        gen_compare(lhs, rhs);
+        m_output << "    set" << cc << " al\n";
+        m_output << "    movzx eax, al\n";
+        push("rax");
+    }
+
+    // Jumps to `label` when `expr` is nonzero, or when it is zero if
+    // `jump_when` is false, and falls through otherwise. Comparisons branch
+    // on the flags, and `&&`, `||` and `!` only steer the jumps, so a
+    // condition never materializes a 0 or 1.
+    void gen_cond(const NodeExpr *expr, const std::string &label, const bool jump_when)
+    {
+        if (const auto term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (const auto term_paren = std::get_if<NodeTermParen *>(&(*term)->var))
+            {
+                gen_cond((*term_paren)->expr, label, jump_when);
+                return;
+            }
+
+            if (const auto term_not = std::get_if<NodeTermNot *>(&(*term)->var))
+            {
+                gen_cond((*term_not)->expr, label, !jump_when);
+                return;
+            }
+        }
+        else
+        {
+            const NodeBinExpr *bin_expr = std::get<NodeBinExpr *>(expr->var);
+
+            if (const auto cmp = comparison(bin_expr))
+            {
+                gen_compare(cmp->lhs, cmp->rhs);
+                m_output << "    j" << (jump_when ? cmp->cc : cmp->inverse) << " " << label << "\n";
+                return;
+            }
+
+            // `a && b` is false as soon as `a` is; it is true only past `b`.
+            if (const auto and_ = std::get_if<NodeBinExprAnd *>(&bin_expr->var))
+            {
+                if (!jump_when)
+                {
+                    gen_cond((*and_)->lhs, label, false);
+                    gen_cond((*and_)->rhs, label, false);
+                    return;
+                }
+
+                const std::string skip = create_label();
+                gen_cond((*and_)->lhs, skip, false);
+                gen_cond((*and_)->rhs, label, true);
+                m_output << skip << ":\n";
+                return;
+            }
+
+            if (const auto or_ = std::get_if<NodeBinExprOr *>(&bin_expr->var))
+            {
+                if (jump_when)
+                {
+                    gen_cond((*or_)->lhs, label, true);
+                    gen_cond((*or_)->rhs, label, true);
+                    return;
+                }
+
+                const std::string skip = create_label();
+                gen_cond((*or_)->lhs, skip, true);
+                gen_cond((*or_)->rhs, label, false);
+                m_output << skip << ":\n";
+                return;
+            }
+        }
+
+        gen_expr(expr);
+        pop("rax");
+        m_output << "    test rax, rax\n";
+        m_output << "    " << (jump_when ? "jnz " : "jz ") << label << "\n";
+    }
+
     void gen_expr(const NodeExpr *expr)
     {
         struct ExprVisitor
@@ -134,8 +438,11 @@ public:
         std::visit(visitor, expr->var);
     }
 
-    void gen_scope(const NodeScope *scope)
+    // The scope's block is counted under `line` when given, e.g. the line
+    // of the `if` it belongs to, and under its opening brace otherwise.
+    void gen_scope(const NodeScope *scope, const BlockKind kind = BlockKind::scope, const std::optional<int> line = {})
     {
+        begin_block(line.value_or(scope->line), kind);
         begin_scope();
 
         for (const NodeStmt *stmt : scope->stmts)
@@ -146,45 +453,133 @@ public:
         end_scope();
     }
 
-    void gen_if_pred(const NodeIfPred *pred, const std::string &end_label)
+    // One tested arm of an if chain, followed by the `rest` of the chain.
+    // Without a profile, or when both ways are equally likely, the arm sits
+    // on the fall-through path. Otherwise the likelier successor falls
+    // through and the other moves to the cold section, with the jump
+    // inverted to reach it, so the common case takes no branch at all.
+    // `residual` is how often the whole chain falls through without taking
+    // any arm.
+    void gen_arm(const NodeExpr *expr, const NodeScope *scope, const BlockKind kind, const int line,
+                 const std::optional<NodeIfPred *> rest, const std::string &end_label, const uint64_t residual)
+    {
+        const uint64_t taken = block_count(line, kind);
+        const uint64_t not_taken = residual + (rest.has_value() ? chain_count(rest.value()) : 0);
+
+        if (taken < not_taken)
+        {
+            const std::string label = create_label();
+            gen_cond(expr, label, true);
+
+            gen_cold([&]
+                     {
+                         m_output << label << ":\n";
+                         gen_scope(scope, kind, line);
+                         m_output << "    jmp " << end_label << "\n"; });
+
+            if (rest.has_value())
+            {
+                gen_if_pred(rest.value(), end_label, residual);
+            }
+
+            return;
+        }
+
+        if (!rest.has_value())
+        {
+            gen_cond(expr, end_label, false);
+            gen_scope(scope, kind, line);
+            return;
+        }
+
+        const std::string label = create_label();
+        gen_cond(expr, label, false);
+        gen_scope(scope, kind, line);
+
+        if (not_taken < taken)
+        {
+            gen_cold([&]
+                     {
+                         m_output << label << ":\n";
+                         gen_if_pred(rest.value(), end_label, residual);
+                         m_output << "    jmp " << end_label << "\n"; });
+            return;
+        }
+
+        m_output << "    jmp " << end_label << "\n";
+        m_output << label << ":\n";
+        gen_if_pred(rest.value(), end_label, residual);
+    }
+
+    void gen_if_pred(const NodeIfPred *pred, const std::string &end_label, const uint64_t residual)
     {
         struct PredVisitor
         {
             Generator &gen;
             const std::string &end_label;
+            const uint64_t residual;
 
             void operator()(const NodeIfPredElse *else_cond) const
             {
                 gen.m_output << "    ;; else\n";
 
-                gen.gen_scope(else_cond->scope);
+                gen.gen_scope(else_cond->scope, BlockKind::else_arm, else_cond->line);
             }
 
             void operator()(const NodeIfPredElif *elif) const
             {
                 gen.m_output << "    ;; elif\n";
 
-                gen.gen_expr(elif->expr);
-                gen.pop("rax");
+                gen.gen_arm(elif->expr, elif->scope, BlockKind::elif_arm, elif->line, elif->pred, end_label, residual);
+            }
+        };
 
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
+        PredVisitor visitor{.gen = *this, .end_label = end_label, .residual = residual};
+        std::visit(visitor, pred->var);
+    }
 
-                gen.gen_scope(elif->scope);
+    // The value is evaluated once into `rax` and dispatched on by
+    // `gen_dispatch`; the arms follow in source order, each jumping to the
+    // end, and the `else` arm, if any, comes last.
+    void gen_match(const NodeStmtMatch *stmt_match)
+    {
+        const std::string end_label = create_label();
+        std::vector<MatchCase> cases;
 
-                gen.m_output << "    jmp " << end_label << "\n";
+        for (const NodeMatchArm &arm : stmt_match->arms)
+        {
+            cases.push_back({.value = arm.value, .label = create_label()});
+        }
 
-                if (elif->pred.has_value())
-                {
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(elif->pred.value(), end_label);
-                }
+        const std::string default_label = stmt_match->otherwise != nullptr ? create_label() : end_label;
+
+        gen_expr(stmt_match->expr);
+        pop("rax");
+
+        std::vector<MatchCase> sorted = cases;
+        std::sort(sorted.begin(), sorted.end(), [](const MatchCase &a, const MatchCase &b)
+                  { return a.value < b.value; });
+
+        gen_dispatch(sorted, 0, sorted.size(), default_label);
+
+        for (size_t i = 0; i < cases.size(); i++)
+        {
+            m_output << cases[i].label << ":\n";
+            gen_scope(stmt_match->arms[i].scope);
+
+            if (i + 1 < cases.size() || stmt_match->otherwise != nullptr)
+            {
+                m_output << "    jmp " << end_label << "\n";
             }
-        };
+        }
 
-        PredVisitor visitor{.gen = *this, .end_label = end_label};
-        std::visit(visitor, pred->var);
+        if (stmt_match->otherwise != nullptr)
+        {
+            m_output << default_label << ":\n";
+            gen_scope(stmt_match->otherwise);
+        }
+
+        m_output << end_label << ":\n";
     }
 
     void gen_stmt(const NodeStmt *stmt)
@@ -198,6 +593,8 @@ public:
                 gen.m_output << "    ;; exit\n";
 
                 gen.gen_expr(stmt_exit->expr);
+                gen.dump_profile();
+                gen.flush_prints();
                 gen.m_output << "    mov rax, 60\n";
                 gen.pop("rdi");
                 gen.m_output << "    syscall\n";
@@ -205,6 +602,17 @@ public:
                 gen.m_output << "    ;; /exit\n";
             }
 
+            void operator()(const NodeStmtPrint *stmt_print) const
+            {
+                gen.m_output << "    ;; print\n";
+
+                gen.gen_expr(stmt_print->expr);
+                gen.pop("rax");
+                gen.m_output << "    call hydro_print\n";
+
+                gen.m_output << "    ;; /print\n";
+            }
+
             void operator()(const NodeStmtLet *stmt_let) const
             {
                 gen.m_output << "    ;; let\n";
@@ -212,13 +620,26 @@ public:
                 if (std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var &var)
                                  { return var.name == stmt_let->ident.value.value(); }) != gen.m_vars.cend())
                 {
-                    std::cerr << "Identifier already declared: " << stmt_let->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+                    compile_error_at(stmt_let->ident.line, "Identifier already declared: ", stmt_let->ident.value.value());
                 }
 
-                gen.m_vars.push_back({.name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size});
+                const size_t offset = gen.m_frame->offsets.at(stmt_let);
+                gen.m_vars.push_back({.name = stmt_let->ident.value.value(),
+                                      .offset = offset,
+                                      .length = stmt_let->length,
+                                      .type = stmt_let->type});
 
-                gen.gen_expr(stmt_let->expr);
+                // Without an initializer the slot is simply left as is.
+                if (stmt_let->expr != nullptr && stmt_let->length != 0)
+                {
+                    gen.gen_elementwise(gen.m_vars.back(), stmt_let->expr);
+                }
+                else if (stmt_let->expr != nullptr)
+                {
+                    gen.gen_expr(stmt_let->expr);
+                    gen.pop("rax");
+                    gen.store_var(gen.m_vars.back(), "rax");
+                }
 
                 gen.m_output << "    ;; /let\n";
             }
@@ -236,101 +657,1569 @@ public:
             {
                 gen.m_output << "    ;; if\n";
 
-                gen.gen_expr(stmt_if->expr);
-                gen.pop("rax");
+                // Arms that return or exit never reach the join, so the
+                // residual is only an estimate.
+                const uint64_t arms = gen.block_count(stmt_if->line, BlockKind::if_arm) +
+                                      (stmt_if->pred.has_value() ? gen.chain_count(stmt_if->pred.value()) : 0);
+                const uint64_t join = gen.block_count(stmt_if->line, BlockKind::join);
 
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
+                const std::string end_label = gen.create_label();
+                gen.gen_arm(stmt_if->expr, stmt_if->scope, BlockKind::if_arm, stmt_if->line, stmt_if->pred, end_label,
+                            join > arms ? join - arms : 0);
+                gen.m_output << end_label << ":\n";
 
-                gen.gen_scope(stmt_if->scope);
+                gen.begin_block(stmt_if->line, BlockKind::join);
 
-                if (stmt_if->pred.has_value())
-                {
-                    const std::string end_label = gen.create_label();
+                gen.m_output << "    ;; /if\n";
+            }
+
+            void operator()(const NodeStmtWhile *stmt_while) const
+            {
+                gen.m_output << "    ;; while\n";
 
-                    gen.m_output << "    jmp " << end_label << "\n";
-                    gen.m_output << label << ":\n";
+                // Rotated loop: the test sits at the bottom, so each iteration
+                // runs a single conditional branch. Variables declared in the
+                // body already own fixed frame slots, so nothing is released
+                // between iterations.
+                const std::string body_label = gen.create_label();
+                const std::string cond_label = gen.create_label();
 
-                    gen.gen_if_pred(stmt_if->pred.value(), end_label);
-                    gen.m_output << end_label << ":\n";
-                }
-                else
-                {
-                    gen.m_output << label << ":\n";
-                }
+                gen.m_output << "    jmp " << cond_label << "\n";
+                gen.m_output << "    align 16\n";
+                gen.m_output << body_label << ":\n";
 
-                gen.m_output << "    ;; /if\n";
+                gen.gen_scope(stmt_while->scope, BlockKind::loop_body, stmt_while->line);
+
+                gen.m_output << cond_label << ":\n";
+                gen.line_directive(stmt_while->line);
+                gen.gen_cond(stmt_while->expr, body_label, true);
+                gen.begin_block(stmt_while->line, BlockKind::loop_exit);
+
+                gen.m_output << "    ;; /while\n";
+            }
+
+            void operator()(const NodeStmtReturn *stmt_return) const
+            {
+                gen.m_output << "    ;; return\n";
+
+                gen.gen_expr(stmt_return->expr);
+                gen.pop("rax");
+                gen.m_output << "    leave\n";
+                gen.m_output << "    ret\n";
+
+                gen.m_output << "    ;; /return\n";
+            }
+
+            void operator()(const NodeStmtMatch *stmt_match) const
+            {
+                gen.m_output << "    ;; match\n";
+
+                gen.gen_match(stmt_match);
+
+                gen.m_output << "    ;; /match\n";
             }
 
             void operator()(const NodeStmtAssign *stmt_assign) const
             {
-                const auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var &var)
-                                             { return var.name == stmt_assign->ident.value.value(); });
+                const Var &var = gen.find_var(stmt_assign->ident);
+
+                if (stmt_assign->index != nullptr)
+                {
+                    gen.gen_expr(stmt_assign->expr);
+                    const std::string element = gen.gen_element(stmt_assign->ident, stmt_assign->index);
+                    gen.pop("rbx");
+                    gen.m_output << "    mov " << element << ", rbx\n";
+                    return;
+                }
 
-                if (it == gen.m_vars.end())
+                if (var.length != 0)
                 {
-                    std::cerr << "Undeclared identifier: " << stmt_assign->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+                    gen.gen_elementwise(var, stmt_assign->expr);
+                    return;
                 }
 
                 gen.gen_expr(stmt_assign->expr);
                 gen.pop("rax");
-                gen.m_output << "    mov [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "], rax\n";
+                gen.store_var(var, "rax");
             }
         };
 
+        line_directive(stmt->line);
+
         StmtVisitor visitor{.gen = *this};
         std::visit(visitor, stmt->var);
     }
 
-    [[nodiscard]] std::string gen_prog()
+    // Arguments arrive in the System V integer argument registers, the
+    // result is returned in `rax`, and falling off the end returns 0.
+    void gen_fn(const NodeFn *fn)
     {
-        m_output << "global _start\n_start:\n";
+        m_output << fn_label(fn->ident.value.value()) << ":\n";
+        m_output << "    push rbp\n";
+        m_output << "    mov rbp, rsp\n";
 
-        for (const NodeStmt *stmt : m_prog.stmts)
+        if (const size_t size = m_frame->fn_sizes.at(fn); size > 0)
         {
-            gen_stmt(stmt);
+            m_output << "    sub rsp, " << size << "\n";
         }
 
-        m_output << "    mov rax, 60\n";
-        m_output << "    mov rdi, 0\n";
-        m_output << "    syscall\n";
+        m_vars.clear();
 
-        return m_output.str();
-    }
+        for (size_t i = 0; i < fn->params.size(); i++)
+        {
+            const std::string &name = fn->params[i]->ident.value.value();
 
-private:
-    void push(const std::string &reg)
-    {
-        m_output << "    push " << reg << "\n";
-        m_stack_size++;
-    }
+            if (std::find_if(m_vars.cbegin(), m_vars.cend(), [&](const Var &var)
+                             { return var.name == name; }) != m_vars.cend())
+            {
+                compile_error_at(fn->params[i]->ident.line, "Identifier already declared: ", name);
+            }
 
-    void pop(const std::string reg)
-    {
-        m_output << "    pop " << reg << "\n";
-        m_stack_size--;
-    }
+            const size_t offset = m_frame->offsets.at(fn->params[i]);
+            m_vars.push_back({.name = name, .offset = offset, .type = fn->params[i]->type});
+            store_var(m_vars.back(), arg_regs[i]);
+        }
 
-    void begin_scope()
-    {
-        m_scopes.push_back(m_vars.size());
+        gen_scope(fn->scope, BlockKind::fn, fn->ident.line);
+
+        m_output << "    mov rax, 0\n";
+        m_output << "    leave\n";
+        m_output << "    ret\n";
     }
 
-    void end_scope()
+    [[nodiscard]] std::string gen_prog()
     {
-        const size_t pop_count = m_vars.size() - m_scopes.back();
-
-        m_output << "    add rsp, " << pop_count * 8 << "\n";
-
-        m_stack_size -= pop_count;
-
-        for (size_t i = 0; i < pop_count; i++)
+        for (const NodeFn *fn : m_prog->fns)
         {
-            m_vars.pop_back();
-        }
+            const std::string &name = fn->ident.value.value();
 
+            if (m_fns.contains(name))
+            {
+                compile_error_at(fn->ident.line, "Function already declared: ", name);
+            }
+
+            if (fn->params.size() > arg_regs.size())
+            {
+                compile_error_at(fn->ident.line, "Function ", name, " takes more than ", arg_regs.size(), " parameters");
+            }
+
+            m_fns[name] = fn;
+        }
+
+        m_output << "global _start\n_start:\n";
+        m_output << "    mov rbp, rsp\n";
+
+        if (m_frame->size > 0)
+        {
+            m_output << "    sub rsp, " << m_frame->size << "\n";
+        }
+
+        begin_block(0, BlockKind::entry);
+
+        const bool cached = m_options.stmt_cache != nullptr && !m_options.profile_path.has_value() &&
+                            m_options.profile == nullptr && !m_options.debug_file.has_value();
+        // Block counters and symbols are numbered across the whole program,
+        // so instrumented and debug builds stay serial.
+        const size_t runs = std::min(m_options.jobs * 4, m_prog->stmts.size() / min_run_size);
+
+        if (!cached && runs > 1 && !m_options.profile_path.has_value() && !m_options.debug_file.has_value())
+        {
+            gen_stmts_parallel(runs);
+        }
+        else
+        {
+            for (const NodeStmt *stmt : m_prog->stmts)
+            {
+                if (cached)
+                {
+                    gen_cached_stmt(stmt);
+                }
+                else
+                {
+                    gen_stmt(stmt);
+                }
+            }
+        }
+
+        dump_profile();
+        flush_prints();
+        m_output << "    mov rax, 60\n";
+        m_output << "    mov rdi, 0\n";
+        m_output << "    syscall\n";
+
+        // Every function is generated so its errors are reported, but only
+        // the ones reachable from the main program are emitted.
+        std::unordered_map<const NodeFn *, std::string> bodies;
+        std::unordered_map<const NodeFn *, std::string> cold_bodies;
+        std::string cold = m_cold.str();
+
+        for (const NodeFn *fn : m_prog->fns)
+        {
+            std::stringstream body;
+            std::stringstream cold_body;
+            std::swap(m_output, body);
+            std::swap(m_cold, cold_body);
+
+            m_fn = fn;
+            gen_fn(fn);
+
+            std::swap(m_output, body);
+            std::swap(m_cold, cold_body);
+            bodies[fn] = body.str();
+            cold_bodies[fn] = cold_body.str();
+        }
+
+        std::vector<const NodeFn *> reachable = m_calls[nullptr];
+
+        for (size_t i = 0; i < reachable.size(); i++)
+        {
+            m_output << bodies.at(reachable[i]);
+            cold += cold_bodies.at(reachable[i]);
+
+            for (const NodeFn *callee : m_calls[reachable[i]])
+            {
+                if (std::find(reachable.cbegin(), reachable.cend(), callee) == reachable.cend())
+                {
+                    reachable.push_back(callee);
+                }
+            }
+        }
+
+        if (m_bounds_checks)
+        {
+            // Where every failed run-time index check jumps.
+            cold += "hydro_bounds_fail:\n    ud2\n";
+        }
+
+        if (!cold.empty())
+        {
+            m_output << "section .text.unlikely progbits alloc exec nowrite align=16\n";
+            m_output << cold;
+        }
+
+        gen_profile_runtime();
+        gen_print_runtime();
+
+        return m_output.str();
+    }
+
+    // Whether the program has a `.data` or `.bss` section.
+    [[nodiscard]] bool has_writable_data() const
+    {
+        return m_writable_data;
+    }
+
+private:
+    struct Var
+    {
+        std::string name;
+        size_t offset;
+        // Elements of an array, 0 for a scalar.
+        size_t length = 0;
+        IntType type = IntType::i64;
+    };
+
+    // A case of a match, by value, and the label of its arm.
+    struct MatchCase
+    {
+        uint64_t value;
+        std::string label;
+    };
+
+    enum class Dispatch
+    {
+        linear,
+        table,
+        tree
+    };
+
+    // Generates a run of top-level statements for `gen_stmts_parallel`,
+    // starting from the state the serial walk has at its first statement:
+    // the first `var_count` top-level variables. Labels are numbered from 0
+    // and rebased when the run is joined.
+    Generator(const Generator &parent, const size_t var_count)
+        : m_prog(parent.m_prog), m_frame(parent.m_frame), m_options(parent.m_options), m_prints(parent.m_prints),
+          m_fns(parent.m_fns),
+          m_vars(parent.m_vars.begin(), parent.m_vars.begin() + static_cast<std::ptrdiff_t>(var_count))
+    {
+    }
+
+    // Between two top-level statements the walk only carries the stack
+    // depth, the visible variables and the next label number. Statements
+    // leave the stack as they found it and top-level variables only
+    // accumulate, so a pre-pass over the statements gives the variables of
+    // each. Runs of statements are then generated on the pool into their
+    // own buffers, each numbering its labels from 0, and are joined in
+    // order with their labels rebased onto the ones before them, as the
+    // statement cache does. The first error in program order wins, as in a
+    // serial walk.
+    void gen_stmts_parallel(const size_t runs)
+    {
+        struct Run
+        {
+            size_t begin;
+            size_t end;
+            std::string code{};
+            std::string cold{};
+            std::vector<const NodeFn *> callees{};
+            size_t labels = 0;
+            bool bounds_checks = false;
+            std::exception_ptr error{};
+        };
+
+        const std::vector<NodeStmt *> &stmts = m_prog->stmts;
+        std::vector<size_t> var_counts;
+
+        for (const NodeStmt *stmt : stmts)
+        {
+            var_counts.push_back(m_vars.size());
+
+            if (const auto stmt_let = std::get_if<NodeStmtLet *>(&stmt->var))
+            {
+                m_vars.push_back({.name = (*stmt_let)->ident.value.value(),
+                                  .offset = m_frame->offsets.at(*stmt_let),
+                                  .length = (*stmt_let)->length,
+                                  .type = (*stmt_let)->type});
+            }
+        }
+
+        std::vector<Run> results;
+
+        for (size_t i = 0; i < runs; i++)
+        {
+            results.push_back({.begin = stmts.size() * i / runs, .end = stmts.size() * (i + 1) / runs});
+        }
+
+        WorkStealingPool pool(std::min(m_options.jobs, runs));
+
+        for (Run &run : results)
+        {
+            pool.submit([&, run = &run](size_t)
+                        {
+                            // Nothing may escape a pool thread: anything thrown,
+                            // including bad_alloc, is rethrown below in program
+                            // order.
+                            try
+                            {
+                                Generator gen(*this, var_counts[run->begin]);
+
+                                for (size_t i = run->begin; i < run->end; i++)
+                                {
+                                    gen.gen_stmt(stmts[i]);
+                                }
+
+                                assert(gen.m_stack_size == 0);
+
+                                run->code = gen.m_output.str();
+                                run->cold = gen.m_cold.str();
+                                run->callees = std::move(gen.m_calls[nullptr]);
+                                run->labels = gen.m_label_count;
+                                run->bounds_checks = gen.m_bounds_checks;
+                            }
+                            catch (...)
+                            {
+                                run->error = std::current_exception();
+                            } });
+        }
+
+        pool.run();
+
+        std::vector<const NodeFn *> &callees = m_calls[nullptr];
+
+        for (const Run &run : results)
+        {
+            if (run.error)
+            {
+                std::rethrow_exception(run.error);
+            }
+
+            m_output << rebase_labels(run.code, 0, m_label_count);
+            m_cold << rebase_labels(run.cold, 0, m_label_count);
+            m_label_count += run.labels;
+            m_bounds_checks |= run.bounds_checks;
+
+            for (const NodeFn *fn : run.callees)
+            {
+                if (std::find(callees.cbegin(), callees.cend(), fn) == callees.cend())
+                {
+                    callees.push_back(fn);
+                }
+            }
+        }
+    }
+
+    // A top-level statement's code depends on the statement itself, the
+    // variables it can see, the stack depth, the functions it may call and
+    // whether the program prints. Labels are numbered from wherever the
+    // statement ends up.
+    void gen_cached_stmt(const NodeStmt *stmt)
+    {
+        AstHasher hasher(*m_frame);
+        hasher.hash(stmt);
+        hasher.mix(m_stack_size);
+        hasher.mix(m_prints);
+
+        for (const Var &var : m_vars)
+        {
+            hasher.mix(var.name);
+            hasher.mix(var.offset);
+            hasher.mix(var.length);
+            hasher.mix(static_cast<uint64_t>(var.type));
+        }
+
+        for (const NodeFn *fn : m_prog->fns)
+        {
+            hasher.mix(fn->ident.value.value());
+            hasher.mix(fn->params.size());
+        }
+
+        const uint64_t key = hasher.value();
+        std::vector<const NodeFn *> &callees = m_calls[nullptr];
+
+        if (const CachedStmt *entry = m_options.stmt_cache->find(key))
+        {
+            m_output << rebase_labels(entry->code, entry->label_base, m_label_count);
+            m_label_count += entry->labels;
+            m_bounds_checks |= entry->bounds_checks;
+
+            for (const std::string &name : entry->callees)
+            {
+                const NodeFn *fn = m_fns.at(name);
+
+                if (std::find(callees.cbegin(), callees.cend(), fn) == callees.cend())
+                {
+                    callees.push_back(fn);
+                }
+            }
+
+            if (const auto stmt_let = std::get_if<NodeStmtLet *>(&stmt->var))
+            {
+                m_vars.push_back({.name = (*stmt_let)->ident.value.value(),
+                                  .offset = m_frame->offsets.at(*stmt_let),
+                                  .length = (*stmt_let)->length,
+                                  .type = (*stmt_let)->type});
+            }
+
+            return;
+        }
+
+        std::stringstream code;
+        std::vector<const NodeFn *> stmt_callees;
+        const size_t label_base = m_label_count;
+        const bool bounds_checks = std::exchange(m_bounds_checks, false);
+
+        std::swap(m_output, code);
+        std::swap(callees, stmt_callees);
+
+        gen_stmt(stmt);
+
+        std::swap(m_output, code);
+        std::swap(callees, stmt_callees);
+
+        CachedStmt entry{.code = code.str(),
+                         .label_base = label_base,
+                         .labels = m_label_count - label_base,
+                         .callees = {},
+                         .bounds_checks = m_bounds_checks};
+        m_bounds_checks |= bounds_checks;
+
+        for (const NodeFn *fn : stmt_callees)
+        {
+            entry.callees.push_back(fn->ident.value.value());
+
+            if (std::find(callees.cbegin(), callees.cend(), fn) == callees.cend())
+            {
+                callees.push_back(fn);
+            }
+        }
+
+        m_output << entry.code;
+        m_options.stmt_cache->insert(key, std::move(entry));
+    }
+
+    [[nodiscard]] uint64_t block_count(const int line, const BlockKind kind) const
+    {
+        return m_options.profile != nullptr ? m_options.profile->count(line, kind) : 0;
+    }
+
+    // How often any arm of `pred` and the ones after it ran.
+    [[nodiscard]] uint64_t chain_count(const NodeIfPred *pred) const
+    {
+        if (const auto elif = std::get_if<NodeIfPredElif *>(&pred->var))
+        {
+            return block_count((*elif)->line, BlockKind::elif_arm) +
+                   ((*elif)->pred.has_value() ? chain_count((*elif)->pred.value()) : 0);
+        }
+
+        const NodeIfPredElse *else_cond = std::get<NodeIfPredElse *>(pred->var);
+        return block_count(else_cond->line, BlockKind::else_arm);
+    }
+
+    // An upper bound on the value of `expr`, if one is known. Only literals
+    // and u8 variables have one to begin with, and a difference may wrap.
+    [[nodiscard]] std::optional<uint64_t> upper_bound(const NodeExpr *expr) const
+    {
+        struct ExprVisitor
+        {
+            const Generator &gen;
+
+            std::optional<uint64_t> operator()(const NodeTerm *term) const
+            {
+                if (const auto term_int_lit = std::get_if<NodeTermIntLit *>(&term->var))
+                {
+                    const std::string &digits = (*term_int_lit)->int_lit.value.value();
+                    const size_t first = std::min(digits.find_first_not_of('0'), digits.size() - 1);
+
+                    if (digits.size() - first > 19)
+                    {
+                        return std::nullopt;
+                    }
+
+                    return std::stoull(digits.substr(first));
+                }
+
+                if (const auto term_ident = std::get_if<NodeTermIdent *>(&term->var))
+                {
+                    const std::string &name = (*term_ident)->ident.value.value();
+                    const auto it = std::find_if(gen.m_vars.crbegin(), gen.m_vars.crend(), [&](const Var &var)
+                                                 { return var.name == name; });
+
+                    if (it != gen.m_vars.crend() && it->length == 0 && it->type == IntType::u8)
+                    {
+                        return std::numeric_limits<uint8_t>::max();
+                    }
+
+                    return std::nullopt;
+                }
+
+                if (const auto term_paren = std::get_if<NodeTermParen *>(&term->var))
+                {
+                    return gen.upper_bound((*term_paren)->expr);
+                }
+
+                if (std::holds_alternative<NodeTermNot *>(term->var))
+                {
+                    return 1;
+                }
+
+                return std::nullopt;
+            }
+
+            std::optional<uint64_t> operator()(const NodeBinExpr *bin_expr) const
+            {
+                constexpr uint64_t max = std::numeric_limits<uint64_t>::max();
+
+                if (const auto div = std::get_if<NodeBinExprDiv *>(&bin_expr->var))
+                {
+                    return gen.upper_bound((*div)->lhs);
+                }
+
+                if (std::holds_alternative<NodeBinExprSub *>(bin_expr->var))
+                {
+                    return std::nullopt;
+                }
+
+                // Comparisons and logic give 0 or 1.
+                if (!std::holds_alternative<NodeBinExprAdd *>(bin_expr->var) &&
+                    !std::holds_alternative<NodeBinExprMulti *>(bin_expr->var))
+                {
+                    return 1;
+                }
+
+                const auto [lhs, rhs] = std::visit([&](const auto *bin)
+                                                   { return std::make_pair(gen.upper_bound(bin->lhs), gen.upper_bound(bin->rhs)); },
+                                                   bin_expr->var);
+
+                if (!lhs.has_value() || !rhs.has_value())
+                {
+                    return std::nullopt;
+                }
+
+                if (std::holds_alternative<NodeBinExprAdd *>(bin_expr->var))
+                {
+                    return lhs.value() <= max - rhs.value() ? std::optional(lhs.value() + rhs.value()) : std::nullopt;
+                }
+
+                if (lhs.value() != 0 && rhs.value() > max / lhs.value())
+                {
+                    return std::nullopt;
+                }
+
+                return lhs.value() * rhs.value();
+            }
+        };
+
+        return std::visit(ExprVisitor{.gen = *this}, expr->var);
+    }
+
+    // A comparison's operands and the unsigned condition codes under which
+    // it holds and fails.
+    struct Comparison
+    {
+        const NodeExpr *lhs;
+        const NodeExpr *rhs;
+        const char *cc;
+        const char *inverse;
+    };
+
+    static std::optional<Comparison> comparison(const NodeBinExpr *bin_expr)
+    {
+        if (const auto eq = std::get_if<NodeBinExprEq *>(&bin_expr->var))
+        {
+            return Comparison{.lhs = (*eq)->lhs, .rhs = (*eq)->rhs, .cc = "e", .inverse = "ne"};
+        }
+
+        if (const auto ne = std::get_if<NodeBinExprNe *>(&bin_expr->var))
+        {
+            return Comparison{.lhs = (*ne)->lhs, .rhs = (*ne)->rhs, .cc = "ne", .inverse = "e"};
+        }
+
+        if (const auto lt = std::get_if<NodeBinExprLt *>(&bin_expr->var))
+        {
+            return Comparison{.lhs = (*lt)->lhs, .rhs = (*lt)->rhs, .cc = "b", .inverse = "ae"};
+        }
+
+        if (const auto le = std::get_if<NodeBinExprLe *>(&bin_expr->var))
+        {
+            return Comparison{.lhs = (*le)->lhs, .rhs = (*le)->rhs, .cc = "be", .inverse = "a"};
+        }
+
+        if (const auto gt = std::get_if<NodeBinExprGt *>(&bin_expr->var))
+        {
+            return Comparison{.lhs = (*gt)->lhs, .rhs = (*gt)->rhs, .cc = "a", .inverse = "be"};
+        }
+
+        if (const auto ge = std::get_if<NodeBinExprGe *>(&bin_expr->var))
+        {
+            return Comparison{.lhs = (*ge)->lhs, .rhs = (*ge)->rhs, .cc = "ae", .inverse = "b"};
+        }
+
+        return std::nullopt;
+    }
+
+    // Jumps to the label of the case in `cases[begin, end)` equal to `rax`,
+    // or to `default_label` if there is none.
+    void gen_dispatch(const std::vector<MatchCase> &cases, const size_t begin, const size_t end,
+                      const std::string &default_label)
+    {
+        switch (dispatch_plan(cases, begin, end))
+        {
+        case Dispatch::linear:
+            for (size_t i = begin; i < end; i++)
+            {
+                const std::string value = operand(cases[i].value);
+                m_output << "    cmp rax, " << value << "\n";
+                m_output << "    je " << cases[i].label << "\n";
+            }
+
+            m_output << "    jmp " << default_label << "\n";
+            break;
+        case Dispatch::table:
+        {
+            // Entries are offsets from the table itself, so it works at any
+            // load address.
+            const std::string table = create_label();
+            const uint64_t first = cases[begin].value;
+            const uint64_t slots = cases[end - 1].value - first + 1;
+
+            if (first != 0)
+            {
+                const std::string offset = operand(first);
+                m_output << "    sub rax, " << offset << "\n";
+            }
+
+            const std::string size = operand(slots);
+            m_output << "    cmp rax, " << size << "\n";
+            m_output << "    jae " << default_label << "\n";
+            m_output << "    lea rbx, [rel " << table << "]\n";
+            m_output << "    movsxd rax, DWORD [rbx + rax*4]\n";
+            m_output << "    add rax, rbx\n";
+            m_output << "    jmp rax\n";
+            m_output << "    align 4\n";
+            m_output << table << ":\n";
+
+            for (size_t i = begin; i < end; i++)
+            {
+                const uint64_t hole = i > begin ? cases[i].value - cases[i - 1].value - 1 : 0;
+
+                for (uint64_t j = 0; j < hole; j++)
+                {
+                    m_output << "    dd " << default_label << " - " << table << "\n";
+                }
+
+                m_output << "    dd " << cases[i].label << " - " << table << "\n";
+            }
+
+            break;
+        }
+        case Dispatch::tree:
+        {
+            const size_t mid = begin + (end - begin) / 2;
+            const std::string lower = create_label();
+
+            const std::string value = operand(cases[mid].value);
+            m_output << "    cmp rax, " << value << "\n";
+            m_output << "    je " << cases[mid].label << "\n";
+            m_output << "    jb " << lower << "\n";
+            gen_dispatch(cases, mid + 1, end, default_label);
+
+            m_output << lower << ":\n";
+            gen_dispatch(cases, begin, mid, default_label);
+            break;
+        }
+        }
+    }
+
+    // A few cases are compared one by one. A range of values dense enough
+    // becomes a jump table, found in constant time; any other range is
+    // split at its middle case into a binary search, and each half is
+    // planned in turn.
+    static Dispatch dispatch_plan(const std::vector<MatchCase> &cases, const size_t begin, const size_t end)
+    {
+        const size_t count = end - begin;
+
+        if (count <= max_linear_cases)
+        {
+            return Dispatch::linear;
+        }
+
+        if (cases[end - 1].value - cases[begin].value < count * max_table_spread)
+        {
+            return Dispatch::table;
+        }
+
+        return Dispatch::tree;
+    }
+
+    // `value` as the second operand of `cmp` or `sub` against `rax`. One
+    // that does not fit a sign-extended 32-bit immediate is first moved into
+    // `rbx`, so call this before writing the instruction.
+    std::string operand(const uint64_t value)
+    {
+        if (value <= static_cast<uint64_t>(std::numeric_limits<int32_t>::max()))
+        {
+            return std::to_string(value);
+        }
+
+        m_output << "    mov rbx, " << value << "\n";
+        return "rbx";
+    }
+
+    // The value of `expr` if it is a literal usable as an immediate operand.
+    static std::optional<uint64_t> immediate(const NodeExpr *expr)
+    {
+        const auto term = std::get_if<NodeTerm *>(&expr->var);
+
+        if (term == nullptr || !std::holds_alternative<NodeTermIntLit *>((*term)->var))
+        {
+            return std::nullopt;
+        }
+
+        const std::string &digits = std::get<NodeTermIntLit *>((*term)->var)->int_lit.value.value();
+        const size_t first = std::min(digits.find_first_not_of('0'), digits.size() - 1);
+
+        if (digits.size() - first > 10)
+        {
+            return std::nullopt;
+        }
+
+        const uint64_t value = std::stoull(digits.substr(first));
+
+        return value <= static_cast<uint64_t>(std::numeric_limits<int32_t>::max()) ? std::optional(value) : std::nullopt;
+    }
+
+    [[nodiscard]] bool fits_u32(const NodeExpr *expr) const
+    {
+        const std::optional<uint64_t> bound = upper_bound(expr);
+        return bound.has_value() && bound.value() <= std::numeric_limits<uint32_t>::max();
+    }
+
+    // The innermost visible variable named by `ident`.
+    [[nodiscard]] const Var &find_var(const Token &ident) const
+    {
+        const auto it = std::find_if(m_vars.crbegin(), m_vars.crend(), [&](const Var &var)
+                                     { return var.name == ident.value.value(); });
+
+        if (it == m_vars.crend())
+        {
+            compile_error_at(ident.line, "Undeclared identifier: ", ident.value.value());
+        }
+
+        return *it;
+    }
+
+    // The memory operand of element `index` of the array `ident`. A literal
+    // index is checked here and needs no code; any other is evaluated into
+    // `rax` and checked against the length at run time.
+    std::string gen_element(const Token &ident, const NodeExpr *index)
+    {
+        const Var var = find_var(ident);
+
+        if (var.length == 0)
+        {
+            compile_error_at(ident.line, "Not an array: ", var.name);
+        }
+
+        if (const auto term = std::get_if<NodeTerm *>(&index->var);
+            term != nullptr && std::holds_alternative<NodeTermIntLit *>((*term)->var))
+        {
+            const std::string &digits = std::get<NodeTermIntLit *>((*term)->var)->int_lit.value.value();
+            const size_t first = std::min(digits.find_first_not_of('0'), digits.size() - 1);
+
+            if (digits.size() - first > 5 || std::stoul(digits.substr(first)) >= var.length)
+            {
+                compile_error_at(ident.line, "Index ", digits, " out of bounds for ", var.name, "[", var.length, "]");
+            }
+
+            return slot(var.offset - std::stoul(digits.substr(first)) * 8);
+        }
+
+        gen_expr(index);
+        pop("rax");
+        m_output << "    cmp rax, " << var.length << "\n";
+        m_output << "    jae hydro_bounds_fail\n";
+        m_bounds_checks = true;
+
+        return "QWORD [rbp + rax*8 - " + std::to_string(var.offset) + "]";
+    }
+
+    // What `gen_elementwise` knows about its statement.
+    struct Elementwise
+    {
+        const Var &dest;
+        // The parts evaluated once up front, by their order on the stack.
+        std::unordered_map<const NodeExpr *, size_t> scalars{};
+        // The stack depth below the first of them.
+        size_t stack_base = 0;
+        // Vector registers from this one up hold the scalars, broadcast.
+        size_t scalar_reg = 0;
+        bool avx2 = false;
+        bool divides = false;
+    };
+
+    // The array named by `expr`, if it is a bare identifier naming one.
+    [[nodiscard]] const Var *array_var(const NodeExpr *expr) const
+    {
+        const auto term = std::get_if<NodeTerm *>(&expr->var);
+
+        if (term == nullptr || !std::holds_alternative<NodeTermIdent *>((*term)->var))
+        {
+            return nullptr;
+        }
+
+        const std::string &name = std::get<NodeTermIdent *>((*term)->var)->ident.value.value();
+        const auto it = std::find_if(m_vars.crbegin(), m_vars.crend(), [&](const Var &var)
+                                     { return var.name == name; });
+
+        return it != m_vars.crend() && it->length != 0 ? &*it : nullptr;
+    }
+
+    // Whether `expr` reads a whole array outside of any call or index.
+    [[nodiscard]] bool reads_array(const NodeExpr *expr) const
+    {
+        if (array_var(expr) != nullptr)
+        {
+            return true;
+        }
+
+        if (const auto term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            const auto term_paren = std::get_if<NodeTermParen *>(&(*term)->var);
+            return term_paren != nullptr && reads_array((*term_paren)->expr);
+        }
+
+        return std::visit([&](const auto *bin)
+                          { return reads_array(bin->lhs) || reads_array(bin->rhs); },
+                          std::get<NodeBinExpr *>(expr->var)->var);
+    }
+
+    // The first whole array read by `expr`, which must read one.
+    [[nodiscard]] const Token &array_ident(const NodeExpr *expr) const
+    {
+        if (array_var(expr) != nullptr)
+        {
+            return std::get<NodeTermIdent *>(std::get<NodeTerm *>(expr->var)->var)->ident;
+        }
+
+        if (const auto term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            return array_ident(std::get<NodeTermParen *>((*term)->var)->expr);
+        }
+
+        return std::visit([&](const auto *bin) -> const Token &
+                          { return array_ident(reads_array(bin->lhs) ? bin->lhs : bin->rhs); },
+                          std::get<NodeBinExpr *>(expr->var)->var);
+    }
+
+    // Splits `expr` into arrays, operators and maximal scalar parts, which
+    // are collected left to right.
+    void collect_scalars(const NodeExpr *expr, Elementwise &ew, std::vector<const NodeExpr *> &scalars) const
+    {
+        if (!reads_array(expr))
+        {
+            ew.scalars[expr] = scalars.size();
+            scalars.push_back(expr);
+            return;
+        }
+
+        if (const Var *var = array_var(expr))
+        {
+            if (var->length != ew.dest.length)
+            {
+                const Token &ident = std::get<NodeTermIdent *>(std::get<NodeTerm *>(expr->var)->var)->ident;
+                compile_error_at(ident.line, "Array length mismatch: ", var->name, "[", var->length, "] with ",
+                                 ew.dest.name, "[", ew.dest.length, "]");
+            }
+
+            return;
+        }
+
+        if (const auto term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            collect_scalars(std::get<NodeTermParen *>((*term)->var)->expr, ew, scalars);
+            return;
+        }
+
+        const NodeBinExpr *bin_expr = std::get<NodeBinExpr *>(expr->var);
+        ew.divides |= std::holds_alternative<NodeBinExprDiv *>(bin_expr->var);
+
+        if (!std::holds_alternative<NodeBinExprAdd *>(bin_expr->var) &&
+            !std::holds_alternative<NodeBinExprSub *>(bin_expr->var) &&
+            !std::holds_alternative<NodeBinExprMulti *>(bin_expr->var) &&
+            !std::holds_alternative<NodeBinExprDiv *>(bin_expr->var))
+        {
+            const Token &ident = array_ident(expr);
+            compile_error_at(ident.line, "Only + - * / apply element-wise: ", ident.value.value());
+        }
+
+        std::visit([&](const auto *bin)
+                   {
+                       collect_scalars(bin->lhs, ew, scalars);
+                       collect_scalars(bin->rhs, ew, scalars); },
+                   bin_expr->var);
+    }
+
+    // `dest[i] = expr` for every element, where each array in `expr` stands
+    // for its own element `i`. The scalar parts of `expr` are evaluated once,
+    // left to right, and kept on the stack. Without division, which has no
+    // vector instruction, a loop computes a whole vector of elements per
+    // iteration and the few left over follow at constant indices, in the low
+    // lane; otherwise a scalar loop does one element at a time. Either way
+    // the loop counts in `rcx`.
+    void gen_elementwise(const Var &dest, const NodeExpr *expr)
+    {
+        Elementwise ew{.dest = dest, .stack_base = m_stack_size, .avx2 = m_options.vector_isa == VectorIsa::avx2};
+        std::vector<const NodeExpr *> scalars;
+        collect_scalars(expr, ew, scalars);
+
+        for (const NodeExpr *scalar : scalars)
+        {
+            gen_expr(scalar);
+        }
+
+        const std::string label = create_label();
+
+        if (!ew.divides && scalars.size() < vector_regs && count_vector_regs(expr, ew) <= vector_regs - scalars.size())
+        {
+            ew.scalar_reg = vector_regs - scalars.size();
+            gen_vector_loop(expr, ew, label);
+        }
+        else
+        {
+            gen_scalar_loop(expr, ew, label);
+        }
+
+        if (!scalars.empty())
+        {
+            m_output << "    add rsp, " << scalars.size() * 8 << "\n";
+            m_stack_size -= scalars.size();
+        }
+    }
+
+    void gen_vector_loop(const NodeExpr *expr, const Elementwise &ew, const std::string &label)
+    {
+        const size_t lanes = ew.avx2 ? 4 : 2;
+        const size_t full = ew.dest.length / lanes * lanes;
+
+        for (size_t i = 0; i < vector_regs - ew.scalar_reg; i++)
+        {
+            const std::string reg = vector_reg(ew.scalar_reg + i, true, ew);
+            const std::string src = "QWORD [rsp + " + std::to_string((m_stack_size - 1 - ew.stack_base - i) * 8) + "]";
+
+            if (ew.avx2)
+            {
+                m_output << "    vpbroadcastq " << reg << ", " << src << "\n";
+            }
+            else
+            {
+                m_output << "    movq " << reg << ", " << src << "\n";
+                m_output << "    punpcklqdq " << reg << ", " << reg << "\n";
+            }
+        }
+
+        if (full > 0)
+        {
+            m_output << "    xor ecx, ecx\n";
+            m_output << "    align 16\n";
+            m_output << label << ":\n";
+
+            const std::string value = gen_vector(expr, 0, ew, std::nullopt);
+            m_output << "    " << (ew.avx2 ? "vmovdqu " : "movdqu ") << element_ref(ew.dest, std::nullopt) << ", "
+                     << value << "\n";
+
+            m_output << "    add rcx, " << lanes << "\n";
+            m_output << "    cmp rcx, " << full << "\n";
+            m_output << "    jb " << label << "\n";
+        }
+
+        for (size_t i = full; i < ew.dest.length; i++)
+        {
+            const std::string value = gen_vector(expr, 0, ew, i);
+            m_output << "    " << (ew.avx2 ? "vmovq " : "movq ") << "QWORD " << element_ref(ew.dest, i) << ", " << value << "\n";
+        }
+
+        if (ew.avx2)
+        {
+            m_output << "    vzeroupper\n";
+        }
+    }
+
+    void gen_scalar_loop(const NodeExpr *expr, const Elementwise &ew, const std::string &label)
+    {
+        m_output << "    xor ecx, ecx\n";
+        m_output << "    align 16\n";
+        m_output << label << ":\n";
+
+        gen_scalar_element(expr, ew);
+        pop("rax");
+        m_output << "    mov QWORD " << element_ref(ew.dest, std::nullopt) << ", rax\n";
+
+        m_output << "    inc rcx\n";
+        m_output << "    cmp rcx, " << ew.dest.length << "\n";
+        m_output << "    jb " << label << "\n";
+    }
+
+    // Element `rcx` of `expr`, pushed, with the same instructions as the
+    // scalar operators.
+    void gen_scalar_element(const NodeExpr *expr, const Elementwise &ew)
+    {
+        if (const auto it = ew.scalars.find(expr); it != ew.scalars.end())
+        {
+            push("QWORD [rsp + " + std::to_string((m_stack_size - 1 - ew.stack_base - it->second) * 8) + "]");
+            return;
+        }
+
+        if (const Var *var = array_var(expr))
+        {
+            push("QWORD " + element_ref(*var, std::nullopt));
+            return;
+        }
+
+        if (const auto term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            gen_scalar_element(std::get<NodeTermParen *>((*term)->var)->expr, ew);
+            return;
+        }
+
+        const NodeBinExpr *bin_expr = std::get<NodeBinExpr *>(expr->var);
+
+        std::visit([&](const auto *bin)
+                   {
+                       gen_scalar_element(bin->rhs, ew);
+                       gen_scalar_element(bin->lhs, ew); },
+                   bin_expr->var);
+
+        pop("rax");
+        pop("rbx");
+
+        if (std::holds_alternative<NodeBinExprAdd *>(bin_expr->var))
+        {
+            m_output << "    add rax, rbx\n";
+        }
+        else if (std::holds_alternative<NodeBinExprSub *>(bin_expr->var))
+        {
+            m_output << "    sub rax, rbx\n";
+        }
+        else if (std::holds_alternative<NodeBinExprMulti *>(bin_expr->var))
+        {
+            m_output << "    mul rbx\n";
+        }
+        else
+        {
+            m_output << "    xor rdx, rdx\n";
+            m_output << "    div rbx\n";
+        }
+
+        push("rax");
+    }
+
+    // Registers `gen_vector` needs for `expr`, beyond the broadcast scalars.
+    [[nodiscard]] size_t count_vector_regs(const NodeExpr *expr, const Elementwise &ew) const
+    {
+        if (ew.scalars.contains(expr))
+        {
+            return 0;
+        }
+
+        if (array_var(expr) != nullptr)
+        {
+            return 1;
+        }
+
+        if (const auto term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            return count_vector_regs(std::get<NodeTermParen *>((*term)->var)->expr, ew);
+        }
+
+        const NodeBinExpr *bin_expr = std::get<NodeBinExpr *>(expr->var);
+        const size_t temps = std::holds_alternative<NodeBinExprMulti *>(bin_expr->var) ? 4 : 2;
+
+        return std::visit([&](const auto *bin)
+                          { return std::max({count_vector_regs(bin->lhs, ew), count_vector_regs(bin->rhs, ew) + 1, temps}); },
+                          bin_expr->var);
+    }
+
+    // Computes `expr` for the elements from `rcx` on, or for element `at`
+    // alone, with registers from `reg` up free, and returns the register
+    // holding it. Neither SSE2 nor AVX2 multiplies 64-bit lanes, so a
+    // product is put together from three 32-bit ones:
+    // lo(a)*lo(b) + (hi(a)*lo(b) + lo(a)*hi(b)) << 32.
+    std::string gen_vector(const NodeExpr *expr, const size_t reg, const Elementwise &ew, const std::optional<size_t> at)
+    {
+        const bool wide = !at.has_value();
+
+        if (const auto it = ew.scalars.find(expr); it != ew.scalars.end())
+        {
+            return vector_reg(ew.scalar_reg + it->second, wide, ew);
+        }
+
+        if (const Var *var = array_var(expr))
+        {
+            const std::string dest = vector_reg(reg, wide, ew);
+            m_output << "    " << (ew.avx2 ? "v" : "") << (wide ? "movdqu " : "movq ") << dest << ", "
+                     << (wide ? "" : "QWORD ") << element_ref(*var, at) << "\n";
+
+            return dest;
+        }
+
+        if (const auto term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            return gen_vector(std::get<NodeTermParen *>((*term)->var)->expr, reg, ew, at);
+        }
+
+        const NodeBinExpr *bin_expr = std::get<NodeBinExpr *>(expr->var);
+        const auto [lhs, rhs] = std::visit([&](const auto *bin)
+                                           {
+                                               const std::string x = gen_vector(bin->lhs, reg, ew, at);
+                                               return std::make_pair(x, gen_vector(bin->rhs, reg + 1, ew, at)); },
+                                           bin_expr->var);
+        const std::string dest = vector_reg(reg, wide, ew);
+
+        if (std::holds_alternative<NodeBinExprAdd *>(bin_expr->var))
+        {
+            vector_op("paddq", dest, lhs, rhs, ew);
+        }
+        else if (std::holds_alternative<NodeBinExprSub *>(bin_expr->var))
+        {
+            vector_op("psubq", dest, lhs, rhs, ew);
+        }
+        else
+        {
+            const std::string cross = vector_reg(reg + 2, wide, ew);
+            const std::string temp = vector_reg(reg + 3, wide, ew);
+
+            vector_op("psrlq", cross, lhs, "32", ew);
+            vector_op("pmuludq", cross, cross, rhs, ew);
+            vector_op("psrlq", temp, rhs, "32", ew);
+            vector_op("pmuludq", temp, temp, lhs, ew);
+            vector_op("paddq", cross, cross, temp, ew);
+            vector_op("psllq", cross, cross, "32", ew);
+            vector_op("pmuludq", dest, lhs, rhs, ew);
+            vector_op("paddq", dest, dest, cross, ew);
+        }
+
+        return dest;
+    }
+
+    // `dest = lhs op rhs`. SSE2 only has the two-operand form, which
+    // overwrites its first operand; `rhs` is never `dest`.
+    void vector_op(const std::string &op, const std::string &dest, const std::string &lhs, const std::string &rhs,
+                   const Elementwise &ew)
+    {
+        if (ew.avx2)
+        {
+            m_output << "    v" << op << " " << dest << ", " << lhs << ", " << rhs << "\n";
+            return;
+        }
+
+        if (dest != lhs)
+        {
+            m_output << "    movdqa " << dest << ", " << lhs << "\n";
+        }
+
+        m_output << "    " << op << " " << dest << ", " << rhs << "\n";
+    }
+
+    static std::string vector_reg(const size_t index, const bool wide, const Elementwise &ew)
+    {
+        return (wide && ew.avx2 ? "ymm" : "xmm") + std::to_string(index);
+    }
+
+    // Element `at` of `var`, or element `rcx` when not given, without an
+    // operand size.
+    static std::string element_ref(const Var &var, const std::optional<size_t> at)
+    {
+        if (at.has_value())
+        {
+            return "[rbp - " + std::to_string(var.offset - at.value() * 8) + "]";
+        }
+
+        return "[rbp + rcx*8 - " + std::to_string(var.offset) + "]";
+    }
+
+    // Generates code for the cold section. The frame and stack depth are
+    // the same as at the point of the call; only the placement differs.
+    template <typename F>
+    void gen_cold(F &&gen)
+    {
+        std::stringstream body;
+        std::swap(m_output, body);
+
+        gen();
+
+        std::swap(m_output, body);
+        m_cold << body.str();
+    }
+
+    void begin_block(const int line, const BlockKind kind)
+    {
+        if (m_options.debug_file.has_value())
+        {
+            std::string name = std::string("hy_") + to_string(kind) + "_" + std::to_string(line);
+            std::replace(name.begin(), name.end(), ' ', '_');
+
+            if (const size_t seen = m_symbols[name]++; seen > 0)
+            {
+                name += "_" + std::to_string(seen);
+            }
+
+            m_output << name << ":\n";
+        }
+
+        if (m_options.profile_path.has_value())
+        {
+            m_output << "    inc QWORD [rel hydro_counts + " << m_counters.size() * 8 << "]\n";
+            m_counters.emplace_back(line, kind);
+        }
+    }
+
+    // Attributes the code that follows to `line`, up to the next directive.
+    void line_directive(const int line)
+    {
+        if (m_options.debug_file.has_value() && line > 0)
+        {
+            m_output << "%line " << line << "+0 " << m_options.debug_file.value() << "\n";
+        }
+    }
+
+    // Whether any of `stmts` prints, directly or in a nested scope.
+    static bool prints(const std::vector<NodeStmt *> &stmts)
+    {
+        struct StmtVisitor
+        {
+            bool operator()(const NodeStmtExit *) const
+            {
+                return false;
+            }
+
+            bool operator()(const NodeStmtLet *) const
+            {
+                return false;
+            }
+
+            bool operator()(const NodeScope *scope) const
+            {
+                return prints(scope->stmts);
+            }
+
+            bool operator()(const NodeStmtIf *stmt_if) const
+            {
+                if (prints(stmt_if->scope->stmts))
+                {
+                    return true;
+                }
+
+                std::optional<NodeIfPred *> pred = stmt_if->pred;
+
+                while (pred.has_value())
+                {
+                    if (const auto *els = std::get_if<NodeIfPredElse *>(&pred.value()->var))
+                    {
+                        return prints((*els)->scope->stmts);
+                    }
+
+                    const auto *elif = std::get<NodeIfPredElif *>(pred.value()->var);
+
+                    if (prints(elif->scope->stmts))
+                    {
+                        return true;
+                    }
+
+                    pred = elif->pred;
+                }
+
+                return false;
+            }
+
+            bool operator()(const NodeStmtAssign *) const
+            {
+                return false;
+            }
+
+            bool operator()(const NodeStmtWhile *stmt_while) const
+            {
+                return prints(stmt_while->scope->stmts);
+            }
+
+            bool operator()(const NodeStmtReturn *) const
+            {
+                return false;
+            }
+
+            bool operator()(const NodeStmtMatch *stmt_match) const
+            {
+                return std::any_of(stmt_match->arms.cbegin(), stmt_match->arms.cend(), [](const NodeMatchArm &arm)
+                                   { return prints(arm.scope->stmts); }) ||
+                       (stmt_match->otherwise != nullptr && prints(stmt_match->otherwise->stmts));
+            }
+
+            bool operator()(const NodeStmtPrint *) const
+            {
+                return true;
+            }
+        };
+
+        return std::any_of(stmts.cbegin(), stmts.cend(), [](const NodeStmt *stmt)
+                           { return std::visit(StmtVisitor{}, stmt->var); });
+    }
+
+    void flush_prints()
+    {
+        if (m_prints)
+        {
+            m_output << "    call hydro_print_flush\n";
+        }
+    }
+
+    void dump_profile()
+    {
+        if (m_options.profile_path.has_value())
+        {
+            m_output << "    call hydro_dump_profile\n";
+        }
+    }
+
+    // Writes the layout described in profile.hpp: the header and block
+    // table are static data, the counts follow from `.bss`. A profile that
+    // cannot be opened is silently skipped, so the exit status stays the
+    // program's own. The code goes back to `.text`, since cold blocks may
+    // have been emitted just before it.
+    void gen_profile_runtime()
+    {
+        if (!m_options.profile_path.has_value())
+        {
+            return;
+        }
+
+        const size_t header_size = 16 + m_counters.size() * 16;
+        m_writable_data = true;
+
+        m_output << "section .text\n";
+        m_output << "hydro_dump_profile:\n";
+        m_output << "    mov rax, 2\n";
+        m_output << "    lea rdi, [rel hydro_profile_path]\n";
+        m_output << "    mov rsi, 577\n"; // O_WRONLY | O_CREAT | O_TRUNC
+        m_output << "    mov rdx, 420\n"; // 0644
+        m_output << "    syscall\n";
+        m_output << "    test rax, rax\n";
+        m_output << "    js hydro_dump_profile_done\n";
+        m_output << "    push rax\n";
+        m_output << "    mov rdi, rax\n";
+        m_output << "    mov rax, 1\n";
+        m_output << "    lea rsi, [rel hydro_profile_header]\n";
+        m_output << "    mov rdx, " << header_size << "\n";
+        m_output << "    syscall\n";
+        m_output << "    mov rdi, [rsp]\n";
+        m_output << "    mov rax, 1\n";
+        m_output << "    lea rsi, [rel hydro_counts]\n";
+        m_output << "    mov rdx, " << m_counters.size() * 8 << "\n";
+        m_output << "    syscall\n";
+        m_output << "    pop rdi\n";
+        m_output << "    mov rax, 3\n";
+        m_output << "    syscall\n";
+        m_output << "hydro_dump_profile_done:\n";
+        m_output << "    ret\n";
+
+        m_output << "section .data\n";
+        m_output << "hydro_profile_path:\n";
+        m_output << "    db ";
+
+        for (const char c : m_options.profile_path.value())
+        {
+            m_output << static_cast<int>(static_cast<unsigned char>(c)) << ", ";
+        }
+
+        m_output << "0\n";
+        m_output << "    align 8\n";
+        m_output << "hydro_profile_header:\n";
+        m_output << "    dq " << Profile::magic << ", " << m_counters.size() << "\n";
+
+        for (const auto &[line, kind] : m_counters)
+        {
+            m_output << "    dq " << line << ", " << static_cast<uint64_t>(kind) << "\n";
+        }
+
+        m_output << "section .bss\n";
+        m_output << "    alignb 8\n";
+        m_output << "hydro_counts:\n";
+        m_output << "    resq " << m_counters.size() << "\n";
+    }
+
+    // `hydro_print` appends the decimal digits of `rax` and a newline to a
+    // buffer in `.bss`, flushing it first when the longest number might not
+    // fit. The digits are written backwards two at a time from a table of
+    // the pairs "00" to "99", dividing by 100 with a multiply by its
+    // reciprocal. `hydro_print_flush` hands the buffer to one `write` and
+    // retries what a short write leaves; output that cannot be written is
+    // dropped, so the exit status stays the program's own.
+    void gen_print_runtime()
+    {
+        if (!m_prints)
+        {
+            return;
+        }
+
+        // The most digits of a 64-bit value, and the newline.
+        constexpr size_t max_line = 21;
+        m_writable_data = true;
+
+        m_output << "section .text\n";
+        m_output << "hydro_print:\n";
+        m_output << "    mov rcx, [rel hydro_print_len]\n";
+        m_output << "    cmp rcx, " << print_buffer_size - max_line << "\n";
+        m_output << "    jbe hydro_print_format\n";
+        m_output << "    push rax\n";
+        m_output << "    call hydro_print_flush\n";
+        m_output << "    pop rax\n";
+        m_output << "    mov rcx, 0\n";
+        m_output << "hydro_print_format:\n";
+        m_output << "    lea r8, [rel hydro_print_digits + " << max_line - 1 << "]\n";
+        m_output << "    mov BYTE [r8], 10\n";
+        m_output << "    mov r9, r8\n";
+        m_output << "    lea r10, [rel hydro_print_pairs]\n";
+        m_output << "hydro_print_pair:\n";
+        m_output << "    cmp rax, 100\n";
+        m_output << "    jb hydro_print_last\n";
+        m_output << "    mov r11, rax\n";
+        m_output << "    shr rax, 2\n";
+        m_output << "    mov rdx, 0x28f5c28f5c28f5c3\n";
+        m_output << "    mul rdx\n";
+        m_output << "    shr rdx, 2\n";
+        m_output << "    imul rax, rdx, 100\n";
+        m_output << "    sub r11, rax\n";
+        m_output << "    mov rax, rdx\n";
+        m_output << "    movzx edx, WORD [r10 + r11*2]\n";
+        m_output << "    sub r9, 2\n";
+        m_output << "    mov [r9], dx\n";
+        m_output << "    jmp hydro_print_pair\n";
+        m_output << "hydro_print_last:\n";
+        m_output << "    cmp rax, 10\n";
+        m_output << "    jb hydro_print_digit\n";
+        m_output << "    movzx edx, WORD [r10 + rax*2]\n";
+        m_output << "    sub r9, 2\n";
+        m_output << "    mov [r9], dx\n";
+        m_output << "    jmp hydro_print_copy\n";
+        m_output << "hydro_print_digit:\n";
+        m_output << "    add rax, 48\n";
+        m_output << "    dec r9\n";
+        m_output << "    mov [r9], al\n";
+        m_output << "hydro_print_copy:\n";
+        m_output << "    lea rdx, [r8 + 1]\n";
+        m_output << "    sub rdx, r9\n";
+        m_output << "    mov rsi, r9\n";
+        m_output << "    lea rdi, [rel hydro_print_buffer]\n";
+        m_output << "    add rdi, rcx\n";
+        m_output << "    add rcx, rdx\n";
+        m_output << "    mov [rel hydro_print_len], rcx\n";
+        m_output << "    mov rcx, rdx\n";
+        m_output << "    rep movsb\n";
+        m_output << "    ret\n";
+
+        m_output << "hydro_print_flush:\n";
+        m_output << "    lea rsi, [rel hydro_print_buffer]\n";
+        m_output << "    mov rdx, [rel hydro_print_len]\n";
+        m_output << "    mov QWORD [rel hydro_print_len], 0\n";
+        m_output << "hydro_print_write:\n";
+        m_output << "    test rdx, rdx\n";
+        m_output << "    jz hydro_print_flush_done\n";
+        m_output << "    mov rax, 1\n";
+        m_output << "    mov rdi, 1\n";
+        m_output << "    syscall\n";
+        m_output << "    test rax, rax\n";
+        m_output << "    jle hydro_print_flush_done\n";
+        m_output << "    add rsi, rax\n";
+        m_output << "    sub rdx, rax\n";
+        m_output << "    jmp hydro_print_write\n";
+        m_output << "hydro_print_flush_done:\n";
+        m_output << "    ret\n";
+
+        m_output << "section .data\n";
+        m_output << "hydro_print_pairs:\n";
+
+        for (int tens = 0; tens < 10; tens++)
+        {
+            m_output << "    db ";
+
+            for (int ones = 0; ones < 10; ones++)
+            {
+                m_output << (ones > 0 ? ", " : "") << '0' + tens << ", " << '0' + ones;
+            }
+
+            m_output << "\n";
+        }
+
+        m_output << "section .bss\n";
+        m_output << "    alignb 8\n";
+        m_output << "hydro_print_len:\n";
+        m_output << "    resq 1\n";
+        m_output << "hydro_print_digits:\n";
+        m_output << "    resb " << max_line << "\n";
+        m_output << "hydro_print_buffer:\n";
+        m_output << "    resb " << print_buffer_size << "\n";
+    }
+
+    void push(const std::string &reg)
+    {
+        m_output << "    push " << reg << "\n";
+        m_stack_size++;
+    }
+
+    void pop(const std::string reg)
+    {
+        m_output << "    pop " << reg << "\n";
+        m_stack_size--;
+    }
+
+    void begin_scope()
+    {
+        m_scopes.push_back(m_vars.size());
+    }
+
+    // Variables live in fixed frame slots, so closing a scope only ends
+    // their visibility.
+    void end_scope()
+    {
+        m_vars.resize(m_scopes.back());
         m_scopes.pop_back();
     }
 
@@ -342,16 +2231,119 @@ private:
         return ss.str();
     }
 
-    struct Var
+    static std::string fn_label(const std::string &name)
     {
-        std::string name;
-        size_t stack_loc;
-    };
+        return "fn_" + name;
+    }
+
+    static std::string slot(const size_t offset, const IntType type = IntType::i64)
+    {
+        std::stringstream ss;
+
+        switch (type)
+        {
+        case IntType::u8:
+            ss << "BYTE";
+            break;
+        case IntType::i32:
+            ss << "DWORD";
+            break;
+        case IntType::i64:
+            ss << "QWORD";
+            break;
+        }
+
+        ss << " [rbp - " << offset << "]";
+
+        return ss.str();
+    }
+
+    // The low byte or double word of `rax`, `rbx` or an argument register,
+    // as wide as `type`.
+    static std::string sized_reg(const std::string &reg, const IntType type)
+    {
+        const bool numbered = std::isdigit(static_cast<unsigned char>(reg[1]));
+
+        switch (type)
+        {
+        case IntType::u8:
+            if (numbered)
+            {
+                return reg + "b";
+            }
+
+            return reg == "rdi" || reg == "rsi" ? reg.substr(1) + "l" : reg.substr(1, 1) + "l";
+        case IntType::i32:
+            return numbered ? reg + "d" : "e" + reg.substr(1);
+        case IntType::i64:
+            break;
+        }
+
+        return reg;
+    }
+
+    // Pushes the value of a scalar variable, extended to 64 bits.
+    void push_var(const Var &var)
+    {
+        switch (var.type)
+        {
+        case IntType::u8:
+            m_output << "    movzx eax, " << slot(var.offset, var.type) << "\n";
+            push("rax");
+            break;
+        case IntType::i32:
+            m_output << "    movsxd rax, " << slot(var.offset, var.type) << "\n";
+            push("rax");
+            break;
+        case IntType::i64:
+            push(slot(var.offset));
+            break;
+        }
+    }
+
+    // Stores the low bits of `reg` that fit the variable.
+    void store_var(const Var &var, const std::string &reg)
+    {
+        m_output << "    mov " << slot(var.offset, var.type) << ", " << sized_reg(reg, var.type) << "\n";
+    }
 
-    const NodeProg m_prog;
+    static inline const std::array<std::string, 6> arg_regs{"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+
+    // Shared with the generators of parallel runs, which only read them.
+    const std::shared_ptr<const NodeProg> m_prog;
+    const std::shared_ptr<const Frame> m_frame;
+    const CodegenOptions m_options;
+    // Whether any statement prints, in which case every exit flushes the
+    // print buffer first.
+    const bool m_prints;
+    std::unordered_map<std::string, const NodeFn *> m_fns{};
+    // Callees of each function in order of first call; the main program is
+    // keyed by nullptr.
+    std::unordered_map<const NodeFn *, std::vector<const NodeFn *>> m_calls{};
+    const NodeFn *m_fn = nullptr;
     std::stringstream m_output;
+    // Out-of-line code for unlikely arms.
+    std::stringstream m_cold;
     size_t m_stack_size = 0;
     std::vector<Var> m_vars{};
     std::vector<size_t> m_scopes{};
     size_t m_label_count = 0;
+    // The source line and kind of each block counter, in counter order.
+    std::vector<std::pair<int, BlockKind>> m_counters{};
+    // How often each block symbol has been used, to keep them unique.
+    std::unordered_map<std::string, size_t> m_symbols{};
+    bool m_writable_data = false;
+    // Whether any run-time index check jumps to `hydro_bounds_fail`.
+    bool m_bounds_checks = false;
+
+    // Fewer statements per thread than this are not worth the hand-off.
+    static constexpr size_t min_run_size = 64;
+    // `xmm0` to `xmm15`, or `ymm0` to `ymm15` with AVX2.
+    static constexpr size_t vector_regs = 16;
+    // Match cases compared one by one, and the most jump table slots per
+    // case; beyond either, a binary search or a sparser split is cheaper.
+    static constexpr size_t max_linear_cases = 3;
+    static constexpr uint64_t max_table_spread = 3;
+    // Bytes of printed output collected before a `write`.
+    static constexpr size_t print_buffer_size = 8192;
 };
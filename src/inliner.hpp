@@ -0,0 +1,682 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "./arena.hpp"
+#include "./liveness.hpp"
+#include "./parser.hpp"
+
+struct InlineStats
+{
+    size_t calls_inlined = 0;
+};
+
+// Replaces calls to small functions with their body. Only functions whose
+// body is a single `return expr;` are candidates; the call becomes that
+// expression with every parameter replaced by its argument. A call costs
+// about as many instructions as evaluating `budget` expression nodes
+// (argument moves, `call`, prologue, parameter spills, epilogue), so bodies
+// up to that size are always worth inlining. Anything that would duplicate
+// work, drop a side effect or reorder two side effects is left as a call, as
+// is a call passing a whole array, which the generator rejects. Parameters
+// narrower than 64 bits truncate their argument, so functions taking one
+// are not inlined either.
+class Inliner
+{
+public:
+    explicit Inliner(NodeProg &prog, ArenaAllocator &allocator)
+        : m_prog(prog), m_allocator(allocator)
+    {
+    }
+
+    InlineStats run()
+    {
+        for (NodeFn *fn : m_prog.fns)
+        {
+            // Duplicate definitions are reported by the generator.
+            m_fns.try_emplace(fn->ident.value.value(), fn);
+        }
+
+        inline_stmts(m_prog.stmts);
+
+        for (NodeFn *fn : m_prog.fns)
+        {
+            m_expanding.push_back(fn);
+            inline_stmts(fn->scope->stmts);
+            m_expanding.pop_back();
+        }
+
+        return m_stats;
+    }
+
+private:
+    static constexpr size_t budget = 16;
+    static constexpr size_t max_depth = 8;
+
+    static size_t size(const NodeExpr *expr)
+    {
+        struct ExprVisitor
+        {
+            size_t operator()(const NodeTerm *term) const
+            {
+                struct TermVisitor
+                {
+                    size_t operator()(const NodeTermIntLit *) const
+                    {
+                        return 1;
+                    }
+
+                    size_t operator()(const NodeTermIdent *) const
+                    {
+                        return 1;
+                    }
+
+                    size_t operator()(const NodeTermParen *term_paren) const
+                    {
+                        return size(term_paren->expr);
+                    }
+
+                    size_t operator()(const NodeTermCall *term_call) const
+                    {
+                        size_t total = 1;
+
+                        for (const NodeExpr *arg : term_call->args)
+                        {
+                            total += size(arg);
+                        }
+
+                        return total;
+                    }
+
+                    size_t operator()(const NodeTermIndex *term_index) const
+                    {
+                        return 1 + size(term_index->index);
+                    }
+
+                    size_t operator()(const NodeTermNot *term_not) const
+                    {
+                        return 1 + size(term_not->expr);
+                    }
+                };
+
+                return std::visit(TermVisitor{}, term->var);
+            }
+
+            size_t operator()(const NodeBinExpr *bin_expr) const
+            {
+                return std::visit([](const auto *bin)
+                                  { return 1 + size(bin->lhs) + size(bin->rhs); },
+                                  bin_expr->var);
+            }
+        };
+
+        return std::visit(ExprVisitor{}, expr->var);
+    }
+
+    // Counts reads of each name in `expr`.
+    static void count_uses(const NodeExpr *expr, std::unordered_map<std::string, size_t> &uses)
+    {
+        struct ExprVisitor
+        {
+            std::unordered_map<std::string, size_t> &uses;
+
+            void operator()(const NodeTerm *term) const
+            {
+                struct TermVisitor
+                {
+                    std::unordered_map<std::string, size_t> &uses;
+
+                    void operator()(const NodeTermIntLit *) const
+                    {
+                    }
+
+                    void operator()(const NodeTermIdent *term_ident) const
+                    {
+                        uses[term_ident->ident.value.value()]++;
+                    }
+
+                    void operator()(const NodeTermParen *term_paren) const
+                    {
+                        count_uses(term_paren->expr, uses);
+                    }
+
+                    void operator()(const NodeTermCall *term_call) const
+                    {
+                        for (const NodeExpr *arg : term_call->args)
+                        {
+                            count_uses(arg, uses);
+                        }
+                    }
+
+                    void operator()(const NodeTermIndex *term_index) const
+                    {
+                        uses[term_index->ident.value.value()]++;
+                        count_uses(term_index->index, uses);
+                    }
+
+                    void operator()(const NodeTermNot *term_not) const
+                    {
+                        count_uses(term_not->expr, uses);
+                    }
+                };
+
+                std::visit(TermVisitor{.uses = uses}, term->var);
+            }
+
+            void operator()(const NodeBinExpr *bin_expr) const
+            {
+                std::visit([&](const auto *bin)
+                           {
+                               count_uses(bin->lhs, uses);
+                               count_uses(bin->rhs, uses); },
+                           bin_expr->var);
+            }
+        };
+
+        std::visit(ExprVisitor{.uses = uses}, expr->var);
+    }
+
+    // Whether some part of `expr` may be skipped by `&&` or `||`.
+    static bool short_circuits(const NodeExpr *expr)
+    {
+        struct ExprVisitor
+        {
+            bool operator()(const NodeTerm *term) const
+            {
+                struct TermVisitor
+                {
+                    bool operator()(const NodeTermIntLit *) const
+                    {
+                        return false;
+                    }
+
+                    bool operator()(const NodeTermIdent *) const
+                    {
+                        return false;
+                    }
+
+                    bool operator()(const NodeTermParen *term_paren) const
+                    {
+                        return short_circuits(term_paren->expr);
+                    }
+
+                    bool operator()(const NodeTermCall *term_call) const
+                    {
+                        return std::any_of(term_call->args.cbegin(), term_call->args.cend(), short_circuits);
+                    }
+
+                    bool operator()(const NodeTermIndex *term_index) const
+                    {
+                        return short_circuits(term_index->index);
+                    }
+
+                    bool operator()(const NodeTermNot *term_not) const
+                    {
+                        return short_circuits(term_not->expr);
+                    }
+                };
+
+                return std::visit(TermVisitor{}, term->var);
+            }
+
+            bool operator()(const NodeBinExpr *bin_expr) const
+            {
+                if (std::holds_alternative<NodeBinExprAnd *>(bin_expr->var) ||
+                    std::holds_alternative<NodeBinExprOr *>(bin_expr->var))
+                {
+                    return true;
+                }
+
+                return std::visit([](const auto *bin)
+                                  { return short_circuits(bin->lhs) || short_circuits(bin->rhs); },
+                                  bin_expr->var);
+            }
+        };
+
+        return std::visit(ExprVisitor{}, expr->var);
+    }
+
+    bool is_array(const NodeExpr *expr) const
+    {
+        if (!std::holds_alternative<NodeTerm *>(expr->var))
+        {
+            return false;
+        }
+
+        const NodeTerm *term = std::get<NodeTerm *>(expr->var);
+
+        return std::holds_alternative<NodeTermIdent *>(term->var) &&
+               m_arrays.contains(std::get<NodeTermIdent *>(term->var)->ident.value.value());
+    }
+
+    static bool is_trivial(const NodeExpr *expr)
+    {
+        if (!std::holds_alternative<NodeTerm *>(expr->var))
+        {
+            return false;
+        }
+
+        const NodeTerm *term = std::get<NodeTerm *>(expr->var);
+
+        return std::holds_alternative<NodeTermIntLit *>(term->var) || std::holds_alternative<NodeTermIdent *>(term->var);
+    }
+
+    // The expression to substitute for a call to `fn`, if `fn` qualifies.
+    static const NodeExpr *inline_body(const NodeFn *fn)
+    {
+        if (fn->scope->stmts.size() != 1 || !std::holds_alternative<NodeStmtReturn *>(fn->scope->stmts.front()->var))
+        {
+            return nullptr;
+        }
+
+        const NodeExpr *body = std::get<NodeStmtReturn *>(fn->scope->stmts.front()->var)->expr;
+
+        std::unordered_map<std::string, size_t> uses;
+        count_uses(body, uses);
+
+        for (const auto &[name, count] : uses)
+        {
+            // Leave undeclared names to the generator's error reporting.
+            if (std::find_if(fn->params.cbegin(), fn->params.cend(), [&](const NodeStmtLet *param)
+                             { return param->ident.value.value() == name; }) == fn->params.cend())
+            {
+                return nullptr;
+            }
+        }
+
+        for (size_t i = 0; i < fn->params.size(); i++)
+        {
+            if (fn->params[i]->type != IntType::i64)
+            {
+                return nullptr;
+            }
+
+            for (size_t j = 0; j < i; j++)
+            {
+                if (fn->params[i]->ident.value.value() == fn->params[j]->ident.value.value())
+                {
+                    return nullptr;
+                }
+            }
+        }
+
+        return size(body) <= budget ? body : nullptr;
+    }
+
+    bool should_inline(const NodeFn *fn, const NodeTermCall *term_call, const NodeExpr *body) const
+    {
+        if (term_call->args.size() != fn->params.size() || m_expanding.size() > max_depth)
+        {
+            return false;
+        }
+
+        if (std::find(m_expanding.cbegin(), m_expanding.cend(), fn) != m_expanding.cend())
+        {
+            return false;
+        }
+
+        std::unordered_map<std::string, size_t> uses;
+        count_uses(body, uses);
+
+        size_t effects = DeadStoreEliminator::is_pure(body) ? 0 : 1;
+
+        for (size_t i = 0; i < fn->params.size(); i++)
+        {
+            const NodeExpr *arg = term_call->args[i];
+            const size_t count = uses[fn->params[i]->ident.value.value()];
+
+            if (is_array(arg))
+            {
+                return false;
+            }
+
+            if (count > 1 && !is_trivial(arg))
+            {
+                return false;
+            }
+
+            if (!DeadStoreEliminator::is_pure(arg))
+            {
+                // A call evaluates every argument, but the body might skip
+                // the one place that reads it.
+                if (count == 0 || short_circuits(body))
+                {
+                    return false;
+                }
+
+                effects++;
+            }
+        }
+
+        // With a single effect there is no order to preserve.
+        return effects <= 1;
+    }
+
+    NodeExpr *substitute(const NodeExpr *expr, const std::unordered_map<std::string, NodeExpr *> &args,
+                         std::unordered_map<std::string, size_t> &used)
+    {
+        struct ExprVisitor
+        {
+            Inliner &inliner;
+            const std::unordered_map<std::string, NodeExpr *> &args;
+            std::unordered_map<std::string, size_t> &used;
+
+            NodeExpr *operator()(const NodeTerm *term) const
+            {
+                struct TermVisitor
+                {
+                    Inliner &inliner;
+                    const std::unordered_map<std::string, NodeExpr *> &args;
+                    std::unordered_map<std::string, size_t> &used;
+
+                    NodeExpr *operator()(const NodeTermIntLit *term_int_lit) const
+                    {
+                        auto copy = inliner.m_allocator.emplace<NodeTermIntLit>(term_int_lit->int_lit);
+                        return inliner.term_expr(copy);
+                    }
+
+                    NodeExpr *operator()(const NodeTermIdent *term_ident) const
+                    {
+                        const std::string &name = term_ident->ident.value.value();
+                        const auto it = args.find(name);
+
+                        if (it == args.end())
+                        {
+                            auto copy = inliner.m_allocator.emplace<NodeTermIdent>(term_ident->ident);
+                            return inliner.term_expr(copy);
+                        }
+
+                        // The argument node itself is used once; further uses
+                        // are of trivial arguments and get their own copy.
+                        if (used[name]++ == 0)
+                        {
+                            return it->second;
+                        }
+
+                        std::unordered_map<std::string, size_t> none;
+                        return inliner.substitute(it->second, {}, none);
+                    }
+
+                    NodeExpr *operator()(const NodeTermParen *term_paren) const
+                    {
+                        auto copy = inliner.m_allocator.emplace<NodeTermParen>(inliner.substitute(term_paren->expr, args, used));
+                        return inliner.term_expr(copy);
+                    }
+
+                    NodeExpr *operator()(const NodeTermCall *term_call) const
+                    {
+                        auto copy = inliner.m_allocator.emplace<NodeTermCall>(term_call->ident);
+
+                        for (const NodeExpr *arg : term_call->args)
+                        {
+                            copy->args.push_back(inliner.substitute(arg, args, used));
+                        }
+
+                        return inliner.term_expr(copy);
+                    }
+
+                    NodeExpr *operator()(const NodeTermIndex *term_index) const
+                    {
+                        auto copy = inliner.m_allocator.emplace<NodeTermIndex>(term_index->ident,
+                                                                               inliner.substitute(term_index->index, args, used));
+                        return inliner.term_expr(copy);
+                    }
+
+                    NodeExpr *operator()(const NodeTermNot *term_not) const
+                    {
+                        auto copy = inliner.m_allocator.emplace<NodeTermNot>(inliner.substitute(term_not->expr, args, used));
+                        return inliner.term_expr(copy);
+                    }
+                };
+
+                return std::visit(TermVisitor{.inliner = inliner, .args = args, .used = used}, term->var);
+            }
+
+            NodeExpr *operator()(const NodeBinExpr *bin_expr) const
+            {
+                return std::visit([&](const auto *bin)
+                                  {
+                                      using Bin = std::remove_cvref_t<decltype(*bin)>;
+
+                                      auto copy = inliner.m_allocator.emplace<Bin>(inliner.substitute(bin->lhs, args, used),
+                                                                                   inliner.substitute(bin->rhs, args, used));
+                                      auto copy_bin = inliner.m_allocator.emplace<NodeBinExpr>(copy);
+
+                                      return inliner.m_allocator.emplace<NodeExpr>(copy_bin); },
+                                  bin_expr->var);
+            }
+        };
+
+        return std::visit(ExprVisitor{.inliner = *this, .args = args, .used = used}, expr->var);
+    }
+
+    template <typename T>
+    NodeExpr *term_expr(T *node)
+    {
+        auto term = m_allocator.emplace<NodeTerm>(node);
+        return m_allocator.emplace<NodeExpr>(term);
+    }
+
+    void inline_term(NodeTerm *term)
+    {
+        if (std::holds_alternative<NodeTermParen *>(term->var))
+        {
+            inline_expr(std::get<NodeTermParen *>(term->var)->expr);
+            return;
+        }
+
+        if (std::holds_alternative<NodeTermIndex *>(term->var))
+        {
+            inline_expr(std::get<NodeTermIndex *>(term->var)->index);
+            return;
+        }
+
+        if (std::holds_alternative<NodeTermNot *>(term->var))
+        {
+            inline_expr(std::get<NodeTermNot *>(term->var)->expr);
+            return;
+        }
+
+        if (!std::holds_alternative<NodeTermCall *>(term->var))
+        {
+            return;
+        }
+
+        const NodeTermCall *term_call = std::get<NodeTermCall *>(term->var);
+
+        for (NodeExpr *arg : term_call->args)
+        {
+            inline_expr(arg);
+        }
+
+        const auto it = m_fns.find(term_call->ident.value.value());
+
+        if (it == m_fns.end())
+        {
+            return;
+        }
+
+        const NodeFn *fn = it->second;
+        const NodeExpr *body = inline_body(fn);
+
+        if (body == nullptr || !should_inline(fn, term_call, body))
+        {
+            return;
+        }
+
+        std::unordered_map<std::string, NodeExpr *> args;
+
+        for (size_t i = 0; i < fn->params.size(); i++)
+        {
+            args[fn->params[i]->ident.value.value()] = term_call->args[i];
+        }
+
+        std::unordered_map<std::string, size_t> used;
+        NodeExpr *expr = substitute(body, args, used);
+
+        term->var = m_allocator.emplace<NodeTermParen>(expr);
+        m_stats.calls_inlined++;
+
+        // The callee's own calls are now calls from here.
+        m_expanding.push_back(fn);
+        inline_expr(expr);
+        m_expanding.pop_back();
+    }
+
+    void inline_expr(NodeExpr *expr)
+    {
+        struct ExprVisitor
+        {
+            Inliner &inliner;
+
+            void operator()(NodeTerm *term) const
+            {
+                inliner.inline_term(term);
+            }
+
+            void operator()(NodeBinExpr *bin_expr) const
+            {
+                std::visit([&](auto *bin)
+                           {
+                               inliner.inline_expr(bin->lhs);
+                               inliner.inline_expr(bin->rhs); },
+                           bin_expr->var);
+            }
+        };
+
+        std::visit(ExprVisitor{.inliner = *this}, expr->var);
+    }
+
+    void inline_scope(NodeScope *scope)
+    {
+        inline_stmts(scope->stmts);
+    }
+
+    void inline_if_pred(NodeIfPred *pred)
+    {
+        struct PredVisitor
+        {
+            Inliner &inliner;
+
+            void operator()(NodeIfPredElse *else_cond) const
+            {
+                inliner.inline_scope(else_cond->scope);
+            }
+
+            void operator()(NodeIfPredElif *elif) const
+            {
+                inliner.inline_expr(elif->expr);
+                inliner.inline_scope(elif->scope);
+
+                if (elif->pred.has_value())
+                {
+                    inliner.inline_if_pred(elif->pred.value());
+                }
+            }
+        };
+
+        std::visit(PredVisitor{.inliner = *this}, pred->var);
+    }
+
+    void inline_stmts(std::vector<NodeStmt *> &stmts)
+    {
+        struct StmtVisitor
+        {
+            Inliner &inliner;
+
+            void operator()(NodeStmtExit *stmt_exit) const
+            {
+                inliner.inline_expr(stmt_exit->expr);
+            }
+
+            void operator()(NodeStmtPrint *stmt_print) const
+            {
+                inliner.inline_expr(stmt_print->expr);
+            }
+
+            void operator()(NodeStmtLet *stmt_let) const
+            {
+                if (stmt_let->length != 0)
+                {
+                    inliner.m_arrays.insert(stmt_let->ident.value.value());
+                }
+
+                if (stmt_let->expr != nullptr)
+                {
+                    inliner.inline_expr(stmt_let->expr);
+                }
+            }
+
+            void operator()(NodeScope *scope) const
+            {
+                inliner.inline_scope(scope);
+            }
+
+            void operator()(NodeStmtIf *stmt_if) const
+            {
+                inliner.inline_expr(stmt_if->expr);
+                inliner.inline_scope(stmt_if->scope);
+
+                if (stmt_if->pred.has_value())
+                {
+                    inliner.inline_if_pred(stmt_if->pred.value());
+                }
+            }
+
+            void operator()(NodeStmtAssign *stmt_assign) const
+            {
+                if (stmt_assign->index != nullptr)
+                {
+                    inliner.inline_expr(stmt_assign->index);
+                }
+
+                inliner.inline_expr(stmt_assign->expr);
+            }
+
+            void operator()(NodeStmtWhile *stmt_while) const
+            {
+                inliner.inline_expr(stmt_while->expr);
+                inliner.inline_scope(stmt_while->scope);
+            }
+
+            void operator()(NodeStmtReturn *stmt_return) const
+            {
+                inliner.inline_expr(stmt_return->expr);
+            }
+
+            void operator()(NodeStmtMatch *stmt_match) const
+            {
+                inliner.inline_expr(stmt_match->expr);
+
+                for (const NodeMatchArm &arm : stmt_match->arms)
+                {
+                    inliner.inline_scope(arm.scope);
+                }
+
+                if (stmt_match->otherwise != nullptr)
+                {
+                    inliner.inline_scope(stmt_match->otherwise);
+                }
+            }
+        };
+
+        for (NodeStmt *stmt : stmts)
+        {
+            std::visit(StmtVisitor{.inliner = *this}, stmt->var);
+        }
+    }
+
+    NodeProg &m_prog;
+    ArenaAllocator &m_allocator;
+    InlineStats m_stats{};
+    std::unordered_map<std::string, NodeFn *> m_fns{};
+    // Functions whose body is being expanded, to stop at recursion.
+    std::vector<const NodeFn *> m_expanding{};
+    // Names declared as an array anywhere seen so far.
+    std::unordered_set<std::string> m_arrays{};
+};
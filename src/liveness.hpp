@@ -0,0 +1,811 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "./parser.hpp"
+
+struct DeadStoreStats
+{
+    size_t stores_removed = 0;
+    size_t lets_removed = 0;
+};
+
+// Backward liveness analysis over the AST. Assignments whose value is never
+// read are removed, dead `let` initializers are dropped, and variables that
+// are never referenced lose their slot altogether. Only expressions without
+// side effects are discarded; a division may trap, so it is kept unless the
+// divisor is a non-zero literal, and so is an array element read. A store to
+// one element leaves the rest of the array live and is always kept, and an
+// expression reading a whole array is kept for the generator to check its
+// use. Loops are solved by iterating the body to a fixed point before
+// anything inside it is removed.
+class DeadStoreEliminator
+{
+public:
+    explicit DeadStoreEliminator(NodeProg &prog)
+        : m_prog(prog)
+    {
+    }
+
+    DeadStoreStats run()
+    {
+        while (true)
+        {
+            if (!resolve())
+            {
+                // Leave programs with name errors untouched so the generator
+                // still reports them.
+                break;
+            }
+
+            const size_t before = m_stats.stores_removed + m_stats.lets_removed;
+
+            remove_unused_lets(m_prog.stmts);
+
+            LiveSet live;
+            live_stmts(m_prog.stmts, live);
+
+            for (NodeFn *fn : m_prog.fns)
+            {
+                remove_unused_lets(fn->scope->stmts);
+
+                LiveSet fn_live;
+                live_stmts(fn->scope->stmts, fn_live);
+            }
+
+            if (m_stats.stores_removed + m_stats.lets_removed == before)
+            {
+                break;
+            }
+        }
+
+        return m_stats;
+    }
+
+    // Whether evaluating `expr` can be skipped without changing behaviour.
+    static bool is_pure(const NodeExpr *expr)
+    {
+        struct ExprVisitor
+        {
+            bool operator()(const NodeTerm *term) const
+            {
+                if (std::holds_alternative<NodeTermParen *>(term->var))
+                {
+                    return is_pure(std::get<NodeTermParen *>(term->var)->expr);
+                }
+
+                if (std::holds_alternative<NodeTermNot *>(term->var))
+                {
+                    return is_pure(std::get<NodeTermNot *>(term->var)->expr);
+                }
+
+                // A call may exit the program, and an index may be out of
+                // bounds.
+                return !std::holds_alternative<NodeTermCall *>(term->var) &&
+                       !std::holds_alternative<NodeTermIndex *>(term->var);
+            }
+
+            bool operator()(const NodeBinExpr *bin_expr) const
+            {
+                if (std::holds_alternative<NodeBinExprDiv *>(bin_expr->var))
+                {
+                    const auto *div = std::get<NodeBinExprDiv *>(bin_expr->var);
+
+                    if (!is_nonzero_lit(div->rhs))
+                    {
+                        return false;
+                    }
+                }
+
+                return std::visit([](const auto *bin)
+                                  { return is_pure(bin->lhs) && is_pure(bin->rhs); },
+                                  bin_expr->var);
+            }
+        };
+
+        return std::visit(ExprVisitor{}, expr->var);
+    }
+
+    static bool is_nonzero_lit(const NodeExpr *expr)
+    {
+        if (!std::holds_alternative<NodeTerm *>(expr->var))
+        {
+            return false;
+        }
+
+        const NodeTerm *term = std::get<NodeTerm *>(expr->var);
+
+        if (!std::holds_alternative<NodeTermIntLit *>(term->var))
+        {
+            return false;
+        }
+
+        const std::string &value = std::get<NodeTermIntLit *>(term->var)->int_lit.value.value();
+        return value.find_first_not_of('0') != std::string::npos;
+    }
+
+private:
+    using LiveSet = std::unordered_set<const NodeStmtLet *>;
+
+    bool discardable(const NodeExpr *expr) const
+    {
+        return is_pure(expr) && !reads_array(expr);
+    }
+
+    bool reads_array(const NodeExpr *expr) const
+    {
+        struct ExprVisitor
+        {
+            const DeadStoreEliminator &dse;
+
+            bool operator()(const NodeTerm *term) const
+            {
+                if (std::holds_alternative<NodeTermParen *>(term->var))
+                {
+                    return dse.reads_array(std::get<NodeTermParen *>(term->var)->expr);
+                }
+
+                if (std::holds_alternative<NodeTermNot *>(term->var))
+                {
+                    return dse.reads_array(std::get<NodeTermNot *>(term->var)->expr);
+                }
+
+                if (!std::holds_alternative<NodeTermIdent *>(term->var))
+                {
+                    return false;
+                }
+
+                const NodeStmtLet *decl = dse.m_idents.at(std::get<NodeTermIdent *>(term->var));
+                return decl != nullptr && decl->length != 0;
+            }
+
+            bool operator()(const NodeBinExpr *bin_expr) const
+            {
+                return std::visit([&](const auto *bin)
+                                  { return dse.reads_array(bin->lhs) || dse.reads_array(bin->rhs); },
+                                  bin_expr->var);
+            }
+        };
+
+        return std::visit(ExprVisitor{.dse = *this}, expr->var);
+    }
+
+    struct VarUses
+    {
+        size_t reads = 0;
+        size_t writes = 0;
+    };
+
+    struct Decl
+    {
+        std::string name;
+        const NodeStmtLet *let;
+    };
+
+    // Forward walk binding every identifier to its declaration, using the
+    // same visibility rules as the generator.
+    bool resolve()
+    {
+        m_decls.clear();
+        m_idents.clear();
+        m_indexes.clear();
+        m_assigns.clear();
+        m_uses.clear();
+        m_valid = true;
+
+        for (const NodeStmt *stmt : m_prog.stmts)
+        {
+            resolve_stmt(stmt);
+        }
+
+        // Functions only see their parameters and their own variables.
+        for (const NodeFn *fn : m_prog.fns)
+        {
+            m_decls.clear();
+
+            for (const NodeStmtLet *param : fn->params)
+            {
+                declare(param);
+            }
+
+            resolve_scope(fn->scope);
+        }
+
+        return m_valid;
+    }
+
+    void declare(const NodeStmtLet *stmt_let)
+    {
+        const std::string &name = stmt_let->ident.value.value();
+
+        if (std::find_if(m_decls.cbegin(), m_decls.cend(), [&](const Decl &decl)
+                         { return decl.name == name; }) != m_decls.cend())
+        {
+            m_valid = false;
+        }
+
+        m_decls.push_back({.name = name, .let = stmt_let});
+        m_uses[stmt_let];
+    }
+
+    const NodeStmtLet *lookup(const std::string &name)
+    {
+        const auto it = std::find_if(m_decls.crbegin(), m_decls.crend(), [&](const Decl &decl)
+                                     { return decl.name == name; });
+
+        if (it == m_decls.crend())
+        {
+            m_valid = false;
+            return nullptr;
+        }
+
+        return it->let;
+    }
+
+    void resolve_expr(const NodeExpr *expr)
+    {
+        struct ExprVisitor
+        {
+            DeadStoreEliminator &dse;
+
+            void operator()(const NodeTerm *term) const
+            {
+                struct TermVisitor
+                {
+                    DeadStoreEliminator &dse;
+
+                    void operator()(const NodeTermIntLit *) const
+                    {
+                    }
+
+                    void operator()(const NodeTermIdent *term_ident) const
+                    {
+                        const NodeStmtLet *decl = dse.lookup(term_ident->ident.value.value());
+                        dse.m_idents[term_ident] = decl;
+                        dse.m_uses[decl].reads++;
+                    }
+
+                    void operator()(const NodeTermParen *term_paren) const
+                    {
+                        dse.resolve_expr(term_paren->expr);
+                    }
+
+                    void operator()(const NodeTermCall *term_call) const
+                    {
+                        for (const NodeExpr *arg : term_call->args)
+                        {
+                            dse.resolve_expr(arg);
+                        }
+                    }
+
+                    void operator()(const NodeTermIndex *term_index) const
+                    {
+                        const NodeStmtLet *decl = dse.lookup(term_index->ident.value.value());
+                        dse.m_indexes[term_index] = decl;
+                        dse.m_uses[decl].reads++;
+
+                        dse.resolve_expr(term_index->index);
+                    }
+
+                    void operator()(const NodeTermNot *term_not) const
+                    {
+                        dse.resolve_expr(term_not->expr);
+                    }
+                };
+
+                std::visit(TermVisitor{.dse = dse}, term->var);
+            }
+
+            void operator()(const NodeBinExpr *bin_expr) const
+            {
+                std::visit([&](const auto *bin)
+                           {
+                               dse.resolve_expr(bin->lhs);
+                               dse.resolve_expr(bin->rhs); },
+                           bin_expr->var);
+            }
+        };
+
+        std::visit(ExprVisitor{.dse = *this}, expr->var);
+    }
+
+    void resolve_scope(const NodeScope *scope)
+    {
+        const size_t mark = m_decls.size();
+
+        for (const NodeStmt *stmt : scope->stmts)
+        {
+            resolve_stmt(stmt);
+        }
+
+        m_decls.resize(mark);
+    }
+
+    void resolve_if_pred(const NodeIfPred *pred)
+    {
+        struct PredVisitor
+        {
+            DeadStoreEliminator &dse;
+
+            void operator()(const NodeIfPredElse *else_cond) const
+            {
+                dse.resolve_scope(else_cond->scope);
+            }
+
+            void operator()(const NodeIfPredElif *elif) const
+            {
+                dse.resolve_expr(elif->expr);
+                dse.resolve_scope(elif->scope);
+
+                if (elif->pred.has_value())
+                {
+                    dse.resolve_if_pred(elif->pred.value());
+                }
+            }
+        };
+
+        std::visit(PredVisitor{.dse = *this}, pred->var);
+    }
+
+    void resolve_stmt(const NodeStmt *stmt)
+    {
+        struct StmtVisitor
+        {
+            DeadStoreEliminator &dse;
+
+            void operator()(const NodeStmtExit *stmt_exit) const
+            {
+                dse.resolve_expr(stmt_exit->expr);
+            }
+
+            void operator()(const NodeStmtPrint *stmt_print) const
+            {
+                dse.resolve_expr(stmt_print->expr);
+            }
+
+            void operator()(const NodeStmtLet *stmt_let) const
+            {
+                dse.declare(stmt_let);
+
+                if (stmt_let->expr != nullptr)
+                {
+                    dse.resolve_expr(stmt_let->expr);
+                }
+            }
+
+            void operator()(const NodeScope *scope) const
+            {
+                dse.resolve_scope(scope);
+            }
+
+            void operator()(const NodeStmtIf *stmt_if) const
+            {
+                dse.resolve_expr(stmt_if->expr);
+                dse.resolve_scope(stmt_if->scope);
+
+                if (stmt_if->pred.has_value())
+                {
+                    dse.resolve_if_pred(stmt_if->pred.value());
+                }
+            }
+
+            void operator()(const NodeStmtWhile *stmt_while) const
+            {
+                dse.resolve_expr(stmt_while->expr);
+                dse.resolve_scope(stmt_while->scope);
+            }
+
+            void operator()(const NodeStmtReturn *stmt_return) const
+            {
+                dse.resolve_expr(stmt_return->expr);
+            }
+
+            void operator()(const NodeStmtMatch *stmt_match) const
+            {
+                dse.resolve_expr(stmt_match->expr);
+
+                for (const NodeMatchArm &arm : stmt_match->arms)
+                {
+                    dse.resolve_scope(arm.scope);
+                }
+
+                if (stmt_match->otherwise != nullptr)
+                {
+                    dse.resolve_scope(stmt_match->otherwise);
+                }
+            }
+
+            void operator()(const NodeStmtAssign *stmt_assign) const
+            {
+                const NodeStmtLet *decl = dse.lookup(stmt_assign->ident.value.value());
+                dse.m_assigns[stmt_assign] = decl;
+                dse.m_uses[decl].writes++;
+
+                if (stmt_assign->index != nullptr)
+                {
+                    dse.resolve_expr(stmt_assign->index);
+                }
+
+                dse.resolve_expr(stmt_assign->expr);
+            }
+        };
+
+        std::visit(StmtVisitor{.dse = *this}, stmt->var);
+    }
+
+    // Adds every variable read by `expr` to `live`.
+    void gen_uses(const NodeExpr *expr, LiveSet &live) const
+    {
+        struct ExprVisitor
+        {
+            const DeadStoreEliminator &dse;
+            LiveSet &live;
+
+            void operator()(const NodeTerm *term) const
+            {
+                struct TermVisitor
+                {
+                    const DeadStoreEliminator &dse;
+                    LiveSet &live;
+
+                    void operator()(const NodeTermIntLit *) const
+                    {
+                    }
+
+                    void operator()(const NodeTermIdent *term_ident) const
+                    {
+                        live.insert(dse.m_idents.at(term_ident));
+                    }
+
+                    void operator()(const NodeTermParen *term_paren) const
+                    {
+                        dse.gen_uses(term_paren->expr, live);
+                    }
+
+                    void operator()(const NodeTermCall *term_call) const
+                    {
+                        for (const NodeExpr *arg : term_call->args)
+                        {
+                            dse.gen_uses(arg, live);
+                        }
+                    }
+
+                    void operator()(const NodeTermIndex *term_index) const
+                    {
+                        live.insert(dse.m_indexes.at(term_index));
+                        dse.gen_uses(term_index->index, live);
+                    }
+
+                    void operator()(const NodeTermNot *term_not) const
+                    {
+                        dse.gen_uses(term_not->expr, live);
+                    }
+                };
+
+                std::visit(TermVisitor{.dse = dse, .live = live}, term->var);
+            }
+
+            void operator()(const NodeBinExpr *bin_expr) const
+            {
+                std::visit([&](const auto *bin)
+                           {
+                               dse.gen_uses(bin->lhs, live);
+                               dse.gen_uses(bin->rhs, live); },
+                           bin_expr->var);
+            }
+        };
+
+        std::visit(ExprVisitor{.dse = *this, .live = live}, expr->var);
+    }
+
+    void live_scope(NodeScope *scope, LiveSet &live)
+    {
+        live_stmts(scope->stmts, live);
+    }
+
+    void live_if_pred(NodeIfPred *pred, LiveSet &live)
+    {
+        struct PredVisitor
+        {
+            DeadStoreEliminator &dse;
+            LiveSet &live;
+
+            void operator()(NodeIfPredElse *else_cond) const
+            {
+                dse.live_scope(else_cond->scope, live);
+            }
+
+            void operator()(NodeIfPredElif *elif) const
+            {
+                LiveSet taken = live;
+                dse.live_scope(elif->scope, taken);
+
+                if (elif->pred.has_value())
+                {
+                    dse.live_if_pred(elif->pred.value(), live);
+                }
+
+                live.insert(taken.begin(), taken.end());
+                dse.gen_uses(elif->expr, live);
+            }
+        };
+
+        std::visit(PredVisitor{.dse = *this, .live = live}, pred->var);
+    }
+
+    // Walks `stmts` backwards, turning the live-out set into the live-in set
+    // and erasing stores nobody reads.
+    void live_stmts(std::vector<NodeStmt *> &stmts, LiveSet &live)
+    {
+        for (size_t i = stmts.size(); i-- > 0;)
+        {
+            struct StmtVisitor
+            {
+                DeadStoreEliminator &dse;
+                LiveSet &live;
+                bool dead = false;
+
+                void operator()(NodeStmtExit *stmt_exit)
+                {
+                    live.clear();
+                    dse.gen_uses(stmt_exit->expr, live);
+                }
+
+                void operator()(NodeStmtReturn *stmt_return)
+                {
+                    live.clear();
+                    dse.gen_uses(stmt_return->expr, live);
+                }
+
+                void operator()(NodeStmtPrint *stmt_print)
+                {
+                    dse.gen_uses(stmt_print->expr, live);
+                }
+
+                void operator()(NodeStmtLet *stmt_let)
+                {
+                    const bool is_live = live.erase(stmt_let) > 0;
+
+                    if (stmt_let->expr == nullptr)
+                    {
+                        return;
+                    }
+
+                    if (!is_live && dse.discardable(stmt_let->expr))
+                    {
+                        if (!dse.m_dry_run)
+                        {
+                            stmt_let->expr = nullptr;
+                            dse.m_stats.stores_removed++;
+                        }
+
+                        return;
+                    }
+
+                    dse.gen_uses(stmt_let->expr, live);
+                }
+
+                void operator()(NodeScope *scope)
+                {
+                    dse.live_scope(scope, live);
+                }
+
+                void operator()(NodeStmtIf *stmt_if)
+                {
+                    LiveSet taken = live;
+                    dse.live_scope(stmt_if->scope, taken);
+
+                    if (stmt_if->pred.has_value())
+                    {
+                        dse.live_if_pred(stmt_if->pred.value(), live);
+                    }
+
+                    live.insert(taken.begin(), taken.end());
+                    dse.gen_uses(stmt_if->expr, live);
+                }
+
+                // Without an `else` arm, no arm running is one more path.
+                void operator()(NodeStmtMatch *stmt_match)
+                {
+                    const LiveSet out = live;
+
+                    if (stmt_match->otherwise != nullptr)
+                    {
+                        dse.live_scope(stmt_match->otherwise, live);
+                    }
+
+                    for (const NodeMatchArm &arm : stmt_match->arms)
+                    {
+                        LiveSet taken = out;
+                        dse.live_scope(arm.scope, taken);
+                        live.insert(taken.begin(), taken.end());
+                    }
+
+                    dse.gen_uses(stmt_match->expr, live);
+                }
+
+                void operator()(NodeStmtWhile *stmt_while)
+                {
+                    // Live at the loop head: whatever the exit path, the
+                    // condition or the next iteration may read.
+                    LiveSet head = live;
+                    dse.gen_uses(stmt_while->expr, head);
+
+                    const bool dry_run = dse.m_dry_run;
+                    dse.m_dry_run = true;
+
+                    while (true)
+                    {
+                        LiveSet next = head;
+                        dse.live_scope(stmt_while->scope, next);
+                        next.insert(head.begin(), head.end());
+
+                        if (next.size() == head.size())
+                        {
+                            break;
+                        }
+
+                        head = std::move(next);
+                    }
+
+                    dse.m_dry_run = dry_run;
+
+                    LiveSet body = head;
+                    dse.live_scope(stmt_while->scope, body);
+
+                    live = std::move(head);
+                }
+
+                void operator()(NodeStmtAssign *stmt_assign)
+                {
+                    const NodeStmtLet *decl = dse.m_assigns.at(stmt_assign);
+
+                    if (stmt_assign->index != nullptr)
+                    {
+                        dse.gen_uses(stmt_assign->index, live);
+                        dse.gen_uses(stmt_assign->expr, live);
+                        return;
+                    }
+
+                    if (!live.contains(decl) && dse.discardable(stmt_assign->expr))
+                    {
+                        if (!dse.m_dry_run)
+                        {
+                            dse.m_stats.stores_removed++;
+                            dead = true;
+                        }
+
+                        return;
+                    }
+
+                    live.erase(decl);
+                    dse.gen_uses(stmt_assign->expr, live);
+                }
+            };
+
+            StmtVisitor visitor{.dse = *this, .live = live};
+            std::visit(visitor, stmts[i]->var);
+
+            if (visitor.dead)
+            {
+                stmts.erase(stmts.begin() + static_cast<std::ptrdiff_t>(i));
+            }
+        }
+    }
+
+    // Removes `let` statements for variables that are never read nor written.
+    // Runs on freshly resolved counts, so stores erased by the previous
+    // liveness round are already accounted for.
+    void remove_unused_lets(std::vector<NodeStmt *> &stmts)
+    {
+        std::erase_if(stmts, [&](NodeStmt *stmt)
+                      {
+                          struct StmtVisitor
+                          {
+                              DeadStoreEliminator &dse;
+
+                              bool operator()(const NodeStmtLet *stmt_let) const
+                              {
+                                  const VarUses &uses = dse.m_uses[stmt_let];
+
+                                  if (uses.reads > 0 || uses.writes > 0)
+                                  {
+                                      return false;
+                                  }
+
+                                  if (stmt_let->expr != nullptr && !dse.discardable(stmt_let->expr))
+                                  {
+                                      return false;
+                                  }
+
+                                  dse.m_stats.lets_removed++;
+                                  return true;
+                              }
+
+                              bool operator()(NodeScope *scope) const
+                              {
+                                  dse.remove_unused_lets(scope->stmts);
+                                  return false;
+                              }
+
+                              bool operator()(NodeStmtIf *stmt_if) const
+                              {
+                                  dse.remove_unused_lets(stmt_if->scope->stmts);
+
+                                  std::optional<NodeIfPred *> pred = stmt_if->pred;
+
+                                  while (pred.has_value())
+                                  {
+                                      if (std::holds_alternative<NodeIfPredElse *>(pred.value()->var))
+                                      {
+                                          dse.remove_unused_lets(std::get<NodeIfPredElse *>(pred.value()->var)->scope->stmts);
+                                          break;
+                                      }
+
+                                      const auto *elif = std::get<NodeIfPredElif *>(pred.value()->var);
+                                      dse.remove_unused_lets(elif->scope->stmts);
+                                      pred = elif->pred;
+                                  }
+
+                                  return false;
+                              }
+
+                              bool operator()(NodeStmtWhile *stmt_while) const
+                              {
+                                  dse.remove_unused_lets(stmt_while->scope->stmts);
+                                  return false;
+                              }
+
+                              bool operator()(NodeStmtMatch *stmt_match) const
+                              {
+                                  for (const NodeMatchArm &arm : stmt_match->arms)
+                                  {
+                                      dse.remove_unused_lets(arm.scope->stmts);
+                                  }
+
+                                  if (stmt_match->otherwise != nullptr)
+                                  {
+                                      dse.remove_unused_lets(stmt_match->otherwise->stmts);
+                                  }
+
+                                  return false;
+                              }
+
+                              bool operator()(const NodeStmtExit *) const
+                              {
+                                  return false;
+                              }
+
+                              bool operator()(const NodeStmtPrint *) const
+                              {
+                                  return false;
+                              }
+
+                              bool operator()(const NodeStmtReturn *) const
+                              {
+                                  return false;
+                              }
+
+                              bool operator()(const NodeStmtAssign *) const
+                              {
+                                  return false;
+                              }
+                          };
+
+                          return std::visit(StmtVisitor{.dse = *this}, stmt->var); });
+    }
+
+    NodeProg &m_prog;
+    DeadStoreStats m_stats{};
+    bool m_valid = true;
+    bool m_dry_run = false;
+    std::vector<Decl> m_decls{};
+    std::unordered_map<const NodeTermIdent *, const NodeStmtLet *> m_idents{};
+    std::unordered_map<const NodeTermIndex *, const NodeStmtLet *> m_indexes{};
+    std::unordered_map<const NodeStmtAssign *, const NodeStmtLet *> m_assigns{};
+    std::unordered_map<const NodeStmtLet *, VarUses> m_uses{};
+};
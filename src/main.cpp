@@ -2,61 +2,94 @@
 #include <iostream>
 #include <variant>
 
-#include "./tokenization.hpp"
-#include "./parser.hpp"
-#include "./generation.hpp"
+#include "./batch.hpp"
+#include "./driver.hpp"
+#include "./server.hpp"
+#include "./watch.hpp"
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    const std::optional<Options> options = parse_args(std::vector<std::string>(argv + 1, argv + argc));
+
+    if (!options.has_value())
     {
-        std::cerr << "Incorrect usage." << std::endl;
-        std::cerr << "hydro <input.hy>" << std::endl;
+        print_usage(std::cerr);
         return EXIT_FAILURE;
     }
 
-    std::filesystem::path file_path = argv[1];
+    switch (options->mode)
+    {
+    case Options::Mode::superopt:
+    {
+        Superoptimizer superopt;
+        SuperoptStats stats;
+        const RewriteTable table = superopt.search(stats);
+
+        std::fstream file(options->superopt_path.value(), std::ios::out);
+        table.save(file);
+
+        std::cout << "superopt: " << stats.rules << " rules for " << stats.shapes << " shapes, "
+                  << stats.candidates << " candidates verified in " << stats.seconds << "s" << std::endl;
 
-    if (!std::filesystem::exists(file_path))
+        return EXIT_SUCCESS;
+    }
+
+    case Options::Mode::cache_stats:
     {
-        std::cerr << "The file " << file_path << " does not exist." << std::endl;
-        return EXIT_FAILURE;
+        const CacheStats stats = CompileCache(options->cache_dir, options->cache_size << 20).stats();
+
+        std::cout << "cache: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.entries
+                  << " entries using " << stats.bytes << " bytes in " << options->cache_dir << std::endl;
+
+        return EXIT_SUCCESS;
     }
 
-    if (!file_path.has_extension() || file_path.extension() != ".hy")
+    case Options::Mode::show_profile:
     {
-        std::cerr << "Invalid Hydrogen file." << std::endl;
-        return EXIT_FAILURE;
+        std::fstream file(options->profile_path.value(), std::ios::in | std::ios::binary);
+        const std::optional<Profile> profile = Profile::load(file);
+
+        if (!profile.has_value())
+        {
+            std::cerr << "Invalid profile " << options->profile_path.value() << "." << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        profile->print(std::cout);
+
+        return EXIT_SUCCESS;
     }
 
-    std::string contents;
+    case Options::Mode::watch:
     {
-        std::stringstream contents_stream;
-        std::fstream input(file_path, std::ios::in);
-        contents_stream << input.rdbuf();
-        contents = contents_stream.str();
+        WatchSession session(options.value(), options->inputs.front(), options->output.value_or("out"),
+                             std::filesystem::current_path(), std::cout, std::cerr);
+        return session.run();
     }
 
-    Tokenizer tokenizer(std::move(contents));
-    std::vector<Token> tokens = tokenizer.tokenize();
+    case Options::Mode::server:
+    {
+        CompileServer server(options->socket.value_or(default_socket_path()), options->jobs);
+        return server.run();
+    }
 
-    Parser parser(std::move(tokens));
-    std::optional<NodeProg> prog = parser.parse_prog();
+    case Options::Mode::client:
+        return run_client(options->socket.value_or(default_socket_path()), options->forward);
 
-    if (!prog.has_value())
-    {
-        std::cerr << "Invalid program." << std::endl;
-        exit(EXIT_FAILURE);
+    case Options::Mode::compile:
+        break;
     }
 
+    std::optional<std::string> source;
+
+    if (options->inputs.front() == "-")
     {
-        Generator generator(prog.value());
-        std::fstream file("out.asm", std::ios::out);
-        file << generator.gen_prog();
+        std::stringstream ss;
+        ss << std::cin.rdbuf();
+        source = ss.str();
     }
 
-    system("nasm -felf64 out.asm");
-    system("ld out.o -o out");
+    ArenaAllocator arena(arena_size);
 
-    return EXIT_SUCCESS;
+    return compile_all(options.value(), std::filesystem::current_path(), arena, std::cout, std::cerr, std::move(source));
 }
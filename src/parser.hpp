@@ -1,8 +1,16 @@
 #pragma once
 
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <variant>
 #include <vector>
 
 #include "./arena.hpp"
+#include "./error.hpp"
 
 struct NodeExpr;
 
@@ -21,6 +29,24 @@ struct NodeTermParen
     NodeExpr *expr;
 };
 
+struct NodeTermCall
+{
+    Token ident;
+    std::vector<NodeExpr *> args{};
+};
+
+struct NodeTermIndex
+{
+    Token ident;
+    NodeExpr *index;
+};
+
+// `!expr`: 1 when `expr` is 0, and 0 otherwise.
+struct NodeTermNot
+{
+    NodeExpr *expr;
+};
+
 struct NodeBinExprAdd
 {
     NodeExpr *lhs;
@@ -45,14 +71,67 @@ struct NodeBinExprDiv
     NodeExpr *rhs;
 };
 
+struct NodeBinExprAnd
+{
+    NodeExpr *lhs;
+    NodeExpr *rhs;
+};
+
+struct NodeBinExprOr
+{
+    NodeExpr *lhs;
+    NodeExpr *rhs;
+};
+
+struct NodeBinExprEq
+{
+    NodeExpr *lhs;
+    NodeExpr *rhs;
+};
+
+struct NodeBinExprNe
+{
+    NodeExpr *lhs;
+    NodeExpr *rhs;
+};
+
+struct NodeBinExprLt
+{
+    NodeExpr *lhs;
+    NodeExpr *rhs;
+};
+
+struct NodeBinExprLe
+{
+    NodeExpr *lhs;
+    NodeExpr *rhs;
+};
+
+struct NodeBinExprGt
+{
+    NodeExpr *lhs;
+    NodeExpr *rhs;
+};
+
+struct NodeBinExprGe
+{
+    NodeExpr *lhs;
+    NodeExpr *rhs;
+};
+
 struct NodeBinExpr
 {
-    std::variant<NodeBinExprAdd *, NodeBinExprSub *, NodeBinExprMulti *, NodeBinExprDiv *> var;
+    // `&&` and `||` evaluate their right operand only when the left one
+    // does not decide the result. Comparisons are unsigned and give 0 or 1.
+    std::variant<NodeBinExprAdd *, NodeBinExprSub *, NodeBinExprMulti *, NodeBinExprDiv *, NodeBinExprAnd *,
+                 NodeBinExprOr *, NodeBinExprEq *, NodeBinExprNe *, NodeBinExprLt *, NodeBinExprLe *, NodeBinExprGt *,
+                 NodeBinExprGe *>
+        var;
 };
 
 struct NodeTerm
 {
-    std::variant<NodeTermIntLit *, NodeTermIdent *, NodeTermParen *> var;
+    std::variant<NodeTermIntLit *, NodeTermIdent *, NodeTermParen *, NodeTermCall *, NodeTermIndex *, NodeTermNot *> var;
 };
 
 struct NodeExpr
@@ -65,10 +144,32 @@ struct NodeStmtExit
     NodeExpr *expr;
 };
 
+// Writes the value of `expr` as an unsigned decimal and a newline to
+// standard output, which is buffered until it fills up or the program exits.
+struct NodeStmtPrint
+{
+    NodeExpr *expr;
+};
+
+// How many bits a variable keeps. Expressions are always unsigned 64-bit;
+// storing into a narrower variable keeps the low bits, and reading it back
+// extends them with zeros (u8) or with the sign (i32), so an i32 holds the
+// same values as an i64 for anything that fits.
+enum class IntType
+{
+    i64,
+    i32,
+    u8
+};
+
 struct NodeStmtLet
 {
     Token ident;
     NodeExpr *expr{};
+    // The number of elements of an array, whose initializer is applied
+    // element-wise; 0 for a scalar.
+    size_t length = 0;
+    IntType type = IntType::i64;
 };
 
 struct NodeScope;
@@ -80,11 +181,13 @@ struct NodeIfPredElif
     NodeExpr *expr;
     NodeScope *scope;
     std::optional<NodeIfPred *> pred;
+    int line = 0;
 };
 
 struct NodeIfPredElse
 {
     NodeScope *scope;
+    int line = 0;
 };
 
 struct NodeIfPred
@@ -97,43 +200,91 @@ struct NodeStmtIf
     NodeExpr *expr;
     NodeScope *scope;
     std::optional<NodeIfPred *> pred;
+    int line = 0;
 };
 
 struct NodeStmt;
 
+// One `K => { ... }` arm of a match.
+struct NodeMatchArm
+{
+    uint64_t value;
+    NodeScope *scope;
+};
+
+// Runs the arm whose value equals `expr`, or `otherwise` (the `else` arm)
+// when there is one and no value does. Arms never fall through.
+struct NodeStmtMatch
+{
+    NodeExpr *expr;
+    std::vector<NodeMatchArm> arms{};
+    NodeScope *otherwise{};
+    int line = 0;
+};
+
 struct NodeScope
 {
     std::vector<NodeStmt *> stmts;
+    // The line of the opening brace.
+    int line = 0;
+};
+
+struct NodeStmtWhile
+{
+    NodeExpr *expr;
+    NodeScope *scope;
+    int line = 0;
+};
+
+struct NodeStmtReturn
+{
+    NodeExpr *expr;
 };
 
 struct NodeStmtAssign
 {
     Token ident;
     NodeExpr *expr{};
+    // The element assigned by `a[i] = ...`. Assigning a whole array is
+    // element-wise.
+    NodeExpr *index{};
 };
 
 struct NodeStmt
 {
-    std::variant<NodeStmtExit *, NodeStmtLet *, NodeScope *, NodeStmtIf *, NodeStmtAssign *> var;
+    std::variant<NodeStmtExit *, NodeStmtLet *, NodeScope *, NodeStmtIf *, NodeStmtAssign *, NodeStmtWhile *, NodeStmtReturn *,
+                 NodeStmtMatch *, NodeStmtPrint *>
+        var;
+    // The line the statement starts on; 0 for statements made by a pass.
+    int line = 0;
+};
+
+struct NodeFn
+{
+    Token ident;
+    // Parameters are declared like variables without an initializer; their
+    // values arrive in registers.
+    std::vector<NodeStmtLet *> params{};
+    NodeScope *scope{};
 };
 
 struct NodeProg
 {
+    std::vector<NodeFn *> fns;
     std::vector<NodeStmt *> stmts;
 };
 
 class Parser
 {
 public:
-    explicit Parser(std::vector<Token> tokens)
-        : m_tokens(std::move(tokens)), m_allocator(1024 * 1024 * 4) // 4 mb
+    explicit Parser(std::vector<Token> tokens, ArenaAllocator &allocator)
+        : m_tokens(std::move(tokens)), m_allocator(allocator)
     {
     }
 
     void error_expected_term(const std::string term) const
     {
-        std::cerr << "Expected `" << term << "` on line " << peek(-1).value().line << "." << std::endl;
-        exit(EXIT_FAILURE);
+        compile_error_at(peek(-1).value().line, "Expected `", term, "`");
     }
 
     std::optional<NodeTerm *> parse_term()
@@ -148,20 +299,69 @@ public:
 
         if (auto ident = try_consume(TokenType::ident))
         {
+            if (try_consume(TokenType::open_bracket))
+            {
+                auto term_index = m_allocator.emplace<NodeTermIndex>(ident.value(), parse_index());
+
+                auto term = m_allocator.emplace<NodeTerm>(term_index);
+
+                return term;
+            }
+
+            if (try_consume(TokenType::open_paren))
+            {
+                auto term_call = m_allocator.emplace<NodeTermCall>(ident.value());
+
+                if (!try_consume(TokenType::close_paren))
+                {
+                    do
+                    {
+                        if (const auto arg = parse_expr())
+                        {
+                            term_call->args.push_back(arg.value());
+                        }
+                        else
+                        {
+                            compile_error_at(peek(-1).value().line, "Expected expression");
+                        }
+                    } while (try_consume(TokenType::comma));
+
+                    try_consume_err(TokenType::close_paren);
+                }
+
+                auto term = m_allocator.emplace<NodeTerm>(term_call);
+
+                return term;
+            }
+
             auto term_ident = m_allocator.emplace<NodeTermIdent>(ident.value());
             auto term = m_allocator.emplace<NodeTerm>(term_ident);
 
             return term;
         }
 
+        if (const auto bang = try_consume(TokenType::bang))
+        {
+            const auto operand = parse_term();
+
+            if (!operand.has_value())
+            {
+                compile_error_at(bang.value().line, "Expected expression");
+            }
+
+            auto term_not = m_allocator.emplace<NodeTermNot>(m_allocator.emplace<NodeExpr>(operand.value()));
+            auto term = m_allocator.emplace<NodeTerm>(term_not);
+
+            return term;
+        }
+
         if (const auto open_paren = try_consume(TokenType::open_paren))
         {
             auto expr = parse_expr();
 
             if (!expr.has_value())
             {
-                std::cerr << "Expected expression on line " << open_paren.value().line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(open_paren.value().line, "Expected expression");
             }
 
             try_consume_err(TokenType::close_paren);
@@ -212,8 +412,7 @@ public:
 
             if (!expr_rhs.has_value())
             {
-                std::cerr << "Unable to parse expression on line " << line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(line, "Unable to parse expression");
             }
 
             auto expr = m_allocator.emplace<NodeBinExpr>();
@@ -241,6 +440,46 @@ public:
                 auto div = m_allocator.emplace<NodeBinExprDiv>(expr_lhs2, expr_rhs.value());
                 expr->var = div;
             }
+            else if (type == TokenType::and_and)
+            {
+                auto and_ = m_allocator.emplace<NodeBinExprAnd>(expr_lhs2, expr_rhs.value());
+                expr->var = and_;
+            }
+            else if (type == TokenType::or_or)
+            {
+                auto or_ = m_allocator.emplace<NodeBinExprOr>(expr_lhs2, expr_rhs.value());
+                expr->var = or_;
+            }
+            else if (type == TokenType::eq_eq)
+            {
+                auto eq = m_allocator.emplace<NodeBinExprEq>(expr_lhs2, expr_rhs.value());
+                expr->var = eq;
+            }
+            else if (type == TokenType::bang_eq)
+            {
+                auto ne = m_allocator.emplace<NodeBinExprNe>(expr_lhs2, expr_rhs.value());
+                expr->var = ne;
+            }
+            else if (type == TokenType::lt)
+            {
+                auto lt = m_allocator.emplace<NodeBinExprLt>(expr_lhs2, expr_rhs.value());
+                expr->var = lt;
+            }
+            else if (type == TokenType::lt_eq)
+            {
+                auto le = m_allocator.emplace<NodeBinExprLe>(expr_lhs2, expr_rhs.value());
+                expr->var = le;
+            }
+            else if (type == TokenType::gt)
+            {
+                auto gt = m_allocator.emplace<NodeBinExprGt>(expr_lhs2, expr_rhs.value());
+                expr->var = gt;
+            }
+            else if (type == TokenType::gt_eq)
+            {
+                auto ge = m_allocator.emplace<NodeBinExprGe>(expr_lhs2, expr_rhs.value());
+                expr->var = ge;
+            }
 
             expr_lhs->var = expr;
         }
@@ -250,12 +489,15 @@ public:
 
     std::optional<NodeScope *> parse_scope()
     {
-        if (!try_consume(TokenType::open_curly).has_value())
+        const auto open_curly = try_consume(TokenType::open_curly);
+
+        if (!open_curly.has_value())
         {
             return {};
         }
 
         auto scope = m_allocator.emplace<NodeScope>();
+        scope->line = open_curly.value().line;
 
         while (auto stmt = parse_stmt())
         {
@@ -267,13 +509,26 @@ public:
         return scope;
     }
 
+    NodeScope *parse_match_scope()
+    {
+        const auto scope = parse_scope();
+
+        if (!scope.has_value())
+        {
+            compile_error_at(peek(-1).value().line, "Expected scope");
+        }
+
+        return scope.value();
+    }
+
     std::optional<NodeIfPred *> parse_if_pred()
     {
-        if (try_consume(TokenType::elif))
+        if (const auto elif_token = try_consume(TokenType::elif))
         {
             try_consume_err(TokenType::open_paren);
 
             const auto elif = m_allocator.emplace<NodeIfPredElif>();
+            elif->line = elif_token.value().line;
 
             if (const auto expr = parse_expr())
             {
@@ -281,8 +536,7 @@ public:
             }
             else
             {
-                std::cerr << "Expected expression on line " << peek(-1).value().line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(peek(-1).value().line, "Expected expression");
             }
 
             try_consume_err(TokenType::close_paren);
@@ -293,8 +547,7 @@ public:
             }
             else
             {
-                std::cerr << "Expected scope on line " << peek(-1).value().line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(peek(-1).value().line, "Expected scope");
             }
 
             elif->pred = parse_if_pred();
@@ -303,9 +556,10 @@ public:
             return pred;
         }
 
-        if (try_consume(TokenType::else_cond))
+        if (const auto else_token = try_consume(TokenType::else_cond))
         {
             const auto else_cond = m_allocator.emplace<NodeIfPredElse>();
+            else_cond->line = else_token.value().line;
 
             if (const auto scope = parse_scope())
             {
@@ -313,8 +567,7 @@ public:
             }
             else
             {
-                std::cerr << "Expected scope on line " << peek(-1).value().line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(peek(-1).value().line, "Expected scope");
             }
 
             auto pred = m_allocator.emplace<NodeIfPred>(else_cond);
@@ -325,13 +578,25 @@ public:
     }
 
     std::optional<NodeStmt *> parse_stmt()
+    {
+        const std::optional<Token> first = peek();
+        const std::optional<NodeStmt *> stmt = parse_stmt_kind();
+
+        if (stmt.has_value())
+        {
+            stmt.value()->line = first.value().line;
+        }
+
+        return stmt;
+    }
+
+    std::optional<NodeStmt *> parse_stmt_kind()
     {
         if (peek().has_value() && peek().value().type == TokenType::exit)
         {
             if (peek(1).has_value() && peek(1).value().type != TokenType::open_paren)
             {
-                std::cerr << "Missing `(` on line " << peek(1).value().line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(peek(1).value().line, "Missing `(`");
             }
 
             consume();
@@ -345,8 +610,7 @@ public:
             }
             else
             {
-                std::cerr << "Invalid expression on line " << peek(-1).value().line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(peek(-1).value().line, "Invalid expression");
             }
 
             try_consume_err(TokenType::close_paren);
@@ -359,18 +623,39 @@ public:
             return stmt;
         }
 
+        if (try_consume(TokenType::print))
+        {
+            try_consume_err(TokenType::open_paren);
+
+            auto stmt_print = m_allocator.emplace<NodeStmtPrint>();
+
+            if (const auto node_expr = parse_expr())
+            {
+                stmt_print->expr = node_expr.value();
+            }
+            else
+            {
+                compile_error_at(peek(-1).value().line, "Invalid expression");
+            }
+
+            try_consume_err(TokenType::close_paren);
+            try_consume_err(TokenType::semi);
+
+            auto stmt = m_allocator.emplace<NodeStmt>(stmt_print);
+            return stmt;
+        }
+
         if (peek().has_value() && peek().value().type == TokenType::let)
         {
             if (peek(1).has_value() && peek(1).value().type != TokenType::ident)
             {
-                std::cerr << "Missing variable identifier on line " << peek(1).value().line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(peek(1).value().line, "Missing variable identifier");
             }
 
-            if (peek(2).has_value() && peek(2).value().type != TokenType::eq)
+            if (peek(2).has_value() && peek(2).value().type != TokenType::eq &&
+                peek(2).value().type != TokenType::open_bracket && peek(2).value().type != TokenType::colon)
             {
-                std::cerr << "Missing `=` on line " << peek(2).value().line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(peek(2).value().line, "Missing `=`");
             }
 
             consume(); // Consume the 'let' token.
@@ -378,7 +663,32 @@ public:
             auto stmt_let = m_allocator.emplace<NodeStmtLet>();
             stmt_let->ident = consume();
 
-            consume(); // Consume the equal sign.
+            if (try_consume(TokenType::open_bracket))
+            {
+                const Token length = try_consume_err(TokenType::int_lit);
+                const std::string &digits = length.value.value();
+
+                if (digits.find_first_not_of('0') == std::string::npos || digits.size() > 6 ||
+                    std::stoul(digits) > max_array_length)
+                {
+                    compile_error_at(length.line, "Array length must be between 1 and ", max_array_length);
+                }
+
+                stmt_let->length = std::stoul(digits);
+                try_consume_err(TokenType::close_bracket);
+            }
+
+            if (const auto colon = try_consume(TokenType::colon))
+            {
+                if (stmt_let->length != 0)
+                {
+                    compile_error_at(colon->line, "Array elements are always i64");
+                }
+
+                stmt_let->type = parse_type();
+            }
+
+            try_consume_err(TokenType::eq);
 
             if (const auto node_expr = parse_expr())
             {
@@ -386,8 +696,7 @@ public:
             }
             else
             {
-                std::cerr << "Invalid expression on line " << peek(-1).value().line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(peek(-1).value().line, "Invalid expression");
             }
 
             try_consume_err(TokenType::semi);
@@ -400,16 +709,21 @@ public:
 
         if (peek().has_value() && peek().value().type == TokenType::ident)
         {
-            if (peek(1).has_value() && peek(1).value().type != TokenType::eq)
+            if (peek(1).has_value() && peek(1).value().type != TokenType::eq &&
+                peek(1).value().type != TokenType::open_bracket)
             {
-                std::cerr << "Missing `=` on line " << peek(1).value().line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(peek(1).value().line, "Missing `=`");
             }
 
             const auto assign = m_allocator.emplace<NodeStmtAssign>();
             assign->ident = consume();
 
-            consume(); // Consume the equal sign.
+            if (try_consume(TokenType::open_bracket))
+            {
+                assign->index = parse_index();
+            }
+
+            try_consume_err(TokenType::eq);
 
             if (const auto expr = parse_expr())
             {
@@ -417,8 +731,7 @@ public:
             }
             else
             {
-                std::cerr << "Invalid expression on line " << peek(-1).value().line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(peek(-1).value().line, "Invalid expression");
             }
 
             try_consume_err(TokenType::semi);
@@ -437,8 +750,7 @@ public:
                 return stmt;
             }
 
-            std::cerr << "Invalid scope on line " << peek(-1).value().line << "." << std::endl;
-            exit(EXIT_FAILURE);
+            compile_error_at(peek(-1).value().line, "Invalid scope");
         }
 
         if (auto if_cond = try_consume(TokenType::if_cond))
@@ -446,6 +758,7 @@ public:
             try_consume_err(TokenType::open_paren);
 
             auto stmt_if = m_allocator.emplace<NodeStmtIf>();
+            stmt_if->line = if_cond.value().line;
 
             if (const auto expr = parse_expr())
             {
@@ -453,8 +766,7 @@ public:
             }
             else
             {
-                std::cerr << "Invalid expression on line " << peek(-1).value().line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(peek(-1).value().line, "Invalid expression");
             }
 
             try_consume_err(TokenType::close_paren);
@@ -465,8 +777,7 @@ public:
             }
             else
             {
-                std::cerr << "Invalid scope on line " << peek(-1).value().line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(peek(-1).value().line, "Invalid scope");
             }
 
             stmt_if->pred = parse_if_pred();
@@ -475,23 +786,187 @@ public:
             return stmt;
         }
 
+        if (const auto while_loop = try_consume(TokenType::while_loop))
+        {
+            try_consume_err(TokenType::open_paren);
+
+            auto stmt_while = m_allocator.emplace<NodeStmtWhile>();
+            stmt_while->line = while_loop.value().line;
+
+            if (const auto expr = parse_expr())
+            {
+                stmt_while->expr = expr.value();
+            }
+            else
+            {
+                compile_error_at(peek(-1).value().line, "Invalid expression");
+            }
+
+            try_consume_err(TokenType::close_paren);
+
+            if (auto scope = parse_scope())
+            {
+                stmt_while->scope = scope.value();
+            }
+            else
+            {
+                compile_error_at(peek(-1).value().line, "Invalid scope");
+            }
+
+            auto stmt = m_allocator.emplace<NodeStmt>(stmt_while);
+            return stmt;
+        }
+
+        if (const auto match = try_consume(TokenType::match))
+        {
+            try_consume_err(TokenType::open_paren);
+
+            auto stmt_match = m_allocator.emplace<NodeStmtMatch>();
+            stmt_match->line = match.value().line;
+
+            if (const auto expr = parse_expr())
+            {
+                stmt_match->expr = expr.value();
+            }
+            else
+            {
+                compile_error_at(peek(-1).value().line, "Invalid expression");
+            }
+
+            try_consume_err(TokenType::close_paren);
+            try_consume_err(TokenType::open_curly);
+
+            while (const auto value = try_consume(TokenType::int_lit))
+            {
+                std::string digits = value.value().value.value();
+                digits.erase(0, std::min(digits.find_first_not_of('0'), digits.size() - 1));
+
+                uint64_t number = 0;
+
+                if (std::from_chars(digits.data(), digits.data() + digits.size(), number).ec ==
+                    std::errc::result_out_of_range)
+                {
+                    compile_error_at(value.value().line, "Match value out of range: ", digits);
+                }
+
+                if (std::find_if(stmt_match->arms.cbegin(), stmt_match->arms.cend(), [&](const NodeMatchArm &arm)
+                                 { return arm.value == number; }) != stmt_match->arms.cend())
+                {
+                    compile_error_at(value.value().line, "Duplicate match value: ", digits);
+                }
+
+                try_consume_err(TokenType::fat_arrow);
+                stmt_match->arms.push_back({.value = number, .scope = parse_match_scope()});
+            }
+
+            if (try_consume(TokenType::else_cond))
+            {
+                try_consume_err(TokenType::fat_arrow);
+                stmt_match->otherwise = parse_match_scope();
+            }
+
+            try_consume_err(TokenType::close_curly);
+
+            auto stmt = m_allocator.emplace<NodeStmt>(stmt_match);
+            return stmt;
+        }
+
+        if (const auto return_stmt = try_consume(TokenType::return_stmt))
+        {
+            if (!m_in_fn)
+            {
+                compile_error_at(return_stmt.value().line, "Unexpected `return` outside of a function");
+            }
+
+            auto stmt_return = m_allocator.emplace<NodeStmtReturn>();
+
+            if (const auto expr = parse_expr())
+            {
+                stmt_return->expr = expr.value();
+            }
+            else
+            {
+                compile_error_at(peek(-1).value().line, "Invalid expression");
+            }
+
+            try_consume_err(TokenType::semi);
+
+            auto stmt = m_allocator.emplace<NodeStmt>(stmt_return);
+            return stmt;
+        }
+
         return {};
     }
 
+    std::optional<NodeFn *> parse_fn()
+    {
+        if (!try_consume(TokenType::fn).has_value())
+        {
+            return {};
+        }
+
+        auto fn = m_allocator.emplace<NodeFn>();
+        fn->ident = try_consume_err(TokenType::ident);
+
+        try_consume_err(TokenType::open_paren);
+
+        if (!try_consume(TokenType::close_paren))
+        {
+            do
+            {
+                auto param = m_allocator.emplace<NodeStmtLet>();
+                param->ident = try_consume_err(TokenType::ident);
+
+                if (try_consume(TokenType::colon))
+                {
+                    param->type = parse_type();
+                }
+
+                fn->params.push_back(param);
+            } while (try_consume(TokenType::comma));
+
+            try_consume_err(TokenType::close_paren);
+        }
+
+        m_in_fn = true;
+
+        if (const auto scope = parse_scope())
+        {
+            fn->scope = scope.value();
+        }
+        else
+        {
+            compile_error_at(peek(-1).value().line, "Invalid scope");
+        }
+
+        m_in_fn = false;
+
+        return fn;
+    }
+
+    // How many tokens have been consumed so far.
+    [[nodiscard]] size_t position() const
+    {
+        return m_index;
+    }
+
     std::optional<NodeProg> parse_prog()
     {
         NodeProg prog;
 
         while (peek().has_value())
         {
-            if (auto stmt = parse_stmt())
+            if (auto fn = parse_fn())
+            {
+                prog.fns.push_back(fn.value());
+            }
+            else if (auto stmt = parse_stmt())
             {
                 prog.stmts.push_back(stmt.value());
             }
             else
             {
-                std::cerr << "Invalid statement on line " << peek(-1).value().line << "." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(peek(-1).value().line, "Invalid statement");
             }
         }
 
@@ -499,6 +974,48 @@ public:
     }
 
 private:
+    // Arrays live in the stack frame, so they are kept well below the
+    // stack limit.
+    static constexpr size_t max_array_length = 65536;
+
+    IntType parse_type()
+    {
+        const Token type = try_consume_err(TokenType::ident);
+        const std::string &name = type.value.value();
+
+        if (name == "i64")
+        {
+            return IntType::i64;
+        }
+
+        if (name == "i32")
+        {
+            return IntType::i32;
+        }
+
+        if (name == "u8")
+        {
+            return IntType::u8;
+        }
+
+        compile_error_at(type.line, "Unknown type: ", name);
+    }
+
+    // The index between brackets, after the opening one.
+    NodeExpr *parse_index()
+    {
+        const auto index = parse_expr();
+
+        if (!index.has_value())
+        {
+            compile_error_at(peek(-1).value().line, "Expected expression");
+        }
+
+        try_consume_err(TokenType::close_bracket);
+
+        return index.value();
+    }
+
     [[nodiscard]] std::optional<Token> peek(const int offset = 0) const
     {
         if (m_index + offset >= m_tokens.size())
@@ -537,5 +1054,6 @@ private:
 
     const std::vector<Token> m_tokens;
     size_t m_index = 0;
-    ArenaAllocator m_allocator;
+    bool m_in_fn = false;
+    ArenaAllocator &m_allocator;
 };
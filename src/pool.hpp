@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads running a known batch of tasks. Tasks are dealt out
+// round robin; each worker runs its own queue from the back and, once that
+// is empty, steals from the front of the others, so one slow task does not
+// leave the rest of its queue waiting.
+class WorkStealingPool
+{
+public:
+    explicit WorkStealingPool(const size_t workers)
+        : m_queues(std::max<size_t>(1, workers))
+    {
+    }
+
+    void submit(std::function<void(size_t)> task)
+    {
+        Queue &queue = m_queues[m_next++ % m_queues.size()];
+        std::lock_guard lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+
+    // Runs every submitted task and returns once all of them have finished.
+    // Each task is given the index of the worker running it, so per-worker
+    // state such as an arena can be indexed without locking.
+    void run()
+    {
+        std::vector<std::thread> threads;
+
+        for (size_t i = 1; i < m_queues.size(); i++)
+        {
+            threads.emplace_back([this, i]
+                                 { work(i); });
+        }
+
+        work(0);
+
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return m_queues.size();
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void(size_t)>> tasks;
+    };
+
+    std::optional<std::function<void(size_t)>> take(const size_t worker)
+    {
+        {
+            Queue &own = m_queues[worker];
+            std::lock_guard lock(own.mutex);
+
+            if (!own.tasks.empty())
+            {
+                auto task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return task;
+            }
+        }
+
+        for (size_t i = 1; i < m_queues.size(); i++)
+        {
+            Queue &victim = m_queues[(worker + i) % m_queues.size()];
+            std::lock_guard lock(victim.mutex);
+
+            if (!victim.tasks.empty())
+            {
+                auto task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return task;
+            }
+        }
+
+        return {};
+    }
+
+    // No task is submitted while the pool runs, so a full sweep that finds
+    // nothing means the work is done.
+    void work(const size_t worker)
+    {
+        while (auto task = take(worker))
+        {
+            task.value()(worker);
+        }
+    }
+
+    std::vector<Queue> m_queues;
+    size_t m_next = 0;
+};
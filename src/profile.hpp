@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <iomanip>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <vector>
+
+// The kinds of basic block an instrumented program counts.
+enum class BlockKind : uint64_t
+{
+    entry,
+    scope,
+    if_arm,
+    elif_arm,
+    else_arm,
+    // After an if chain, where every arm rejoins.
+    join,
+    loop_body,
+    loop_exit,
+    fn,
+};
+
+inline const char *to_string(const BlockKind kind)
+{
+    switch (kind)
+    {
+    case BlockKind::entry:
+        return "entry";
+    case BlockKind::scope:
+        return "scope";
+    case BlockKind::if_arm:
+        return "if";
+    case BlockKind::elif_arm:
+        return "elif";
+    case BlockKind::else_arm:
+        return "else";
+    case BlockKind::join:
+        return "join";
+    case BlockKind::loop_body:
+        return "loop";
+    case BlockKind::loop_exit:
+        return "loop exit";
+    case BlockKind::fn:
+        return "fn";
+    }
+
+    return "unknown";
+}
+
+struct ProfileEntry
+{
+    int line = 0;
+    BlockKind kind = BlockKind::entry;
+    uint64_t count = 0;
+};
+
+// Execution counts written by a program built with `--instrument`. The
+// file is little-endian 64-bit words: the magic, the number of counters
+// `n`, `n` pairs of source line and block kind, then the `n` counts.
+struct Profile
+{
+    // "HYPROF01" read as a little-endian word.
+    static constexpr uint64_t magic = 0x3130464f52505948;
+
+    std::vector<ProfileEntry> entries{};
+
+    static std::optional<Profile> load(std::istream &in)
+    {
+        const auto word = [&](uint64_t &value)
+        {
+            return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof(value)));
+        };
+
+        uint64_t value = 0;
+        uint64_t size = 0;
+
+        if (!word(value) || value != magic || !word(size))
+        {
+            return {};
+        }
+
+        Profile profile;
+
+        for (uint64_t i = 0; i < size; i++)
+        {
+            uint64_t line = 0;
+            uint64_t kind = 0;
+
+            if (!word(line) || !word(kind) || kind > static_cast<uint64_t>(BlockKind::fn))
+            {
+                return {};
+            }
+
+            profile.entries.push_back({.line = static_cast<int>(line), .kind = static_cast<BlockKind>(kind)});
+        }
+
+        for (ProfileEntry &entry : profile.entries)
+        {
+            if (!word(entry.count))
+            {
+                return {};
+            }
+        }
+
+        return profile;
+    }
+
+    // The same block can be counted more than once, e.g. when a call is
+    // inlined in several places, so counts are summed.
+    [[nodiscard]] uint64_t count(const int line, const BlockKind kind) const
+    {
+        uint64_t total = 0;
+
+        for (const ProfileEntry &entry : entries)
+        {
+            if (entry.line == line && entry.kind == kind)
+            {
+                total += entry.count;
+            }
+        }
+
+        return total;
+    }
+
+    void print(std::ostream &out) const
+    {
+        out << std::left << std::setw(8) << "line" << std::setw(12) << "block" << std::right << "count" << std::endl;
+
+        for (const ProfileEntry &entry : entries)
+        {
+            out << std::left << std::setw(8) << entry.line << std::setw(12) << to_string(entry.kind) << std::right
+                << entry.count << std::endl;
+        }
+    }
+};
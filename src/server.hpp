@@ -0,0 +1,404 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "./batch.hpp"
+#include "./driver.hpp"
+
+// Messages on the socket are a count followed by that many length-prefixed
+// strings. A request carries the client's working directory, its standard
+// input (used when the input is `-`) and its arguments; the reply carries
+// the exit status, standard output and standard error.
+namespace wire
+{
+    // Sends with MSG_NOSIGNAL, so a peer that hung up before its reply
+    // fails the write instead of killing the process with SIGPIPE.
+    inline bool write_all(const int fd, const char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            const ssize_t written = ::send(fd, data, size, MSG_NOSIGNAL);
+
+            if (written <= 0)
+            {
+                return false;
+            }
+
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+
+        return true;
+    }
+
+    inline bool read_all(const int fd, char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            const ssize_t got = read(fd, data, size);
+
+            if (got <= 0)
+            {
+                return false;
+            }
+
+            data += got;
+            size -= static_cast<size_t>(got);
+        }
+
+        return true;
+    }
+
+    inline bool send(const int fd, const std::vector<std::string> &parts)
+    {
+        std::string buffer;
+
+        const auto put = [&](const uint32_t value)
+        {
+            buffer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        };
+
+        put(static_cast<uint32_t>(parts.size()));
+
+        for (const std::string &part : parts)
+        {
+            put(static_cast<uint32_t>(part.size()));
+            buffer += part;
+        }
+
+        return write_all(fd, buffer.data(), buffer.size());
+    }
+
+    // Bounds on what a peer may announce, checked before anything is
+    // allocated for it.
+    constexpr uint32_t max_parts = 1 << 16;
+    constexpr uint32_t max_part_size = 1 << 28;
+
+    inline std::optional<std::vector<std::string>> receive(const int fd)
+    {
+        uint32_t count = 0;
+
+        if (!read_all(fd, reinterpret_cast<char *>(&count), sizeof(count)) || count > max_parts)
+        {
+            return {};
+        }
+
+        std::vector<std::string> parts;
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t size = 0;
+
+            if (!read_all(fd, reinterpret_cast<char *>(&size), sizeof(size)) || size > max_part_size)
+            {
+                return {};
+            }
+
+            std::string part(size, '\0');
+
+            if (!read_all(fd, part.data(), size))
+            {
+                return {};
+            }
+
+            parts.push_back(std::move(part));
+        }
+
+        return parts;
+    }
+} // namespace wire
+
+inline std::filesystem::path default_socket_path()
+{
+    if (const char *dir = std::getenv("XDG_RUNTIME_DIR"); dir != nullptr && *dir != '\0')
+    {
+        return std::filesystem::path(dir) / "hydro.sock";
+    }
+
+    return std::filesystem::temp_directory_path() / ("hydro-" + std::to_string(getuid()) + ".sock");
+}
+
+inline std::optional<sockaddr_un> socket_address(const std::filesystem::path &path)
+{
+    const std::string name = path.string();
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+
+    if (name.size() >= sizeof(addr.sun_path))
+    {
+        return {};
+    }
+
+    std::copy(name.begin(), name.end(), addr.sun_path);
+
+    return addr;
+}
+
+// Long-lived compiler listening on a Unix socket. Every worker thread
+// accepts connections on the shared socket and keeps its own arena, which
+// is prefaulted once and rewound after each request.
+class CompileServer
+{
+public:
+    explicit CompileServer(std::filesystem::path path, const size_t workers)
+        : m_path(std::move(path)), m_workers(workers)
+    {
+    }
+
+    int run()
+    {
+        const std::optional<sockaddr_un> addr = socket_address(m_path);
+
+        if (!addr.has_value())
+        {
+            std::cerr << "Socket path too long: " << m_path << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        if (const std::optional<std::string> error = claim_path(m_path, addr.value()))
+        {
+            std::cerr << error.value() << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (fd < 0 || bind(fd, reinterpret_cast<const sockaddr *>(&addr.value()), sizeof(sockaddr_un)) != 0 ||
+            listen(fd, 128) != 0)
+        {
+            std::cerr << "Unable to listen on " << m_path << "." << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        std::cout << "hydro: listening on " << m_path.string() << " with " << m_workers << " workers" << std::endl;
+
+        std::vector<std::thread> threads;
+
+        for (size_t i = 0; i < m_workers; i++)
+        {
+            threads.emplace_back([fd]
+                                 { serve(fd); });
+        }
+
+        // Workers only return once the listening socket is unusable.
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+
+        return EXIT_FAILURE;
+    }
+
+private:
+    // Makes `path` free for bind. Only a socket that refuses connections,
+    // left behind by a server that is gone, is removed; a live server's
+    // socket or any other file is reported instead.
+    static std::optional<std::string> claim_path(const std::filesystem::path &path, const sockaddr_un &addr)
+    {
+        struct stat st{};
+
+        if (lstat(path.c_str(), &st) != 0)
+        {
+            // Nothing to remove; bind reports any other problem.
+            return {};
+        }
+
+        if (!S_ISSOCK(st.st_mode))
+        {
+            return "Unable to listen on " + path.string() + ": the path exists and is not a socket.";
+        }
+
+        const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (probe < 0)
+        {
+            return "Unable to listen on " + path.string() + ": " + std::strerror(errno) + ".";
+        }
+
+        const bool live = connect(probe, reinterpret_cast<const sockaddr *>(&addr), sizeof(sockaddr_un)) == 0;
+        const int error = errno;
+        close(probe);
+
+        if (live)
+        {
+            return "Unable to listen on " + path.string() + ": another server is listening there.";
+        }
+
+        if (error != ECONNREFUSED)
+        {
+            return "Unable to listen on " + path.string() + ": the socket is in use (" + std::strerror(error) + ").";
+        }
+
+        unlink(path.c_str());
+
+        return {};
+    }
+
+    static void serve(const int listen_fd)
+    {
+        ArenaAllocator arena(arena_size);
+        arena.prefault();
+
+        // Set while out of descriptors or memory, so the condition is
+        // reported once rather than on every retry.
+        bool starved = false;
+
+        while (true)
+        {
+            const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+
+            if (fd < 0)
+            {
+                const int error = errno;
+
+                if (error == EINTR || error == ECONNABORTED)
+                {
+                    continue;
+                }
+
+                if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM)
+                {
+                    if (!starved)
+                    {
+                        std::cerr << "hydro: unable to accept a connection: " << std::strerror(error)
+                                  << "; retrying." << std::endl;
+                        starved = true;
+                    }
+
+                    std::this_thread::sleep_for(accept_backoff);
+                    continue;
+                }
+
+                std::cerr << "hydro: unable to accept a connection: " << std::strerror(error) << "." << std::endl;
+                return;
+            }
+
+            starved = false;
+
+            // A client that stalls mid-request or stops reading its reply
+            // fails the read or write with EAGAIN once this runs out, and
+            // the connection is dropped rather than holding the worker.
+            const timeval timeout{.tv_sec = io_timeout.count(), .tv_usec = 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            handle(fd, arena);
+            close(fd);
+        }
+    }
+
+    static void handle(const int fd, ArenaAllocator &arena)
+    {
+        const std::optional<std::vector<std::string>> request = wire::receive(fd);
+
+        if (!request.has_value() || request->size() < 2)
+        {
+            return;
+        }
+
+        const std::filesystem::path cwd = request->at(0);
+        const std::vector<std::string> args(request->begin() + 2, request->end());
+
+        std::stringstream out;
+        std::stringstream err;
+        int status = EXIT_FAILURE;
+
+        // Whatever one request throws is reported to its client alone
+        // rather than terminating the worker and every other client.
+        try
+        {
+            const std::optional<Options> options = parse_args(args);
+
+            if (!options.has_value() || options->mode != Options::Mode::compile)
+            {
+                print_usage(err);
+            }
+            else
+            {
+                status = compile_all(options.value(), cwd, arena, out, err, request->at(1));
+            }
+        }
+        catch (const std::exception &error)
+        {
+            arena.reset();
+            status = EXIT_FAILURE;
+            err << "hydro: " << error.what() << std::endl;
+        }
+
+        wire::send(fd, {std::to_string(status), out.str(), err.str()});
+    }
+
+    // How long a worker waits before accepting again once the process is
+    // out of descriptors or memory.
+    static constexpr std::chrono::milliseconds accept_backoff{100};
+
+    // How long a single read or write on a client connection may block.
+    static constexpr std::chrono::seconds io_timeout{10};
+
+    std::filesystem::path m_path;
+    size_t m_workers;
+};
+
+// Forwards a compilation to the server and relays its output and status.
+inline int run_client(const std::filesystem::path &path, const std::vector<std::string> &args)
+{
+    const std::optional<sockaddr_un> addr = socket_address(path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (!addr.has_value() || fd < 0 ||
+        connect(fd, reinterpret_cast<const sockaddr *>(&addr.value()), sizeof(sockaddr_un)) != 0)
+    {
+        std::cerr << "Unable to connect to the compile server at " << path << "." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::string source;
+
+    if (std::find(args.begin(), args.end(), "-") != args.end())
+    {
+        std::stringstream ss;
+        ss << std::cin.rdbuf();
+        source = ss.str();
+    }
+
+    std::vector<std::string> request{std::filesystem::current_path().string(), source};
+    request.insert(request.end(), args.begin(), args.end());
+
+    std::optional<std::vector<std::string>> reply;
+
+    if (wire::send(fd, request))
+    {
+        reply = wire::receive(fd);
+    }
+
+    close(fd);
+
+    if (!reply.has_value() || reply->size() != 3)
+    {
+        std::cerr << "The compile server closed the connection." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << reply->at(1);
+    std::cerr << reply->at(2);
+
+    return std::atoi(reply->at(0).c_str());
+}
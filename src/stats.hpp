@@ -0,0 +1,179 @@
+#pragma once
+
+#include <chrono>
+#include <ctime>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+struct PassTime
+{
+    std::string name;
+    double wall_ms = 0;
+    double cpu_ms = 0;
+};
+
+// Timings and counters for one compilation, filled in by the driver when
+// `--time-passes` or `--stats-json` is given. CPU time is the compiling
+// thread's own, so the figures stay meaningful in a parallel batch; for
+// nasm and ld it is the child's user plus system time.
+struct CompileStats
+{
+    std::string input;
+    std::vector<PassTime> passes{};
+    bool cache_hit = false;
+    size_t tokens = 0;
+    std::map<std::string, size_t> nodes{};
+    size_t arena_bytes = 0;
+    long peak_rss_kib = 0;
+
+    static double thread_cpu_ms()
+    {
+        timespec ts{};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+        return static_cast<double>(ts.tv_sec) * 1e3 + static_cast<double>(ts.tv_nsec) / 1e6;
+    }
+
+    static double usage_cpu_ms(const rusage &usage)
+    {
+        const auto ms = [](const timeval &tv)
+        {
+            return static_cast<double>(tv.tv_sec) * 1e3 + static_cast<double>(tv.tv_usec) / 1e3;
+        };
+
+        return ms(usage.ru_utime) + ms(usage.ru_stime);
+    }
+
+    static long peak_rss()
+    {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+
+        return usage.ru_maxrss;
+    }
+
+    [[nodiscard]] double total_wall_ms() const
+    {
+        double total = 0;
+
+        for (const PassTime &pass : passes)
+        {
+            total += pass.wall_ms;
+        }
+
+        return total;
+    }
+
+    void print(std::ostream &out) const
+    {
+        out << "===== pass timings: " << input << (cache_hit ? " (cache hit)" : "") << " =====" << std::endl;
+        out << "  " << std::left << std::setw(12) << "pass" << std::right << std::setw(12) << "wall ms"
+            << std::setw(12) << "cpu ms" << std::endl;
+
+        double cpu = 0;
+
+        for (const PassTime &pass : passes)
+        {
+            out << "  " << std::left << std::setw(12) << pass.name << std::right << std::fixed << std::setprecision(3)
+                << std::setw(12) << pass.wall_ms << std::setw(12) << pass.cpu_ms << std::endl;
+            cpu += pass.cpu_ms;
+        }
+
+        out << "  " << std::left << std::setw(12) << "total" << std::right << std::setw(12) << total_wall_ms()
+            << std::setw(12) << cpu << std::endl;
+        out.unsetf(std::ios::floatfield);
+        out << std::setprecision(6);
+
+        out << "  tokens: " << tokens << std::endl;
+
+        size_t total_nodes = 0;
+
+        for (const auto &[kind, count] : nodes)
+        {
+            total_nodes += count;
+        }
+
+        out << "  ast nodes: " << total_nodes << std::endl;
+
+        for (const auto &[kind, count] : nodes)
+        {
+            out << "    " << std::left << std::setw(20) << kind << std::right << count << std::endl;
+        }
+
+        out << "  arena: " << arena_bytes << " bytes" << std::endl;
+        out << "  peak rss: " << peak_rss_kib << " KiB" << std::endl;
+    }
+
+    void write_json(std::ostream &out) const
+    {
+        const auto quoted = [](const std::string &text)
+        {
+            std::string result = "\"";
+
+            for (const char c : text)
+            {
+                if (c == '"' || c == '\\')
+                {
+                    result += '\\';
+                }
+
+                result += c;
+            }
+
+            return result + "\"";
+        };
+
+        out << "{\"input\": " << quoted(input) << ", \"cache_hit\": " << (cache_hit ? "true" : "false")
+            << ", \"passes\": [";
+
+        for (size_t i = 0; i < passes.size(); i++)
+        {
+            out << (i > 0 ? ", " : "") << "{\"name\": " << quoted(passes[i].name)
+                << ", \"wall_ms\": " << passes[i].wall_ms << ", \"cpu_ms\": " << passes[i].cpu_ms << "}";
+        }
+
+        out << "], \"wall_ms\": " << total_wall_ms() << ", \"tokens\": " << tokens << ", \"nodes\": {";
+
+        size_t i = 0;
+
+        for (const auto &[kind, count] : nodes)
+        {
+            out << (i++ > 0 ? ", " : "") << quoted(kind) << ": " << count;
+        }
+
+        out << "}, \"arena_bytes\": " << arena_bytes << ", \"peak_rss_kib\": " << peak_rss_kib << "}";
+    }
+};
+
+// Times one pass into `stats`, or just runs it when there are no stats.
+template <typename F>
+decltype(auto) time_pass(CompileStats *stats, const char *name, F &&pass)
+{
+    if (stats == nullptr)
+    {
+        return pass();
+    }
+
+    struct Timer
+    {
+        CompileStats &stats;
+        const char *name;
+        std::chrono::steady_clock::time_point wall = std::chrono::steady_clock::now();
+        double cpu = CompileStats::thread_cpu_ms();
+
+        ~Timer()
+        {
+            const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - wall;
+            stats.passes.push_back({.name = name, .wall_ms = elapsed.count(), .cpu_ms = CompileStats::thread_cpu_ms() - cpu});
+        }
+    };
+
+    Timer timer{.stats = *stats, .name = name};
+
+    return pass();
+}
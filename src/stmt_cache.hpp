@@ -0,0 +1,387 @@
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "./frame.hpp"
+#include "./parser.hpp"
+
+// Structural hash of a statement as the generator sees it: node kinds,
+// identifiers, literals and the frame slot of every `let`. Lines are left
+// out, so moving a statement within the file keeps its hash.
+class AstHasher
+{
+public:
+    explicit AstHasher(const Frame &frame)
+        : m_frame(frame)
+    {
+    }
+
+    uint64_t hash(const NodeStmt *stmt)
+    {
+        m_hash = fnv_offset;
+        hash_stmt(stmt);
+
+        return m_hash;
+    }
+
+    void mix(const uint64_t value)
+    {
+        for (size_t i = 0; i < 8; i++)
+        {
+            m_hash = (m_hash ^ ((value >> (i * 8)) & 0xff)) * fnv_prime;
+        }
+    }
+
+    void mix(const std::string_view text)
+    {
+        mix(text.size());
+
+        for (const char c : text)
+        {
+            m_hash = (m_hash ^ static_cast<unsigned char>(c)) * fnv_prime;
+        }
+    }
+
+    [[nodiscard]] uint64_t value() const
+    {
+        return m_hash;
+    }
+
+private:
+    void hash_expr(const NodeExpr *expr)
+    {
+        struct ExprVisitor
+        {
+            AstHasher &hasher;
+
+            void operator()(const NodeTerm *term) const
+            {
+                struct TermVisitor
+                {
+                    AstHasher &hasher;
+
+                    void operator()(const NodeTermIntLit *term_int_lit) const
+                    {
+                        hasher.mix(1);
+                        hasher.mix(term_int_lit->int_lit.value.value());
+                    }
+
+                    void operator()(const NodeTermIdent *term_ident) const
+                    {
+                        hasher.mix(2);
+                        hasher.mix(term_ident->ident.value.value());
+                    }
+
+                    void operator()(const NodeTermParen *term_paren) const
+                    {
+                        hasher.mix(3);
+                        hasher.hash_expr(term_paren->expr);
+                    }
+
+                    void operator()(const NodeTermCall *term_call) const
+                    {
+                        hasher.mix(4);
+                        hasher.mix(term_call->ident.value.value());
+                        hasher.mix(term_call->args.size());
+
+                        for (const NodeExpr *arg : term_call->args)
+                        {
+                            hasher.hash_expr(arg);
+                        }
+                    }
+
+                    void operator()(const NodeTermIndex *term_index) const
+                    {
+                        hasher.mix(5);
+                        hasher.mix(term_index->ident.value.value());
+                        hasher.hash_expr(term_index->index);
+                    }
+
+                    void operator()(const NodeTermNot *term_not) const
+                    {
+                        hasher.mix(6);
+                        hasher.hash_expr(term_not->expr);
+                    }
+                };
+
+                std::visit(TermVisitor{.hasher = hasher}, term->var);
+            }
+
+            void operator()(const NodeBinExpr *bin_expr) const
+            {
+                hasher.mix(10 + bin_expr->var.index());
+                std::visit([&](const auto *bin)
+                           {
+                               hasher.hash_expr(bin->lhs);
+                               hasher.hash_expr(bin->rhs); },
+                           bin_expr->var);
+            }
+        };
+
+        std::visit(ExprVisitor{.hasher = *this}, expr->var);
+    }
+
+    void hash_scope(const NodeScope *scope)
+    {
+        mix(scope->stmts.size());
+
+        for (const NodeStmt *stmt : scope->stmts)
+        {
+            hash_stmt(stmt);
+        }
+    }
+
+    void hash_pred(const NodeIfPred *pred)
+    {
+        if (const auto elif = std::get_if<NodeIfPredElif *>(&pred->var))
+        {
+            mix(30);
+            hash_expr((*elif)->expr);
+            hash_scope((*elif)->scope);
+
+            if ((*elif)->pred.has_value())
+            {
+                hash_pred((*elif)->pred.value());
+            }
+
+            return;
+        }
+
+        mix(31);
+        hash_scope(std::get<NodeIfPredElse *>(pred->var)->scope);
+    }
+
+    void hash_stmt(const NodeStmt *stmt)
+    {
+        struct StmtVisitor
+        {
+            AstHasher &hasher;
+
+            void operator()(const NodeStmtExit *stmt_exit) const
+            {
+                hasher.mix(20);
+                hasher.hash_expr(stmt_exit->expr);
+            }
+
+            void operator()(const NodeStmtPrint *stmt_print) const
+            {
+                hasher.mix(28);
+                hasher.hash_expr(stmt_print->expr);
+            }
+
+            void operator()(const NodeStmtLet *stmt_let) const
+            {
+                hasher.mix(21);
+                hasher.mix(stmt_let->ident.value.value());
+                hasher.mix(hasher.m_frame.offsets.at(stmt_let));
+                hasher.mix(stmt_let->length);
+                hasher.mix(static_cast<uint64_t>(stmt_let->type));
+
+                if (stmt_let->expr != nullptr)
+                {
+                    hasher.hash_expr(stmt_let->expr);
+                }
+            }
+
+            void operator()(const NodeScope *scope) const
+            {
+                hasher.mix(22);
+                hasher.hash_scope(scope);
+            }
+
+            void operator()(const NodeStmtIf *stmt_if) const
+            {
+                hasher.mix(23);
+                hasher.hash_expr(stmt_if->expr);
+                hasher.hash_scope(stmt_if->scope);
+
+                if (stmt_if->pred.has_value())
+                {
+                    hasher.hash_pred(stmt_if->pred.value());
+                }
+            }
+
+            void operator()(const NodeStmtAssign *stmt_assign) const
+            {
+                hasher.mix(24);
+                hasher.mix(stmt_assign->ident.value.value());
+                hasher.mix(stmt_assign->index != nullptr ? 1 : 0);
+
+                if (stmt_assign->index != nullptr)
+                {
+                    hasher.hash_expr(stmt_assign->index);
+                }
+
+                hasher.hash_expr(stmt_assign->expr);
+            }
+
+            void operator()(const NodeStmtWhile *stmt_while) const
+            {
+                hasher.mix(25);
+                hasher.hash_expr(stmt_while->expr);
+                hasher.hash_scope(stmt_while->scope);
+            }
+
+            void operator()(const NodeStmtReturn *stmt_return) const
+            {
+                hasher.mix(26);
+                hasher.hash_expr(stmt_return->expr);
+            }
+
+            void operator()(const NodeStmtMatch *stmt_match) const
+            {
+                hasher.mix(27);
+                hasher.hash_expr(stmt_match->expr);
+                hasher.mix(stmt_match->arms.size());
+
+                for (const NodeMatchArm &arm : stmt_match->arms)
+                {
+                    hasher.mix(arm.value);
+                    hasher.hash_scope(arm.scope);
+                }
+
+                hasher.mix(stmt_match->otherwise != nullptr ? 1 : 0);
+
+                if (stmt_match->otherwise != nullptr)
+                {
+                    hasher.hash_scope(stmt_match->otherwise);
+                }
+            }
+        };
+
+        std::visit(StmtVisitor{.hasher = *this}, stmt->var);
+    }
+
+    static constexpr uint64_t fnv_offset = 1469598103934665603ull;
+    static constexpr uint64_t fnv_prime = 1099511628211ull;
+
+    const Frame &m_frame;
+    uint64_t m_hash = fnv_offset;
+};
+
+// Renumbers the `label<n>` names in generated code from a first label of
+// `from` to one of `to`, so code can be reused at another point in the
+// program. Every label in `code` is at least `from`; names that merely end
+// in `label<n>`, such as `fn_label1`, are left alone.
+inline std::string rebase_labels(const std::string &code, const size_t from, const size_t to)
+{
+    if (from == to)
+    {
+        return code;
+    }
+
+    static constexpr std::string_view prefix = "label";
+
+    std::string result;
+    result.reserve(code.size() + 16);
+
+    size_t pos = 0;
+
+    for (size_t found; (found = code.find(prefix, pos)) != std::string::npos;)
+    {
+        size_t end = found + prefix.size();
+        size_t number = 0;
+        const bool whole = found == 0 || (!std::isalnum(static_cast<unsigned char>(code[found - 1])) && code[found - 1] != '_');
+
+        while (end < code.size() && std::isdigit(static_cast<unsigned char>(code[end])))
+        {
+            number = number * 10 + static_cast<size_t>(code[end] - '0');
+            end++;
+        }
+
+        result.append(code, pos, found + prefix.size() - pos);
+
+        if (whole && end > found + prefix.size())
+        {
+            result += std::to_string(number - from + to);
+        }
+        else
+        {
+            result.append(code, found + prefix.size(), end - found - prefix.size());
+        }
+
+        pos = end;
+    }
+
+    result.append(code, pos);
+
+    return result;
+}
+
+struct CachedStmt
+{
+    std::string code;
+    // The first label number the code was generated with, and how many it
+    // uses from there.
+    size_t label_base = 0;
+    size_t labels = 0;
+    // Functions called, in order of first call.
+    std::vector<std::string> callees{};
+    // Whether the code jumps to the shared out-of-bounds trap.
+    bool bounds_checks = false;
+    size_t build = 0;
+};
+
+// Generated code of top-level statements, kept from one build to the next
+// by `hydro --watch`. Entries are keyed by the statement's hash together
+// with everything it sees of the generator's state, and those not used by
+// the latest build are dropped.
+class StmtCodeCache
+{
+public:
+    void begin_build()
+    {
+        m_build++;
+        m_hits = 0;
+        m_misses = 0;
+    }
+
+    void end_build()
+    {
+        std::erase_if(m_entries, [&](const auto &entry)
+                      { return entry.second.build != m_build; });
+    }
+
+    const CachedStmt *find(const uint64_t key)
+    {
+        const auto it = m_entries.find(key);
+
+        if (it == m_entries.end())
+        {
+            m_misses++;
+            return nullptr;
+        }
+
+        m_hits++;
+        it->second.build = m_build;
+
+        return &it->second;
+    }
+
+    void insert(const uint64_t key, CachedStmt entry)
+    {
+        entry.build = m_build;
+        m_entries[key] = std::move(entry);
+    }
+
+    [[nodiscard]] size_t hits() const
+    {
+        return m_hits;
+    }
+
+    [[nodiscard]] size_t misses() const
+    {
+        return m_misses;
+    }
+
+private:
+    std::unordered_map<uint64_t, CachedStmt> m_entries{};
+    size_t m_build = 0;
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+};
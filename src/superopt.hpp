@@ -0,0 +1,1171 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "./parser.hpp"
+
+// Shapes are small expression trees over the placeholders `x` and `y` and a
+// fixed set of constants, written like `((x*3)+5)`. At run time `x` is in
+// `rax` and `y` in `rcx`, and a rewrite leaves the result in `rax`.
+inline const std::vector<uint64_t> superopt_constants{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 16, 32, 64};
+
+struct ShapeNode
+{
+    enum class Kind
+    {
+        x,
+        y,
+        constant,
+        add,
+        sub,
+        multi,
+        div
+    };
+
+    Kind kind;
+    uint64_t value = 0;
+    const ShapeNode *lhs = nullptr;
+    const ShapeNode *rhs = nullptr;
+};
+
+inline char shape_op(const ShapeNode::Kind kind)
+{
+    switch (kind)
+    {
+    case ShapeNode::Kind::add:
+        return '+';
+    case ShapeNode::Kind::sub:
+        return '-';
+    case ShapeNode::Kind::multi:
+        return '*';
+    case ShapeNode::Kind::div:
+        return '/';
+    default:
+        return '?';
+    }
+}
+
+inline std::string shape_key(const ShapeNode &node)
+{
+    switch (node.kind)
+    {
+    case ShapeNode::Kind::x:
+        return "x";
+    case ShapeNode::Kind::y:
+        return "y";
+    case ShapeNode::Kind::constant:
+        return std::to_string(node.value);
+    default:
+        return "(" + shape_key(*node.lhs) + shape_op(node.kind) + shape_key(*node.rhs) + ")";
+    }
+}
+
+// Rewrites found by the superoptimizer, keyed by shape.
+class RewriteTable
+{
+public:
+    struct Match
+    {
+        const std::vector<std::string> *instrs;
+        const NodeExpr *x;
+        const NodeExpr *y;
+    };
+
+    void add(const std::string &key, std::vector<std::string> instrs)
+    {
+        m_rules[key] = std::move(instrs);
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return m_rules.size();
+    }
+
+    [[nodiscard]] const std::vector<std::string> *find(const std::string &key) const
+    {
+        const auto it = m_rules.find(key);
+
+        return it != m_rules.end() ? &it->second : nullptr;
+    }
+
+    // One rule per line: shape, tab, instruction count, tab, `; `-separated
+    // instructions. An empty sequence means the shape is just `x`.
+    void save(std::ostream &out) const
+    {
+        out << "# hydro rewrite table v1\n";
+
+        std::vector<std::string> keys;
+
+        for (const auto &[key, instrs] : m_rules)
+        {
+            keys.push_back(key);
+        }
+
+        std::sort(keys.begin(), keys.end());
+
+        for (const std::string &key : keys)
+        {
+            const std::vector<std::string> &instrs = m_rules.at(key);
+            out << key << "\t" << instrs.size() << "\t";
+
+            for (size_t i = 0; i < instrs.size(); i++)
+            {
+                out << (i > 0 ? "; " : "") << instrs[i];
+            }
+
+            out << "\n";
+        }
+    }
+
+    static std::optional<RewriteTable> load(std::istream &in)
+    {
+        RewriteTable table;
+        std::string line;
+
+        while (std::getline(in, line))
+        {
+            if (line.empty() || line.front() == '#')
+            {
+                continue;
+            }
+
+            const size_t key_end = line.find('\t');
+            const size_t cost_end = key_end == std::string::npos ? std::string::npos : line.find('\t', key_end + 1);
+
+            if (cost_end == std::string::npos)
+            {
+                return {};
+            }
+
+            std::vector<std::string> instrs;
+            std::stringstream body(line.substr(cost_end + 1));
+            std::string instr;
+
+            while (std::getline(body, instr, ';'))
+            {
+                instr.erase(0, instr.find_first_not_of(' '));
+
+                if (!instr.empty())
+                {
+                    instrs.push_back(instr);
+                }
+            }
+
+            table.add(line.substr(0, key_end), std::move(instrs));
+        }
+
+        return table;
+    }
+
+    // Finds a rule for `bin_expr`. A child that is itself a binary expression
+    // is tried first as part of the shape and then as an opaque placeholder.
+    [[nodiscard]] std::optional<Match> match(const NodeBinExpr *bin_expr) const
+    {
+        if (m_rules.empty())
+        {
+            return {};
+        }
+
+        const auto parts = split(bin_expr);
+
+        if (!parts.has_value())
+        {
+            return {};
+        }
+
+        const auto [kind, lhs, rhs] = parts.value();
+
+        for (const bool nest_lhs : {true, false})
+        {
+            for (const bool nest_rhs : {true, false})
+            {
+                Binding binding;
+                std::string key = "(";
+
+                if (!describe(lhs, nest_lhs, binding, key))
+                {
+                    continue;
+                }
+
+                key += shape_op(kind);
+
+                if (!describe(rhs, nest_rhs, binding, key))
+                {
+                    continue;
+                }
+
+                key += ")";
+
+                if (binding.x == nullptr)
+                {
+                    continue;
+                }
+
+                const auto it = m_rules.find(key);
+
+                if (it != m_rules.end())
+                {
+                    return Match{.instrs = &it->second, .x = binding.x, .y = binding.y};
+                }
+            }
+        }
+
+        return {};
+    }
+
+private:
+    struct Binding
+    {
+        const NodeExpr *x = nullptr;
+        const NodeExpr *y = nullptr;
+    };
+
+    using Parts = std::tuple<ShapeNode::Kind, const NodeExpr *, const NodeExpr *>;
+
+    // Shapes only cover arithmetic; comparisons and logic have no parts.
+    static std::optional<Parts> split(const NodeBinExpr *bin_expr)
+    {
+        if (const auto add = std::get_if<NodeBinExprAdd *>(&bin_expr->var))
+        {
+            return Parts{ShapeNode::Kind::add, (*add)->lhs, (*add)->rhs};
+        }
+
+        if (const auto sub = std::get_if<NodeBinExprSub *>(&bin_expr->var))
+        {
+            return Parts{ShapeNode::Kind::sub, (*sub)->lhs, (*sub)->rhs};
+        }
+
+        if (const auto multi = std::get_if<NodeBinExprMulti *>(&bin_expr->var))
+        {
+            return Parts{ShapeNode::Kind::multi, (*multi)->lhs, (*multi)->rhs};
+        }
+
+        if (const auto div = std::get_if<NodeBinExprDiv *>(&bin_expr->var))
+        {
+            return Parts{ShapeNode::Kind::div, (*div)->lhs, (*div)->rhs};
+        }
+
+        return std::nullopt;
+    }
+
+    static const NodeExpr *unparen(const NodeExpr *expr)
+    {
+        while (std::holds_alternative<NodeTerm *>(expr->var))
+        {
+            const NodeTerm *term = std::get<NodeTerm *>(expr->var);
+
+            if (!std::holds_alternative<NodeTermParen *>(term->var))
+            {
+                break;
+            }
+
+            expr = std::get<NodeTermParen *>(term->var)->expr;
+        }
+
+        return expr;
+    }
+
+    static std::optional<uint64_t> constant(const NodeExpr *expr)
+    {
+        if (!std::holds_alternative<NodeTerm *>(expr->var))
+        {
+            return {};
+        }
+
+        const NodeTerm *term = std::get<NodeTerm *>(expr->var);
+
+        if (!std::holds_alternative<NodeTermIntLit *>(term->var))
+        {
+            return {};
+        }
+
+        std::string value = std::get<NodeTermIntLit *>(term->var)->int_lit.value.value();
+        value.erase(0, std::min(value.find_first_not_of('0'), value.size() - 1));
+
+        for (const uint64_t c : superopt_constants)
+        {
+            if (value == std::to_string(c))
+            {
+                return c;
+            }
+        }
+
+        return {};
+    }
+
+    static const std::string *ident_name(const NodeExpr *expr)
+    {
+        if (!std::holds_alternative<NodeTerm *>(expr->var))
+        {
+            return nullptr;
+        }
+
+        const NodeTerm *term = std::get<NodeTerm *>(expr->var);
+
+        if (!std::holds_alternative<NodeTermIdent *>(term->var))
+        {
+            return nullptr;
+        }
+
+        return &std::get<NodeTermIdent *>(term->var)->ident.value.value();
+    }
+
+    static bool bind(const NodeExpr *expr, Binding &binding, std::string &key)
+    {
+        const auto same = [&](const NodeExpr *bound)
+        {
+            const std::string *name = ident_name(expr);
+            return bound == expr || (name != nullptr && ident_name(bound) != nullptr && *ident_name(bound) == *name);
+        };
+
+        if (binding.x == nullptr || same(binding.x))
+        {
+            binding.x = binding.x == nullptr ? expr : binding.x;
+            key += "x";
+            return true;
+        }
+
+        if (binding.y == nullptr || same(binding.y))
+        {
+            binding.y = binding.y == nullptr ? expr : binding.y;
+            key += "y";
+            return true;
+        }
+
+        return false;
+    }
+
+    static bool leaf(const NodeExpr *expr, Binding &binding, std::string &key)
+    {
+        if (const auto value = constant(expr))
+        {
+            key += std::to_string(value.value());
+            return true;
+        }
+
+        return bind(expr, binding, key);
+    }
+
+    static bool describe(const NodeExpr *expr, const bool nest, Binding &binding, std::string &key)
+    {
+        expr = unparen(expr);
+
+        if (!std::holds_alternative<NodeBinExpr *>(expr->var))
+        {
+            return leaf(expr, binding, key);
+        }
+
+        const auto parts = split(std::get<NodeBinExpr *>(expr->var));
+
+        if (!nest || !parts.has_value())
+        {
+            return bind(expr, binding, key);
+        }
+
+        const auto [kind, inner_lhs, inner_rhs] = parts.value();
+        const NodeExpr *lhs = unparen(inner_lhs);
+        const NodeExpr *rhs = unparen(inner_rhs);
+
+        if (std::holds_alternative<NodeBinExpr *>(lhs->var) || std::holds_alternative<NodeBinExpr *>(rhs->var))
+        {
+            return false;
+        }
+
+        key += "(";
+
+        if (!leaf(lhs, binding, key))
+        {
+            return false;
+        }
+
+        key += shape_op(kind);
+
+        if (!leaf(rhs, binding, key))
+        {
+            return false;
+        }
+
+        key += ")";
+        return true;
+    }
+
+    std::unordered_map<std::string, std::vector<std::string>> m_rules{};
+};
+
+struct SuperoptStats
+{
+    size_t shapes = 0;
+    size_t rules = 0;
+    size_t candidates = 0;
+    double seconds = 0;
+};
+
+// Offline search for the cheapest instruction sequence computing each shape.
+// Candidate sequences over a small x86-64 alphabet are enumerated by
+// increasing length and pruned by cost; a candidate must agree with the
+// shape on every test vector (edge cases, seeded random values and the
+// shape's own boundary vectors, with 64-bit wraparound and unsigned division
+// like the generator). A winner is then checked on a much larger set, and
+// any counterexample joins the shape's vectors for another search.
+class Superoptimizer
+{
+public:
+    using Vector = std::array<uint64_t, 2>;
+
+    explicit Superoptimizer(const size_t max_len = 3)
+        : m_max_len(max_len)
+    {
+        std::mt19937_64 rng(0x5eed);
+        const std::vector<uint64_t> edges{0, 1, 2, 3, 7, 8, 255, 256, 0x7fffffff, 0x80000000, 0xffffffff,
+                                          0x100000000, 0x7fffffffffffffff, 0x8000000000000000, ~uint64_t{0}};
+
+        for (const uint64_t edge : edges)
+        {
+            m_vectors.push_back({edge, rng()});
+            m_vectors.push_back({rng(), edge});
+        }
+
+        for (int i = 0; i < 34; i++)
+        {
+            m_vectors.push_back({rng(), rng() & 0xffff});
+        }
+
+        // Every low and every high x exhaustively, so rounding and carries
+        // at the ends of the range are covered whatever the constants.
+        for (uint64_t i = 0; i < final_edge_span; i++)
+        {
+            m_final_vectors.push_back({i, rng()});
+            m_final_vectors.push_back({0 - 1 - i, rng()});
+        }
+
+        for (size_t i = 0; i < final_random_vectors; i++)
+        {
+            m_final_vectors.push_back({rng(), rng()});
+        }
+    }
+
+    // Values around which `shape` changes behaviour: x and y near 0, 2^32
+    // and 2^63 and just short of 2^64, offset by each of its constants and
+    // stepped by multiples of them (where division rounds), and both sides
+    // of every power of two (where shifts drop bits). Each is paired with
+    // full-range random values and with the others.
+    static std::vector<Vector> boundary_vectors(const ShapeNode &shape)
+    {
+        std::vector<uint64_t> constants{1};
+        collect_constants(shape, constants);
+
+        std::vector<uint64_t> values;
+
+        for (const uint64_t base : {uint64_t{0}, uint64_t{1} << 32, uint64_t{1} << 63})
+        {
+            for (const uint64_t offset : constants)
+            {
+                for (const uint64_t step : constants)
+                {
+                    for (int64_t k = -2; k <= 2; k++)
+                    {
+                        for (int64_t e = -1; e <= 1; e++)
+                        {
+                            const uint64_t delta = step * static_cast<uint64_t>(k) + static_cast<uint64_t>(e);
+                            values.push_back(base - offset + delta);
+                            values.push_back(base + offset + delta);
+                        }
+                    }
+                }
+            }
+        }
+
+        for (int bit = 0; bit < 64; bit++)
+        {
+            const uint64_t power = uint64_t{1} << bit;
+            values.insert(values.end(), {power - 1, power, power + 1});
+        }
+
+        std::sort(values.begin(), values.end());
+        values.erase(std::unique(values.begin(), values.end()), values.end());
+
+        std::mt19937_64 rng(0xb0da);
+        std::vector<Vector> vectors;
+
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            vectors.push_back({values[i], rng()});
+            vectors.push_back({rng(), values[i]});
+            vectors.push_back({values[i], values[(i * 7 + 3) % values.size()]});
+        }
+
+        return vectors;
+    }
+
+    // Runs `instrs`, text as written to a rewrite table, on x in `rax` and
+    // y in `rcx`. Instructions outside the search alphabet for `shape` have
+    // no model, and give nothing.
+    static std::optional<uint64_t> emulate(const ShapeNode &shape, const std::vector<std::string> &instrs,
+                                           const uint64_t x, const uint64_t y)
+    {
+        const std::optional<std::vector<Instr>> seq = parse(shape, instrs);
+
+        if (!seq.has_value())
+        {
+            return {};
+        }
+
+        return run(seq.value(), x, y);
+    }
+
+    // The shapes whose rule in `table` disagrees with the shape itself on
+    // its boundary vectors or the final check set, or uses an instruction
+    // outside the alphabet.
+    [[nodiscard]] std::vector<std::string> check(const RewriteTable &table)
+    {
+        std::vector<std::string> wrong;
+
+        for (const ShapeNode *shape : shapes())
+        {
+            const std::string key = shape_key(*shape);
+            const std::vector<std::string> *instrs = table.find(key);
+
+            if (instrs == nullptr)
+            {
+                continue;
+            }
+
+            const std::optional<std::vector<Instr>> seq = parse(*shape, *instrs);
+            std::vector<Vector> vectors = boundary_vectors(*shape);
+            vectors.insert(vectors.end(), m_final_vectors.begin(), m_final_vectors.end());
+
+            const bool agrees = seq.has_value() && std::all_of(vectors.begin(), vectors.end(), [&](const Vector &vector)
+                                                               { return run(seq.value(), vector[0], vector[1]) ==
+                                                                        eval(*shape, vector[0], vector[1]); });
+
+            if (!agrees)
+            {
+                wrong.push_back(key);
+            }
+        }
+
+        return wrong;
+    }
+
+    [[nodiscard]] RewriteTable search(SuperoptStats &stats)
+    {
+        const auto start = std::chrono::steady_clock::now();
+
+        RewriteTable table;
+
+        for (const ShapeNode *shape : shapes())
+        {
+            stats.shapes++;
+
+            if (auto instrs = search_shape(*shape, stats))
+            {
+                table.add(shape_key(*shape), std::move(instrs.value()));
+                stats.rules++;
+            }
+        }
+
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        return table;
+    }
+
+private:
+    enum class Op
+    {
+        mov_rcx_rax,
+        mov_rax_rcx,
+        add_rax_rax,
+        add_rax_rcx,
+        sub_rax_rcx,
+        sub_rcx_rax,
+        imul_rax_rcx,
+        neg_rax,
+        shl_rax,
+        shr_rax,
+        add_rax_imm,
+        sub_rax_imm,
+        imul_rax_imm,
+        and_rax_imm,
+        mov_rax_imm,
+        lea_rax_rax_scaled,
+        lea_rax_scaled,
+        lea_rax_rcx_scaled,
+        lea_rcx_rax_scaled,
+        lea_rax_rax_scaled_imm
+    };
+
+    struct Instr
+    {
+        Op op;
+        int64_t imm = 0;
+        int cost = 1;
+    };
+
+    struct State
+    {
+        uint64_t rax;
+        uint64_t rcx;
+    };
+
+    static void step(const Instr &instr, State &state)
+    {
+        const auto imm = static_cast<uint64_t>(instr.imm);
+
+        switch (instr.op)
+        {
+        case Op::mov_rcx_rax:
+            state.rcx = state.rax;
+            break;
+        case Op::mov_rax_rcx:
+            state.rax = state.rcx;
+            break;
+        case Op::add_rax_rax:
+            state.rax += state.rax;
+            break;
+        case Op::add_rax_rcx:
+            state.rax += state.rcx;
+            break;
+        case Op::sub_rax_rcx:
+            state.rax -= state.rcx;
+            break;
+        case Op::sub_rcx_rax:
+            state.rcx -= state.rax;
+            break;
+        case Op::imul_rax_rcx:
+            state.rax *= state.rcx;
+            break;
+        case Op::neg_rax:
+            state.rax = 0 - state.rax;
+            break;
+        case Op::shl_rax:
+            state.rax <<= imm;
+            break;
+        case Op::shr_rax:
+            state.rax >>= imm;
+            break;
+        case Op::add_rax_imm:
+            state.rax += imm;
+            break;
+        case Op::sub_rax_imm:
+            state.rax -= imm;
+            break;
+        case Op::imul_rax_imm:
+            state.rax *= imm;
+            break;
+        case Op::and_rax_imm:
+            state.rax &= imm;
+            break;
+        case Op::mov_rax_imm:
+            state.rax = imm;
+            break;
+        case Op::lea_rax_rax_scaled:
+            state.rax += state.rax * imm;
+            break;
+        case Op::lea_rax_scaled:
+            state.rax *= imm;
+            break;
+        case Op::lea_rax_rcx_scaled:
+            state.rax += state.rcx * imm;
+            break;
+        case Op::lea_rcx_rax_scaled:
+            state.rax = state.rcx + state.rax * imm;
+            break;
+        case Op::lea_rax_rax_scaled_imm:
+            state.rax += state.rax * (imm >> 32) + static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(imm)));
+            break;
+        }
+    }
+
+    static uint64_t run(const std::vector<Instr> &seq, const uint64_t x, const uint64_t y)
+    {
+        State state{.rax = x, .rcx = y};
+
+        for (const Instr &instr : seq)
+        {
+            step(instr, state);
+        }
+
+        return state.rax;
+    }
+
+    static std::optional<std::vector<Instr>> parse(const ShapeNode &shape, const std::vector<std::string> &instrs)
+    {
+        const std::vector<Instr> letters = alphabet(shape, true);
+        std::vector<Instr> seq;
+
+        for (const std::string &text : instrs)
+        {
+            const auto it = std::find_if(letters.begin(), letters.end(), [&](const Instr &instr)
+                                         { return format(instr) == text; });
+
+            if (it == letters.end())
+            {
+                return {};
+            }
+
+            seq.push_back(*it);
+        }
+
+        return seq;
+    }
+
+    static std::string format(const Instr &instr)
+    {
+        std::stringstream ss;
+
+        switch (instr.op)
+        {
+        case Op::mov_rcx_rax:
+            ss << "mov rcx, rax";
+            break;
+        case Op::mov_rax_rcx:
+            ss << "mov rax, rcx";
+            break;
+        case Op::add_rax_rax:
+            ss << "add rax, rax";
+            break;
+        case Op::add_rax_rcx:
+            ss << "add rax, rcx";
+            break;
+        case Op::sub_rax_rcx:
+            ss << "sub rax, rcx";
+            break;
+        case Op::sub_rcx_rax:
+            ss << "sub rcx, rax";
+            break;
+        case Op::imul_rax_rcx:
+            ss << "imul rax, rcx";
+            break;
+        case Op::neg_rax:
+            ss << "neg rax";
+            break;
+        case Op::shl_rax:
+            ss << "shl rax, " << instr.imm;
+            break;
+        case Op::shr_rax:
+            ss << "shr rax, " << instr.imm;
+            break;
+        case Op::add_rax_imm:
+            ss << "add rax, " << instr.imm;
+            break;
+        case Op::sub_rax_imm:
+            ss << "sub rax, " << instr.imm;
+            break;
+        case Op::imul_rax_imm:
+            ss << "imul rax, rax, " << instr.imm;
+            break;
+        case Op::and_rax_imm:
+            ss << "and rax, " << instr.imm;
+            break;
+        case Op::mov_rax_imm:
+            ss << "mov rax, " << instr.imm;
+            break;
+        case Op::lea_rax_rax_scaled:
+            ss << "lea rax, [rax + rax*" << instr.imm << "]";
+            break;
+        case Op::lea_rax_scaled:
+            ss << "lea rax, [rax*" << instr.imm << "]";
+            break;
+        case Op::lea_rax_rcx_scaled:
+            ss << "lea rax, [rax + rcx*" << instr.imm << "]";
+            break;
+        case Op::lea_rcx_rax_scaled:
+            ss << "lea rax, [rcx + rax*" << instr.imm << "]";
+            break;
+        case Op::lea_rax_rax_scaled_imm:
+            ss << "lea rax, [rax + rax*" << (instr.imm >> 32) << " + " << static_cast<int32_t>(instr.imm) << "]";
+            break;
+        }
+
+        return ss.str();
+    }
+
+    static std::optional<uint64_t> eval(const ShapeNode &node, const uint64_t x, const uint64_t y)
+    {
+        switch (node.kind)
+        {
+        case ShapeNode::Kind::x:
+            return x;
+        case ShapeNode::Kind::y:
+            return y;
+        case ShapeNode::Kind::constant:
+            return node.value;
+        default:
+            break;
+        }
+
+        const auto lhs = eval(*node.lhs, x, y);
+        const auto rhs = eval(*node.rhs, x, y);
+
+        if (!lhs.has_value() || !rhs.has_value())
+        {
+            return {};
+        }
+
+        switch (node.kind)
+        {
+        case ShapeNode::Kind::add:
+            return lhs.value() + rhs.value();
+        case ShapeNode::Kind::sub:
+            return lhs.value() - rhs.value();
+        case ShapeNode::Kind::multi:
+            return lhs.value() * rhs.value();
+        default:
+            if (rhs.value() == 0)
+            {
+                return {};
+            }
+
+            return lhs.value() / rhs.value();
+        }
+    }
+
+    // Division by anything but a non-zero constant can trap, and none of the
+    // candidate instructions do, so such shapes are never rewritten.
+    static bool can_trap(const ShapeNode &node)
+    {
+        if (node.lhs == nullptr)
+        {
+            return false;
+        }
+
+        if (node.kind == ShapeNode::Kind::div && (node.rhs->kind != ShapeNode::Kind::constant || node.rhs->value == 0))
+        {
+            return true;
+        }
+
+        return can_trap(*node.lhs) || can_trap(*node.rhs);
+    }
+
+    static void collect_constants(const ShapeNode &node, std::vector<uint64_t> &out)
+    {
+        if (node.kind == ShapeNode::Kind::constant)
+        {
+            out.push_back(node.value);
+        }
+
+        if (node.lhs != nullptr)
+        {
+            collect_constants(*node.lhs, out);
+            collect_constants(*node.rhs, out);
+        }
+    }
+
+    // Immediates worth trying: the shape's constants and their pairwise
+    // sums, differences and products, as long as they fit in an imm32.
+    static std::vector<int64_t> immediates(const ShapeNode &shape)
+    {
+        std::vector<uint64_t> constants{1};
+        collect_constants(shape, constants);
+
+        std::vector<int64_t> imms;
+
+        const auto add = [&](const uint64_t value)
+        {
+            const auto imm = static_cast<int64_t>(value);
+
+            if (imm >= INT32_MIN && imm <= INT32_MAX && std::find(imms.begin(), imms.end(), imm) == imms.end())
+            {
+                imms.push_back(imm);
+            }
+        };
+
+        for (const uint64_t a : constants)
+        {
+            add(a);
+            add(0 - a);
+
+            for (const uint64_t b : constants)
+            {
+                add(a + b);
+                add(a - b);
+                add(a * b);
+            }
+        }
+
+        return imms;
+    }
+
+    static std::vector<Instr> alphabet(const ShapeNode &shape, const bool uses_y)
+    {
+        std::vector<Instr> instrs{
+            {.op = Op::add_rax_rax},
+            {.op = Op::neg_rax},
+            {.op = Op::mov_rcx_rax},
+            {.op = Op::mov_rax_rcx},
+            {.op = Op::sub_rcx_rax},
+            {.op = Op::add_rax_rcx},
+            {.op = Op::sub_rax_rcx},
+            {.op = Op::imul_rax_rcx, .cost = 3},
+        };
+
+        for (int64_t amount = 1; amount < 64; amount++)
+        {
+            instrs.push_back({.op = Op::shl_rax, .imm = amount});
+            instrs.push_back({.op = Op::shr_rax, .imm = amount});
+        }
+
+        for (const int64_t scale : {2, 4, 8})
+        {
+            instrs.push_back({.op = Op::lea_rax_rax_scaled, .imm = scale});
+            instrs.push_back({.op = Op::lea_rax_scaled, .imm = scale});
+            instrs.push_back({.op = Op::lea_rcx_rax_scaled, .imm = scale});
+        }
+
+        for (const int64_t scale : {1, 2, 4, 8})
+        {
+            instrs.push_back({.op = Op::lea_rax_rcx_scaled, .imm = scale});
+        }
+
+        for (const int64_t imm : immediates(shape))
+        {
+            instrs.push_back({.op = Op::add_rax_imm, .imm = imm});
+            instrs.push_back({.op = Op::sub_rax_imm, .imm = imm});
+            instrs.push_back({.op = Op::imul_rax_imm, .imm = imm, .cost = 3});
+            instrs.push_back({.op = Op::and_rax_imm, .imm = imm});
+            instrs.push_back({.op = Op::mov_rax_imm, .imm = imm});
+
+            for (const int64_t scale : {1, 2, 4, 8})
+            {
+                const auto packed = static_cast<int64_t>((static_cast<uint64_t>(scale) << 32) | static_cast<uint32_t>(imm));
+                instrs.push_back({.op = Op::lea_rax_rax_scaled_imm, .imm = packed, .cost = 2});
+            }
+        }
+
+        if (!uses_y)
+        {
+            // `rcx` only holds scratch values then; reading it first is
+            // never useful, so skip instructions that only make sense with y.
+            std::erase_if(instrs, [](const Instr &instr)
+                          { return instr.op == Op::mov_rax_rcx; });
+        }
+
+        return instrs;
+    }
+
+    static bool uses(const ShapeNode &node, const ShapeNode::Kind kind)
+    {
+        if (node.kind == kind)
+        {
+            return true;
+        }
+
+        return node.lhs != nullptr && (uses(*node.lhs, kind) || uses(*node.rhs, kind));
+    }
+
+    static bool verify(const std::vector<Instr> &seq, const std::vector<Vector> &vectors,
+                       const std::vector<uint64_t> &expected)
+    {
+        for (size_t i = 0; i < vectors.size(); i++)
+        {
+            State state{.rax = vectors[i][0], .rcx = vectors[i][1]};
+
+            for (const Instr &instr : seq)
+            {
+                step(instr, state);
+            }
+
+            if (state.rax != expected[i])
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void extend(const std::vector<Instr> &alphabet, const std::vector<Vector> &vectors,
+                const std::vector<uint64_t> &expected, std::vector<Instr> &seq, const int cost, const size_t len,
+                std::optional<std::vector<Instr>> &best, int &best_cost, SuperoptStats &stats) const
+    {
+        if (seq.size() == len)
+        {
+            stats.candidates++;
+
+            if (verify(seq, vectors, expected))
+            {
+                best = seq;
+                best_cost = cost;
+            }
+
+            return;
+        }
+
+        for (const Instr &instr : alphabet)
+        {
+            if (cost + instr.cost >= best_cost)
+            {
+                continue;
+            }
+
+            seq.push_back(instr);
+            extend(alphabet, vectors, expected, seq, cost + instr.cost, len, best, best_cost, stats);
+            seq.pop_back();
+        }
+    }
+
+    std::optional<std::vector<std::string>> search_shape(const ShapeNode &shape, SuperoptStats &stats) const
+    {
+        if (can_trap(shape))
+        {
+            return {};
+        }
+
+        // The shared vectors come first: they reject most candidates, and
+        // verification stops at the first mismatch.
+        std::vector<Vector> vectors = m_vectors;
+        const std::vector<Vector> boundary = boundary_vectors(shape);
+        vectors.insert(vectors.end(), boundary.begin(), boundary.end());
+
+        std::vector<uint64_t> expected;
+
+        for (const Vector &vector : vectors)
+        {
+            expected.push_back(eval(shape, vector[0], vector[1]).value());
+        }
+
+        const std::vector<Instr> letters = alphabet(shape, uses(shape, ShapeNode::Kind::y));
+
+        // Longer sequences are only searched for single-operation shapes;
+        // for nested ones the third level is too large to be worth it.
+        const bool nested = shape.lhs->lhs != nullptr || shape.rhs->lhs != nullptr;
+        const size_t max_len = nested ? std::min<size_t>(m_max_len, 2) : m_max_len;
+
+        std::optional<std::vector<Instr>> best;
+
+        while (true)
+        {
+            best.reset();
+            int best_cost = 8;
+
+            for (size_t len = 0; len <= max_len; len++)
+            {
+                std::vector<Instr> seq;
+                extend(letters, vectors, expected, seq, 0, len, best, best_cost, stats);
+            }
+
+            if (!best.has_value())
+            {
+                return {};
+            }
+
+            const std::optional<Vector> counter = counterexample(shape, best.value());
+
+            if (!counter.has_value())
+            {
+                break;
+            }
+
+            vectors.push_back(counter.value());
+            expected.push_back(eval(shape, counter.value()[0], counter.value()[1]).value());
+        }
+
+        std::vector<std::string> instrs;
+
+        for (const Instr &instr : best.value())
+        {
+            instrs.push_back(format(instr));
+        }
+
+        return instrs;
+    }
+
+    [[nodiscard]] std::optional<Vector> counterexample(const ShapeNode &shape, const std::vector<Instr> &seq) const
+    {
+        for (const Vector &vector : m_final_vectors)
+        {
+            if (run(seq, vector[0], vector[1]) != eval(shape, vector[0], vector[1]).value())
+            {
+                return vector;
+            }
+        }
+
+        return {};
+    }
+
+    const ShapeNode *node(const ShapeNode::Kind kind, const uint64_t value = 0, const ShapeNode *lhs = nullptr,
+                          const ShapeNode *rhs = nullptr)
+    {
+        m_nodes.push_back(std::make_unique<ShapeNode>(ShapeNode{.kind = kind, .value = value, .lhs = lhs, .rhs = rhs}));
+        return m_nodes.back().get();
+    }
+
+    // Every shape with one or two operations and at most two placeholders,
+    // in the forms the matcher in `RewriteTable::match` produces.
+    std::vector<const ShapeNode *> shapes()
+    {
+        using Kind = ShapeNode::Kind;
+
+        const std::array<Kind, 4> ops{Kind::add, Kind::sub, Kind::multi, Kind::div};
+        const ShapeNode *x = node(Kind::x);
+        const ShapeNode *y = node(Kind::y);
+
+        std::vector<const ShapeNode *> constants;
+
+        for (const uint64_t value : superopt_constants)
+        {
+            constants.push_back(node(Kind::constant, value));
+        }
+
+        std::vector<const ShapeNode *> result;
+
+        for (const Kind op : ops)
+        {
+            result.push_back(node(op, 0, x, x));
+
+            for (const ShapeNode *k : constants)
+            {
+                result.push_back(node(op, 0, x, k));
+                result.push_back(node(op, 0, k, x));
+            }
+        }
+
+        for (const Kind inner : ops)
+        {
+            const ShapeNode *x_y = node(inner, 0, x, y);
+            const ShapeNode *x_x = node(inner, 0, x, x);
+
+            for (const Kind outer : ops)
+            {
+                for (const ShapeNode *k1 : constants)
+                {
+                    const ShapeNode *x_k1 = node(inner, 0, x, k1);
+                    const ShapeNode *y_k1 = node(inner, 0, y, k1);
+
+                    for (const ShapeNode *k2 : constants)
+                    {
+                        result.push_back(node(outer, 0, x_k1, k2));
+                    }
+
+                    result.push_back(node(outer, 0, x_y, k1));
+                    result.push_back(node(outer, 0, x_x, k1));
+                    result.push_back(node(outer, 0, x_k1, y));
+                    result.push_back(node(outer, 0, x, y_k1));
+                }
+            }
+        }
+
+        return result;
+    }
+
+    // The final check: every x this close to either end of the range, and
+    // this many random pairs.
+    static constexpr uint64_t final_edge_span = 4096;
+    static constexpr size_t final_random_vectors = 16384;
+
+    size_t m_max_len;
+    std::vector<Vector> m_vectors{};
+    std::vector<Vector> m_final_vectors{};
+    std::vector<std::unique_ptr<ShapeNode>> m_nodes{};
+};
@@ -0,0 +1,202 @@
+#include "./teller.hpp"
+
+#include "./driver.hpp"
+
+namespace teller
+{
+    namespace
+    {
+        // Runs a tool with its standard error captured, so its complaints
+        // become diagnostics rather than output of the host process.
+        std::optional<Diagnostic> run(const std::vector<std::string> &argv, const std::vector<int> &fds)
+        {
+            const MemFile err("teller.err");
+
+            if (!err.valid())
+            {
+                return Diagnostic{.message = std::string("Unable to create in-memory files: ") + std::strerror(errno) + "."};
+            }
+
+            if (const std::optional<std::string> error = run_tool(argv, fds, nullptr, err.fd()))
+            {
+                return Diagnostic{.message = error.value() + "\n" + err.read_all().value_or("")};
+            }
+
+            return {};
+        }
+
+        std::optional<Diagnostic> read_back(const MemFile &file, std::string &output)
+        {
+            std::optional<std::string> data = file.read_all();
+
+            if (!data.has_value())
+            {
+                return Diagnostic{.message = std::string("Unable to read in-memory file: ") + std::strerror(errno) + "."};
+            }
+
+            output = std::move(data).value();
+
+            return {};
+        }
+
+        std::string generate(ArenaAllocator &arena, const std::string &source, const CodegenOptions &codegen,
+                             bool &writable_data)
+        {
+            Tokenizer tokenizer(source);
+            Parser parser(tokenizer.tokenize(), arena);
+            std::optional<NodeProg> prog = parser.parse_prog();
+
+            if (!prog.has_value())
+            {
+                compile_error("Invalid program.");
+            }
+
+            Inliner inliner(prog.value(), arena);
+            inliner.run();
+            CommonSubexprEliminator cse(prog.value(), arena);
+            cse.run();
+            DeadStoreEliminator dse(prog.value());
+            dse.run();
+
+            FrameLayout layout(prog.value());
+            Generator generator(prog.value(), layout.layout_prog(), codegen);
+
+            std::string assembly = generator.gen_prog();
+            writable_data = generator.has_writable_data();
+
+            return assembly;
+        }
+
+        // Rewinds the arena however generation ends, so a failed compilation
+        // leaves nothing behind for the thread's next one.
+        struct ArenaReset
+        {
+            ArenaAllocator &arena;
+
+            ~ArenaReset()
+            {
+                arena.reset();
+            }
+        };
+    } // namespace
+
+    CompileResult compile(const std::string &source, const CompileOptions &options)
+    {
+        // Each thread keeps one arena, reset after every compilation. Larger
+        // programs continue in overflow blocks that the reset frees.
+        thread_local ArenaAllocator arena(arena_size);
+
+        CompileResult result;
+        std::optional<RewriteTable> rewrites;
+        std::optional<Profile> profile;
+
+        if (options.rewrite_table.has_value())
+        {
+            std::stringstream table(options.rewrite_table.value());
+            rewrites = RewriteTable::load(table);
+
+            if (!rewrites.has_value())
+            {
+                result.diagnostics.push_back({.message = "Invalid rewrite table."});
+                return result;
+            }
+        }
+
+        if (options.profile.has_value())
+        {
+            std::stringstream data(options.profile.value());
+            profile = Profile::load(data);
+
+            if (!profile.has_value())
+            {
+                result.diagnostics.push_back({.message = "Invalid profile."});
+                return result;
+            }
+        }
+
+        std::string assembly;
+        bool writable_data = false;
+
+        try
+        {
+            const ArenaReset reset{.arena = arena};
+            assembly = generate(arena, source, {.rewrites = rewrites.has_value() ? &rewrites.value() : nullptr,
+                                                .profile_path = std::nullopt,
+                                                .profile = profile.has_value() ? &profile.value() : nullptr,
+                                                .debug_file = std::nullopt,
+                                                .vector_isa = options.avx2 ? VectorIsa::avx2 : VectorIsa::sse2},
+                                writable_data);
+        }
+        catch (const CompileError &error)
+        {
+            result.diagnostics.push_back({.message = error.what(), .line = error.line});
+            return result;
+        }
+        catch (const std::bad_alloc &)
+        {
+            result.diagnostics.push_back({.message = "Out of memory."});
+            return result;
+        }
+        catch (const std::exception &error)
+        {
+            result.diagnostics.push_back({.message = std::string("Internal error: ") + error.what()});
+            return result;
+        }
+
+        if (options.output == Output::assembly)
+        {
+            result.output = std::move(assembly);
+            return result;
+        }
+
+        const MemFile asm_file("teller.asm");
+        const MemFile obj_file("teller.o");
+        const MemFile exe_file("teller");
+        const MemFile script("teller.ld");
+
+        if (!asm_file.valid() || !obj_file.valid() || !exe_file.valid() || !script.valid() ||
+            !asm_file.write_all(assembly) || !script.write_all(tiny_linker_script(writable_data)))
+        {
+            result.diagnostics.push_back({.message = std::string("Unable to create in-memory files: ") + std::strerror(errno) + "."});
+            return result;
+        }
+
+        std::optional<Diagnostic> error =
+            run({"nasm", "-felf64", asm_file.child_path(), "-o", obj_file.child_path()}, {asm_file.fd(), obj_file.fd()});
+
+        if (!error.has_value() && options.output == Output::object)
+        {
+            error = read_back(obj_file, result.output);
+        }
+        else if (!error.has_value())
+        {
+            std::vector<std::string> ld{"ld"};
+
+            if (options.tiny)
+            {
+                ld.insert(ld.end(), {"-n", "-s", "--build-id=none", "-T", script.child_path()});
+            }
+
+            ld.insert(ld.end(), {obj_file.child_path(), "-o", exe_file.child_path()});
+            error = run(ld, {obj_file.fd(), exe_file.fd(), script.fd()});
+
+            if (!error.has_value())
+            {
+                error = read_back(exe_file, result.output);
+            }
+
+            if (!error.has_value() && options.tiny && !strip_section_headers(result.output))
+            {
+                error = Diagnostic{.message = "The linker produced an invalid executable."};
+            }
+        }
+
+        if (error.has_value())
+        {
+            result.output.clear();
+            result.diagnostics.push_back(std::move(error).value());
+        }
+
+        return result;
+    }
+} // namespace teller
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+// Embeddable compiler API, built as the `teller` library. Compilation runs
+// in the calling thread with no process-wide state and no files, so any
+// number of threads can compile at once. Producing an object or executable
+// still runs nasm and ld, on in-memory files.
+namespace teller
+{
+    enum class Output
+    {
+        assembly,
+        object,
+        executable
+    };
+
+    struct CompileOptions
+    {
+        Output output = Output::executable;
+        // The contents of a table written by `hydro --superopt`.
+        std::optional<std::string> rewrite_table;
+        // The contents of a profile written by an instrumented program.
+        std::optional<std::string> profile;
+        // See `hydro --tiny`; only affects executables.
+        bool tiny = false;
+        // Lets element-wise array statements use AVX2, like `hydro
+        // -march=x86-64-v3`.
+        bool avx2 = false;
+    };
+
+    struct Diagnostic
+    {
+        std::string message;
+        // The source line, or 0 when the diagnostic has none, e.g. when
+        // the assembler or linker failed.
+        int line = 0;
+    };
+
+    struct CompileResult
+    {
+        // The assembly text, object file or executable image; empty when
+        // compilation failed.
+        std::string output;
+        std::vector<Diagnostic> diagnostics{};
+
+        [[nodiscard]] bool ok() const
+        {
+            return diagnostics.empty();
+        }
+    };
+
+    CompileResult compile(const std::string &source, const CompileOptions &options = {});
+} // namespace teller
@@ -5,6 +5,8 @@
 #include <string>
 #include <assert.h>
 
+#include "./error.hpp"
+
 enum class TokenType
 {
     exit,
@@ -23,7 +25,26 @@ enum class TokenType
     close_curly,
     if_cond,
     elif,
-    else_cond
+    else_cond,
+    while_loop,
+    fn,
+    return_stmt,
+    comma,
+    open_bracket,
+    close_bracket,
+    colon,
+    eq_eq,
+    bang_eq,
+    lt,
+    lt_eq,
+    gt,
+    gt_eq,
+    and_and,
+    or_or,
+    bang,
+    match,
+    fat_arrow,
+    print
 };
 
 inline std::string to_string(const TokenType type)
@@ -64,6 +85,44 @@ inline std::string to_string(const TokenType type)
         return "elif";
     case TokenType::else_cond:
         return "else";
+    case TokenType::while_loop:
+        return "while";
+    case TokenType::fn:
+        return "fn";
+    case TokenType::return_stmt:
+        return "return";
+    case TokenType::comma:
+        return ",";
+    case TokenType::open_bracket:
+        return "[";
+    case TokenType::close_bracket:
+        return "]";
+    case TokenType::colon:
+        return ":";
+    case TokenType::eq_eq:
+        return "==";
+    case TokenType::bang_eq:
+        return "!=";
+    case TokenType::lt:
+        return "<";
+    case TokenType::lt_eq:
+        return "<=";
+    case TokenType::gt:
+        return ">";
+    case TokenType::gt_eq:
+        return ">=";
+    case TokenType::and_and:
+        return "&&";
+    case TokenType::or_or:
+        return "||";
+    case TokenType::bang:
+        return "!";
+    case TokenType::match:
+        return "match";
+    case TokenType::fat_arrow:
+        return "=>";
+    case TokenType::print:
+        return "print";
     }
     assert(false);
 }
@@ -79,12 +138,23 @@ inline std::optional<int> bin_prec(const TokenType type)
 {
     switch (type)
     {
+    case TokenType::or_or:
+        return 0;
+    case TokenType::and_and:
+        return 1;
+    case TokenType::eq_eq:
+    case TokenType::bang_eq:
+    case TokenType::lt:
+    case TokenType::lt_eq:
+    case TokenType::gt:
+    case TokenType::gt_eq:
+        return 2;
     case TokenType::plus:
     case TokenType::minus:
-        return 0;
+        return 3;
     case TokenType::star:
     case TokenType::fslash:
-        return 1;
+        return 4;
     default:
         return {};
     }
@@ -93,8 +163,10 @@ inline std::optional<int> bin_prec(const TokenType type)
 class Tokenizer
 {
 public:
-    explicit Tokenizer(std::string src)
-        : m_src(std::move(src))
+    // `first_line` is the line number of the start of `src`, for sources
+    // that are a slice of a larger file.
+    explicit Tokenizer(std::string src, const int first_line = 1)
+        : m_src(std::move(src)), m_first_line(first_line)
     {
     }
 
@@ -104,7 +176,7 @@ public:
 
         std::string buf;
 
-        int line_count = 1;
+        int line_count = m_first_line;
 
         while (peek().has_value())
         {
@@ -137,6 +209,26 @@ public:
                 {
                     tokens.push_back({TokenType::else_cond, line_count});
                 }
+                else if (buf == "while")
+                {
+                    tokens.push_back({TokenType::while_loop, line_count});
+                }
+                else if (buf == "fn")
+                {
+                    tokens.push_back({TokenType::fn, line_count});
+                }
+                else if (buf == "return")
+                {
+                    tokens.push_back({TokenType::return_stmt, line_count});
+                }
+                else if (buf == "match")
+                {
+                    tokens.push_back({TokenType::match, line_count});
+                }
+                else if (buf == "print")
+                {
+                    tokens.push_back({TokenType::print, line_count});
+                }
                 else
                 {
                     tokens.push_back({TokenType::ident, line_count, buf});
@@ -178,7 +270,15 @@ public:
                         break;
                     }
 
-                    consume();
+                    if (consume() == '\n')
+                    {
+                        line_count++;
+                    }
+                }
+
+                if (!peek().has_value())
+                {
+                    compile_error_at(line_count, "Unterminated comment");
                 }
 
                 consume();
@@ -199,11 +299,73 @@ public:
                 consume();
                 tokens.push_back({TokenType::semi, line_count});
             }
+            else if (peek().value() == ',')
+            {
+                consume();
+                tokens.push_back({TokenType::comma, line_count});
+            }
+            else if (peek().value() == '=' && peek(1).has_value() && peek(1).value() == '=')
+            {
+                consume();
+                consume();
+                tokens.push_back({TokenType::eq_eq, line_count});
+            }
+            else if (peek().value() == '=' && peek(1).has_value() && peek(1).value() == '>')
+            {
+                consume();
+                consume();
+                tokens.push_back({TokenType::fat_arrow, line_count});
+            }
             else if (peek().value() == '=')
             {
                 consume();
                 tokens.push_back({TokenType::eq, line_count});
             }
+            else if (peek().value() == '!' && peek(1).has_value() && peek(1).value() == '=')
+            {
+                consume();
+                consume();
+                tokens.push_back({TokenType::bang_eq, line_count});
+            }
+            else if (peek().value() == '!')
+            {
+                consume();
+                tokens.push_back({TokenType::bang, line_count});
+            }
+            else if (peek().value() == '<' && peek(1).has_value() && peek(1).value() == '=')
+            {
+                consume();
+                consume();
+                tokens.push_back({TokenType::lt_eq, line_count});
+            }
+            else if (peek().value() == '<')
+            {
+                consume();
+                tokens.push_back({TokenType::lt, line_count});
+            }
+            else if (peek().value() == '>' && peek(1).has_value() && peek(1).value() == '=')
+            {
+                consume();
+                consume();
+                tokens.push_back({TokenType::gt_eq, line_count});
+            }
+            else if (peek().value() == '>')
+            {
+                consume();
+                tokens.push_back({TokenType::gt, line_count});
+            }
+            else if (peek().value() == '&' && peek(1).has_value() && peek(1).value() == '&')
+            {
+                consume();
+                consume();
+                tokens.push_back({TokenType::and_and, line_count});
+            }
+            else if (peek().value() == '|' && peek(1).has_value() && peek(1).value() == '|')
+            {
+                consume();
+                consume();
+                tokens.push_back({TokenType::or_or, line_count});
+            }
             else if (peek().value() == '+')
             {
                 consume();
@@ -234,6 +396,21 @@ public:
                 consume();
                 tokens.push_back({TokenType::close_curly, line_count});
             }
+            else if (peek().value() == '[')
+            {
+                consume();
+                tokens.push_back({TokenType::open_bracket, line_count});
+            }
+            else if (peek().value() == ']')
+            {
+                consume();
+                tokens.push_back({TokenType::close_bracket, line_count});
+            }
+            else if (peek().value() == ':')
+            {
+                consume();
+                tokens.push_back({TokenType::colon, line_count});
+            }
             else if (peek().value() == '\n')
             {
                 consume();
@@ -245,8 +422,7 @@ public:
             }
             else
             {
-                std::cerr << "Unknown keyword." << std::endl;
-                exit(EXIT_FAILURE);
+                compile_error_at(line_count, "Unknown keyword");
             }
         }
 
@@ -272,5 +448,6 @@ private:
     }
 
     const std::string m_src;
+    const int m_first_line;
     size_t m_index = 0;
 };
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// In-memory file for intermediates. Tools reach it as `child_path()` once
+// run_tool has let them inherit its descriptor.
+class MemFile
+{
+public:
+    explicit MemFile(const char *name)
+        : m_fd(memfd_create(name, MFD_CLOEXEC))
+    {
+    }
+
+    MemFile(const MemFile &) = delete;
+    MemFile &operator=(const MemFile &) = delete;
+
+    ~MemFile()
+    {
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+    }
+
+    [[nodiscard]] bool valid() const
+    {
+        return m_fd >= 0;
+    }
+
+    [[nodiscard]] int fd() const
+    {
+        return m_fd;
+    }
+
+    // The path a tool sees when the descriptor is passed to run_tool.
+    [[nodiscard]] std::string child_path() const
+    {
+        return "/dev/fd/" + std::to_string(m_fd);
+    }
+
+    // A path this process can open, e.g. to copy the contents elsewhere.
+    [[nodiscard]] std::string path() const
+    {
+        return "/proc/self/fd/" + std::to_string(m_fd);
+    }
+
+    bool write_all(const std::string &data) const
+    {
+        size_t done = 0;
+
+        while (done < data.size())
+        {
+            const ssize_t written = write(m_fd, data.data() + done, data.size() - done);
+
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (written <= 0)
+            {
+                return false;
+            }
+
+            done += static_cast<size_t>(written);
+        }
+
+        return true;
+    }
+
+    // The whole contents, whatever the file offset.
+    [[nodiscard]] std::optional<std::string> read_all() const
+    {
+        std::string data;
+        char buffer[4096];
+
+        for (off_t offset = 0;;)
+        {
+            const ssize_t count = pread(m_fd, buffer, sizeof(buffer), offset);
+
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (count < 0)
+            {
+                return {};
+            }
+
+            if (count == 0)
+            {
+                return data;
+            }
+
+            data.append(buffer, static_cast<size_t>(count));
+            offset += count;
+        }
+    }
+
+private:
+    int m_fd;
+};
+
+// Runs `argv` directly with posix_spawnp, without a shell. Each descriptor
+// in `fds` stays open in the child under its own number; they are not moved
+// onto fixed numbers because concurrent compiles reuse descriptors, and one
+// mapping could then overwrite the source of the next. `stderr_fd`, when
+// given, becomes the child's standard error. Returns a description of the
+// failure, or nothing once the tool exits with status 0. The child's
+// resource usage is stored in `usage` when given.
+inline std::optional<std::string> run_tool(const std::vector<std::string> &argv, const std::vector<int> &fds = {},
+                                           rusage *usage = nullptr, const int stderr_fd = -1)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    // Duplicating a descriptor onto itself clears its close-on-exec flag.
+    for (const int fd : fds)
+    {
+        posix_spawn_file_actions_adddup2(&actions, fd, fd);
+    }
+
+    if (stderr_fd >= 0)
+    {
+        posix_spawn_file_actions_adddup2(&actions, stderr_fd, STDERR_FILENO);
+    }
+
+    std::vector<char *> args;
+
+    for (const std::string &arg : argv)
+    {
+        args.push_back(const_cast<char *>(arg.c_str()));
+    }
+
+    args.push_back(nullptr);
+
+    pid_t pid = 0;
+    const int error = posix_spawnp(&pid, args.front(), &actions, nullptr, args.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (error != 0)
+    {
+        return "Unable to run " + argv.front() + ": " + std::strerror(error) + ".";
+    }
+
+    int status = 0;
+    rusage child_usage{};
+
+    while (wait4(pid, &status, 0, &child_usage) < 0)
+    {
+        if (errno != EINTR)
+        {
+            return "Unable to wait for " + argv.front() + ": " + std::strerror(errno) + ".";
+        }
+    }
+
+    if (usage != nullptr)
+    {
+        *usage = child_usage;
+    }
+
+    if (WIFSIGNALED(status))
+    {
+        return argv.front() + " was killed by signal " + std::to_string(WTERMSIG(status)) + ".";
+    }
+
+    if (WEXITSTATUS(status) != 0)
+    {
+        return argv.front() + " failed with exit status " + std::to_string(WEXITSTATUS(status)) + ".";
+    }
+
+    return {};
+}
@@ -0,0 +1,758 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "./driver.hpp"
+#include "./stmt_cache.hpp"
+
+// Deep copy of parsed functions and statements into another arena, with
+// every line moved by `line_delta`. The passes rewrite the tree in place, so
+// each build works on a copy of the one kept between builds.
+class AstCloner
+{
+public:
+    explicit AstCloner(ArenaAllocator &allocator, const int line_delta)
+        : m_allocator(allocator), m_line_delta(line_delta)
+    {
+    }
+
+    NodeFn *clone_fn(const NodeFn *fn)
+    {
+        auto copy = m_allocator.emplace<NodeFn>();
+        copy->ident = shift(fn->ident);
+
+        for (const NodeStmtLet *param : fn->params)
+        {
+            copy->params.push_back(m_allocator.emplace<NodeStmtLet>(shift(param->ident), nullptr, size_t{0}, param->type));
+        }
+
+        copy->scope = clone_scope(fn->scope);
+
+        return copy;
+    }
+
+    NodeStmt *clone_stmt(const NodeStmt *stmt)
+    {
+        struct StmtVisitor
+        {
+            AstCloner &cloner;
+
+            NodeStmt *make(const decltype(NodeStmt::var) var) const
+            {
+                return cloner.m_allocator.emplace<NodeStmt>(var);
+            }
+
+            NodeStmt *operator()(const NodeStmtExit *stmt_exit) const
+            {
+                return make(cloner.m_allocator.emplace<NodeStmtExit>(cloner.clone_expr(stmt_exit->expr)));
+            }
+
+            NodeStmt *operator()(const NodeStmtPrint *stmt_print) const
+            {
+                return make(cloner.m_allocator.emplace<NodeStmtPrint>(cloner.clone_expr(stmt_print->expr)));
+            }
+
+            NodeStmt *operator()(const NodeStmtLet *stmt_let) const
+            {
+                return make(cloner.m_allocator.emplace<NodeStmtLet>(
+                    cloner.shift(stmt_let->ident), stmt_let->expr != nullptr ? cloner.clone_expr(stmt_let->expr) : nullptr,
+                    stmt_let->length, stmt_let->type));
+            }
+
+            NodeStmt *operator()(const NodeScope *scope) const
+            {
+                return make(cloner.clone_scope(scope));
+            }
+
+            NodeStmt *operator()(const NodeStmtIf *stmt_if) const
+            {
+                return make(cloner.m_allocator.emplace<NodeStmtIf>(
+                    cloner.clone_expr(stmt_if->expr), cloner.clone_scope(stmt_if->scope),
+                    stmt_if->pred.has_value() ? std::optional(cloner.clone_pred(stmt_if->pred.value())) : std::nullopt,
+                    cloner.shift(stmt_if->line)));
+            }
+
+            NodeStmt *operator()(const NodeStmtAssign *stmt_assign) const
+            {
+                return make(cloner.m_allocator.emplace<NodeStmtAssign>(
+                    cloner.shift(stmt_assign->ident), cloner.clone_expr(stmt_assign->expr),
+                    stmt_assign->index != nullptr ? cloner.clone_expr(stmt_assign->index) : nullptr));
+            }
+
+            NodeStmt *operator()(const NodeStmtWhile *stmt_while) const
+            {
+                auto copy = cloner.m_allocator.emplace<NodeStmtWhile>(cloner.clone_expr(stmt_while->expr),
+                                                                      cloner.clone_scope(stmt_while->scope));
+                copy->line = cloner.shift(stmt_while->line);
+
+                return make(copy);
+            }
+
+            NodeStmt *operator()(const NodeStmtReturn *stmt_return) const
+            {
+                return make(cloner.m_allocator.emplace<NodeStmtReturn>(cloner.clone_expr(stmt_return->expr)));
+            }
+
+            NodeStmt *operator()(const NodeStmtMatch *stmt_match) const
+            {
+                auto copy = cloner.m_allocator.emplace<NodeStmtMatch>(cloner.clone_expr(stmt_match->expr));
+                copy->line = cloner.shift(stmt_match->line);
+
+                for (const NodeMatchArm &arm : stmt_match->arms)
+                {
+                    copy->arms.push_back({.value = arm.value, .scope = cloner.clone_scope(arm.scope)});
+                }
+
+                if (stmt_match->otherwise != nullptr)
+                {
+                    copy->otherwise = cloner.clone_scope(stmt_match->otherwise);
+                }
+
+                return make(copy);
+            }
+        };
+
+        NodeStmt *copy = std::visit(StmtVisitor{.cloner = *this}, stmt->var);
+        copy->line = shift(stmt->line);
+
+        return copy;
+    }
+
+private:
+    NodeExpr *clone_expr(const NodeExpr *expr)
+    {
+        struct ExprVisitor
+        {
+            AstCloner &cloner;
+
+            NodeExpr *operator()(const NodeTerm *term) const
+            {
+                struct TermVisitor
+                {
+                    AstCloner &cloner;
+
+                    NodeTerm *make(const decltype(NodeTerm::var) var) const
+                    {
+                        return cloner.m_allocator.emplace<NodeTerm>(var);
+                    }
+
+                    NodeTerm *operator()(const NodeTermIntLit *term_int_lit) const
+                    {
+                        return make(cloner.m_allocator.emplace<NodeTermIntLit>(cloner.shift(term_int_lit->int_lit)));
+                    }
+
+                    NodeTerm *operator()(const NodeTermIdent *term_ident) const
+                    {
+                        return make(cloner.m_allocator.emplace<NodeTermIdent>(cloner.shift(term_ident->ident)));
+                    }
+
+                    NodeTerm *operator()(const NodeTermParen *term_paren) const
+                    {
+                        return make(cloner.m_allocator.emplace<NodeTermParen>(cloner.clone_expr(term_paren->expr)));
+                    }
+
+                    NodeTerm *operator()(const NodeTermCall *term_call) const
+                    {
+                        auto copy = cloner.m_allocator.emplace<NodeTermCall>(cloner.shift(term_call->ident));
+
+                        for (const NodeExpr *arg : term_call->args)
+                        {
+                            copy->args.push_back(cloner.clone_expr(arg));
+                        }
+
+                        return make(copy);
+                    }
+
+                    NodeTerm *operator()(const NodeTermIndex *term_index) const
+                    {
+                        return make(cloner.m_allocator.emplace<NodeTermIndex>(cloner.shift(term_index->ident),
+                                                                              cloner.clone_expr(term_index->index)));
+                    }
+
+                    NodeTerm *operator()(const NodeTermNot *term_not) const
+                    {
+                        return make(cloner.m_allocator.emplace<NodeTermNot>(cloner.clone_expr(term_not->expr)));
+                    }
+                };
+
+                return cloner.m_allocator.emplace<NodeExpr>(std::visit(TermVisitor{.cloner = cloner}, term->var));
+            }
+
+            NodeExpr *operator()(const NodeBinExpr *bin_expr) const
+            {
+                const auto bin = std::visit([&]<typename T>(const T *expr) -> decltype(NodeBinExpr::var)
+                                            { return cloner.m_allocator.emplace<T>(cloner.clone_expr(expr->lhs),
+                                                                                   cloner.clone_expr(expr->rhs)); },
+                                            bin_expr->var);
+
+                return cloner.m_allocator.emplace<NodeExpr>(cloner.m_allocator.emplace<NodeBinExpr>(bin));
+            }
+        };
+
+        return std::visit(ExprVisitor{.cloner = *this}, expr->var);
+    }
+
+    NodeScope *clone_scope(const NodeScope *scope)
+    {
+        auto copy = m_allocator.emplace<NodeScope>();
+        copy->line = shift(scope->line);
+
+        for (const NodeStmt *stmt : scope->stmts)
+        {
+            copy->stmts.push_back(clone_stmt(stmt));
+        }
+
+        return copy;
+    }
+
+    NodeIfPred *clone_pred(const NodeIfPred *pred)
+    {
+        if (const auto elif = std::get_if<NodeIfPredElif *>(&pred->var))
+        {
+            auto copy = m_allocator.emplace<NodeIfPredElif>(
+                clone_expr((*elif)->expr), clone_scope((*elif)->scope),
+                (*elif)->pred.has_value() ? std::optional(clone_pred((*elif)->pred.value())) : std::nullopt,
+                shift((*elif)->line));
+
+            return m_allocator.emplace<NodeIfPred>(copy);
+        }
+
+        const auto pred_else = std::get<NodeIfPredElse *>(pred->var);
+        auto copy = m_allocator.emplace<NodeIfPredElse>(clone_scope(pred_else->scope));
+        copy->line = shift(pred_else->line);
+
+        return m_allocator.emplace<NodeIfPred>(copy);
+    }
+
+    [[nodiscard]] int shift(const int line) const
+    {
+        return line == 0 ? 0 : line + m_line_delta;
+    }
+
+    [[nodiscard]] Token shift(Token token) const
+    {
+        token.line = shift(token.line);
+        return token;
+    }
+
+    ArenaAllocator &m_allocator;
+    const int m_line_delta;
+};
+
+// `hydro --watch`: compiles the input, then recompiles it whenever it is
+// saved. The functions and top-level statements of the last good parse are
+// kept together with the lines they span. A change re-lexes and re-parses
+// only the lines from the first to the last one that differ, widened to
+// whole items and whole block comments; the items after it just move. Code
+// is regenerated only for statements whose tree or surroundings changed.
+// NASM and ld still run on every build.
+class WatchSession
+{
+public:
+    explicit WatchSession(const Options &options, std::filesystem::path input, std::filesystem::path output,
+                          std::filesystem::path cwd, std::ostream &out, std::ostream &err)
+        : m_options(options), m_input(std::move(input)), m_output(std::move(output)), m_cwd(std::move(cwd)),
+          m_out(out), m_err(err)
+    {
+    }
+
+    int run()
+    {
+        const std::filesystem::path file_path = m_cwd / m_input;
+
+        if (!std::filesystem::exists(file_path))
+        {
+            m_err << "The file " << file_path << " does not exist." << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        if (!file_path.has_extension() || file_path.extension() != ".hy")
+        {
+            m_err << "Invalid Hydrogen file." << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        if (!load_inputs())
+        {
+            return EXIT_FAILURE;
+        }
+
+        const int fd = inotify_init1(IN_CLOEXEC);
+
+        // Editors often save by renaming a new file over the old one, so the
+        // directory is watched rather than the file.
+        if (fd < 0 || inotify_add_watch(fd, file_path.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        {
+            m_err << "Unable to watch " << file_path << ": " << std::strerror(errno) << "." << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        rebuild(file_path);
+
+        while (wait_for_change(fd, file_path.filename()))
+        {
+            rebuild(file_path);
+        }
+
+        close(fd);
+
+        return EXIT_FAILURE;
+    }
+
+private:
+    struct Item
+    {
+        // The lines the item spans in the current source.
+        int first_line;
+        int last_line;
+        // Where `first_line` was when the item was parsed; the tree still
+        // carries the lines from then.
+        int parsed_first_line;
+        std::variant<NodeFn *, NodeStmt *> node;
+    };
+
+    struct Region
+    {
+        // Lines of the last good source, and how many lines the new one
+        // adds or removes; `last` is `first - 1` for a pure insertion.
+        int first;
+        int last;
+        int delta;
+    };
+
+    bool load_inputs()
+    {
+        if (m_options.rewrite_path.has_value())
+        {
+            const std::optional<std::string> bytes = read_file(m_cwd / m_options.rewrite_path.value());
+            std::stringstream table(bytes.value_or(""));
+
+            if (!bytes.has_value() || !(m_rewrites = RewriteTable::load(table)).has_value())
+            {
+                m_err << "Invalid rewrite table " << m_cwd / m_options.rewrite_path.value() << "." << std::endl;
+                return false;
+            }
+        }
+
+        if (m_options.profile_path.has_value())
+        {
+            const std::optional<std::string> bytes = read_file(m_cwd / m_options.profile_path.value());
+            std::stringstream data(bytes.value_or(""));
+
+            if (!bytes.has_value() || !(m_profile = Profile::load(data)).has_value())
+            {
+                m_err << "Invalid profile " << m_cwd / m_options.profile_path.value() << "." << std::endl;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Blocks until the input is written, then lets a burst of events from
+    // the same save settle. Returns false if the watch broke.
+    static bool wait_for_change(const int fd, const std::filesystem::path &name)
+    {
+        alignas(inotify_event) char buffer[4096];
+        bool changed = false;
+
+        while (true)
+        {
+            pollfd poll_fd{.fd = fd, .events = POLLIN, .revents = 0};
+            const int ready = poll(&poll_fd, 1, changed ? 50 : -1);
+
+            if (ready < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (ready < 0)
+            {
+                return false;
+            }
+
+            if (ready == 0)
+            {
+                return true;
+            }
+
+            const ssize_t length = read(fd, buffer, sizeof(buffer));
+
+            for (ssize_t offset = 0; offset < length;)
+            {
+                const auto *event = reinterpret_cast<const inotify_event *>(buffer + offset);
+
+                if (event->len > 0 && name == event->name)
+                {
+                    changed = true;
+                }
+
+                offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+            }
+        }
+    }
+
+    static std::optional<std::string> read_file(const std::filesystem::path &path)
+    {
+        std::fstream file(path, std::ios::in | std::ios::binary);
+
+        if (!file)
+        {
+            return {};
+        }
+
+        std::stringstream bytes;
+        bytes << file.rdbuf();
+
+        return bytes.str();
+    }
+
+    static std::vector<std::string> split_lines(const std::string &text)
+    {
+        std::vector<std::string> lines;
+        std::stringstream stream(text);
+
+        for (std::string line; std::getline(stream, line);)
+        {
+            lines.push_back(std::move(line));
+        }
+
+        return lines;
+    }
+
+    // Whether each line, numbered from 1, starts inside a block comment.
+    // One extra entry covers the end of the file.
+    static std::vector<bool> comment_starts(const std::vector<std::string> &lines)
+    {
+        std::vector<bool> starts(lines.size() + 2, false);
+        bool in_comment = false;
+
+        for (size_t i = 0; i < lines.size(); i++)
+        {
+            starts[i + 1] = in_comment;
+            const std::string &line = lines[i];
+
+            for (size_t j = 0; j < line.size(); j++)
+            {
+                const char next = j + 1 < line.size() ? line[j + 1] : '\0';
+
+                if (in_comment && line[j] == '*' && next == '/')
+                {
+                    in_comment = false;
+                    j++;
+                }
+                else if (!in_comment && line[j] == '/' && next == '/')
+                {
+                    break;
+                }
+                else if (!in_comment && line[j] == '/' && next == '*')
+                {
+                    in_comment = true;
+                    j++;
+                }
+            }
+        }
+
+        starts[lines.size() + 1] = in_comment;
+
+        return starts;
+    }
+
+    static std::string join_lines(const std::vector<std::string> &lines, const int first, const int last)
+    {
+        std::string text;
+
+        for (int line = first; line <= last; line++)
+        {
+            text += lines[line - 1];
+            text += '\n';
+        }
+
+        return text;
+    }
+
+    // Lines from `first_line` on, parsed into items in `arena`, which must
+    // outlive this build.
+    static std::vector<Item> parse_items(std::string text, const int first_line, ArenaAllocator &arena)
+    {
+        Tokenizer tokenizer(std::move(text), first_line);
+        std::vector<Token> tokens = tokenizer.tokenize();
+        Parser parser(tokens, arena);
+        std::vector<Item> items;
+
+        while (parser.position() < tokens.size())
+        {
+            const int first = tokens[parser.position()].line;
+            std::variant<NodeFn *, NodeStmt *> node;
+
+            if (auto fn = parser.parse_fn())
+            {
+                node = fn.value();
+            }
+            else if (auto stmt = parser.parse_stmt())
+            {
+                node = stmt.value();
+            }
+            else
+            {
+                compile_error_at(tokens[parser.position()].line, "Invalid statement");
+            }
+
+            items.push_back({.first_line = first,
+                             .last_line = tokens[parser.position() - 1].line,
+                             .parsed_first_line = first,
+                             .node = node});
+        }
+
+        return items;
+    }
+
+    // The smallest run of old lines that covers every changed line and
+    // does not split an item or a block comment, in either version.
+    [[nodiscard]] Region damaged_region(const std::vector<std::string> &lines) const
+    {
+        const int old_count = static_cast<int>(m_lines.size());
+        const int new_count = static_cast<int>(lines.size());
+        int prefix = 0;
+        int suffix = 0;
+
+        while (prefix < std::min(old_count, new_count) && m_lines[prefix] == lines[prefix])
+        {
+            prefix++;
+        }
+
+        while (suffix < std::min(old_count, new_count) - prefix &&
+               m_lines[old_count - suffix - 1] == lines[new_count - suffix - 1])
+        {
+            suffix++;
+        }
+
+        const std::vector<bool> old_comments = comment_starts(m_lines);
+        const std::vector<bool> new_comments = comment_starts(lines);
+        Region region{.first = prefix + 1, .last = old_count - suffix, .delta = new_count - old_count};
+
+        for (bool grown = true; grown;)
+        {
+            grown = false;
+
+            for (const Item &item : m_items)
+            {
+                if (item.first_line <= region.last && item.last_line >= region.first &&
+                    (item.first_line < region.first || item.last_line > region.last))
+                {
+                    region.first = std::min(region.first, item.first_line);
+                    region.last = std::max(region.last, item.last_line);
+                    grown = true;
+                }
+            }
+
+            while (region.first > 1 && (old_comments[region.first] || new_comments[region.first]))
+            {
+                region.first--;
+                grown = true;
+            }
+
+            while (region.last < old_count &&
+                   (old_comments[region.last + 1] || new_comments[region.last + 1 + region.delta]))
+            {
+                region.last++;
+                grown = true;
+            }
+        }
+
+        return region;
+    }
+
+    // Parses the whole source again into a fresh pristine arena. The old
+    // arena and items are only replaced once the parse succeeds, so a
+    // failed parse leaves them intact for the next incremental one.
+    void parse_all(std::vector<std::string> lines, const std::string &source)
+    {
+        const size_t pristine_size = std::max(arena_size, source.size() * 64);
+        auto pristine = std::make_unique<ArenaAllocator>(pristine_size);
+        std::vector<Item> items = parse_items(source, 1, *pristine);
+
+        m_pristine_size = pristine_size;
+        m_pristine = std::move(pristine);
+        m_items = std::move(items);
+        m_lines = std::move(lines);
+        m_relexed = m_lines.size();
+        m_reparsed = m_items.size();
+    }
+
+    void parse_changes(std::vector<std::string> lines)
+    {
+        const Region region = damaged_region(lines);
+        std::vector<Item> items =
+            parse_items(join_lines(lines, region.first, region.last + region.delta), region.first, *m_pristine);
+
+        m_relexed = static_cast<size_t>(region.last + region.delta - region.first + 1);
+        m_reparsed = items.size();
+
+        std::vector<Item> merged;
+
+        for (const Item &item : m_items)
+        {
+            if (item.last_line < region.first)
+            {
+                merged.push_back(item);
+            }
+        }
+
+        merged.insert(merged.end(), items.begin(), items.end());
+
+        for (Item item : m_items)
+        {
+            if (item.first_line > region.last)
+            {
+                item.first_line += region.delta;
+                item.last_line += region.delta;
+                merged.push_back(item);
+            }
+        }
+
+        m_items = std::move(merged);
+        m_lines = std::move(lines);
+    }
+
+    void rebuild(const std::filesystem::path &file_path)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const std::optional<std::string> source = read_file(file_path);
+
+        if (!source.has_value())
+        {
+            m_err << "The file " << file_path << " does not exist." << std::endl;
+            return;
+        }
+
+        std::vector<std::string> lines = split_lines(source.value());
+
+        if (m_pristine != nullptr && lines == m_lines && !m_failed)
+        {
+            return;
+        }
+
+        try
+        {
+            // Replaced trees stay in the pristine arena until the next full
+            // parse, which happens once it is half full.
+            if (m_pristine == nullptr || m_pristine->bytes_used() * 2 > m_pristine_size)
+            {
+                parse_all(std::move(lines), source.value());
+            }
+            else
+            {
+                parse_changes(std::move(lines));
+            }
+
+            m_failed = !build();
+        }
+        catch (const CompileError &error)
+        {
+            m_err << error.what() << std::endl;
+            m_failed = true;
+        }
+
+        if (m_scratch != nullptr)
+        {
+            m_scratch->reset();
+        }
+
+        if (m_failed)
+        {
+            return;
+        }
+
+        const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+        m_out << "rebuilt " << m_output.string() << " in " << elapsed.count() << " ms (relexed " << m_relexed << " of "
+              << m_lines.size() << " lines, reparsed " << m_reparsed << " of " << m_items.size()
+              << " items, generated " << m_stmt_cache.misses() << " of " << m_stmt_cache.hits() + m_stmt_cache.misses()
+              << " statements)" << std::endl;
+    }
+
+    bool build()
+    {
+        if (m_scratch == nullptr || m_scratch_size < m_pristine_size)
+        {
+            m_scratch_size = m_pristine_size;
+            m_scratch = std::make_unique<ArenaAllocator>(m_scratch_size);
+        }
+
+        NodeProg prog;
+
+        for (const Item &item : m_items)
+        {
+            AstCloner cloner(*m_scratch, item.first_line - item.parsed_first_line);
+
+            if (const auto fn = std::get_if<NodeFn *>(&item.node))
+            {
+                prog.fns.push_back(cloner.clone_fn(*fn));
+            }
+            else
+            {
+                prog.stmts.push_back(cloner.clone_stmt(std::get<NodeStmt *>(item.node)));
+            }
+        }
+
+        Inliner(prog, *m_scratch).run();
+        CommonSubexprEliminator(prog, *m_scratch).run();
+        DeadStoreEliminator(prog).run();
+
+        const std::optional<std::string> profile_path =
+            m_options.instrument ? std::optional(m_output.string() + ".prof") : std::nullopt;
+        const std::optional<std::string> debug_file =
+            m_options.debug ? std::optional(std::filesystem::absolute(m_cwd / m_input).lexically_normal().string()) : std::nullopt;
+
+        m_stmt_cache.begin_build();
+
+        FrameLayout layout(prog);
+        Generator generator(prog, layout.layout_prog(),
+                            {.rewrites = m_rewrites.has_value() ? &m_rewrites.value() : nullptr,
+                             .profile_path = profile_path,
+                             .profile = m_profile.has_value() ? &m_profile.value() : nullptr,
+                             .debug_file = debug_file,
+                             .stmt_cache = &m_stmt_cache,
+                             .vector_isa = m_options.vector_isa});
+        const std::string assembly = generator.gen_prog();
+
+        m_stmt_cache.end_build();
+
+        Driver driver(*m_scratch, m_out, m_err);
+
+        return driver.assemble(m_options, assembly, generator.has_writable_data(), m_cwd / m_output);
+    }
+
+    const Options &m_options;
+    const std::filesystem::path m_input;
+    const std::filesystem::path m_output;
+    const std::filesystem::path m_cwd;
+    std::ostream &m_out;
+    std::ostream &m_err;
+    std::optional<RewriteTable> m_rewrites;
+    std::optional<Profile> m_profile;
+    // The last source that parsed, and its items in order.
+    std::vector<std::string> m_lines{};
+    std::vector<Item> m_items{};
+    std::unique_ptr<ArenaAllocator> m_pristine;
+    size_t m_pristine_size = 0;
+    std::unique_ptr<ArenaAllocator> m_scratch;
+    size_t m_scratch_size = 0;
+    StmtCodeCache m_stmt_cache;
+    bool m_failed = false;
+    size_t m_relexed = 0;
+    size_t m_reparsed = 0;
+};
@@ -0,0 +1,81 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../src/tokenization.hpp"
+#include "../src/parser.hpp"
+#include "../src/superopt.hpp"
+
+// Runs the superoptimizer and checks every rule it emits against the shape
+// it rewrites, on that shape's boundary vectors and a large random set. A
+// table from `hydro --superopt` can be checked instead by naming it.
+
+int main(int argc, char *argv[])
+{
+    if (argc > 2)
+    {
+        std::cerr << "Usage: superopt_rules [<table>]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    Superoptimizer superopt;
+    RewriteTable table;
+
+    if (argc == 2)
+    {
+        std::ifstream file(argv[1]);
+        std::optional<RewriteTable> loaded = RewriteTable::load(file);
+
+        if (!file.eof() || !loaded.has_value())
+        {
+            std::cerr << "Invalid rewrite table: " << argv[1] << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        table = std::move(loaded).value();
+    }
+    else
+    {
+        SuperoptStats stats;
+        table = superopt.search(stats);
+    }
+
+    // The checker itself must reject a rule that is only wrong where
+    // `x + 2` reaches a multiple of 32 or wraps.
+    RewriteTable wrong;
+    wrong.add("((x+2)/32)", {"add rax, 1", "shr rax, 5"});
+
+    if (superopt.check(wrong).size() != 1)
+    {
+        std::cerr << "The checker accepted a wrong rule for ((x+2)/32)." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const std::vector<std::string> failures = superopt.check(table);
+
+    for (const std::string &key : failures)
+    {
+        std::cerr << "wrong rule: " << key << "\t";
+
+        for (const std::string &instr : *table.find(key))
+        {
+            std::cerr << instr << "; ";
+        }
+
+        std::cerr << std::endl;
+    }
+
+    if (!failures.empty())
+    {
+        std::cerr << failures.size() << " of " << table.size() << " rules are wrong." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << table.size() << " rules checked." << std::endl;
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,110 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/teller.hpp"
+
+// Compiles the same programs on many threads at once through the library
+// and checks every result against one compiled alone. Any state shared
+// between compiles, such as descriptors handed to nasm and ld, shows up as
+// a failed or different result.
+
+namespace
+{
+    const std::vector<std::string> programs = {
+        "let x = 7;\nexit(x * 6);\n",
+        "fn square(x) {\n    return x * x;\n}\n\nexit(square(3) + square(4));\n",
+        "let i = 0;\nwhile (i < 10) {\n    print(i);\n    i = i + 1;\n}\n\nexit(0);\n",
+        "let a = 5;\nif (a - 5) {\n    exit(1);\n} elif (a) {\n    exit(2);\n}\n\nexit(3);\n",
+    };
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    teller::CompileOptions options{.output = teller::Output::assembly};
+    int threads = 8;
+    int rounds = 25;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--executable") == 0)
+        {
+            options.output = teller::Output::executable;
+        }
+        else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            threads = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--rounds") == 0 && i + 1 < argc)
+        {
+            rounds = std::atoi(argv[++i]);
+        }
+        else
+        {
+            std::cerr << "Usage: teller_threads [--executable] [--threads <n>] [--rounds <n>]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<std::string> expected;
+
+    for (const std::string &program : programs)
+    {
+        const teller::CompileResult result = teller::compile(program, options);
+
+        if (!result.ok())
+        {
+            std::cerr << "Unable to compile a test program: " << result.diagnostics.front().message << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        expected.push_back(result.output);
+    }
+
+    std::mutex mutex;
+    int failures = 0;
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]
+                             {
+                                 for (int round = 0; round < rounds; round++)
+                                 {
+                                     // Threads start on different programs so that
+                                     // different output sizes overlap.
+                                     const size_t index = static_cast<size_t>(t + round) % programs.size();
+                                     const teller::CompileResult result = teller::compile(programs[index], options);
+
+                                     if (result.ok() && result.output == expected[index])
+                                     {
+                                         continue;
+                                     }
+
+                                     const std::lock_guard lock(mutex);
+                                     failures++;
+                                     std::cerr << "thread " << t << ", program " << index << ": "
+                                               << (result.ok() ? "different output" : result.diagnostics.front().message)
+                                               << std::endl;
+                                 } });
+    }
+
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    if (failures > 0)
+    {
+        std::cerr << failures << " of " << threads * rounds << " concurrent compiles failed." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << threads * rounds << " concurrent compiles matched." << std::endl;
+
+    return EXIT_SUCCESS;
+}